@@ -0,0 +1,632 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+// Hardware transcoding through the core library, see gmp-droid-core.h.
+// Input is an IVF file or an H.264 Annex B stream, output is IVF for VP8
+// and VP9 and Annex B for H.264. Decoded pictures whose layout is the one
+// the encoder takes are handed over in the decoder's buffer, so the only
+// copy is the encoder's input packing. Other layouts go through I420.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gmp-droid-core.h"
+
+using namespace std;
+
+// Packets queued on the decoder before waiting for it
+#define MAX_PACKETS_IN_FLIGHT 8
+// Encoder output silence after which the remaining frames are given up
+#define ENCODER_FLUSH_TIMEOUT_S 2
+
+typedef struct {
+  const char *input = nullptr;
+  const char *output = nullptr;
+  // Output codec, the input codec if not given
+  const char *codec = nullptr;
+  uint32_t bitrate = 0;
+  uint32_t fps = 30;
+  int32_t width = 0;
+  int32_t height = 0;
+  int workers = 4;
+  // Always convert through I420, for comparison
+  bool convert = false;
+} options_t;
+
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  int64_t ts;
+  bool keyFrame;
+} unit_t;
+
+static double
+nowS ()
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool
+parseCodec (const char *name, DroidCodecType & codec)
+{
+  if (!strcmp (name, "h264"))
+    codec = DROID_CODEC_H264;
+  else if (!strcmp (name, "vp8"))
+    codec = DROID_CODEC_VP8;
+  else if (!strcmp (name, "vp9"))
+    codec = DROID_CODEC_VP9;
+  else
+    return false;
+  return true;
+}
+
+static uint32_t
+readLE (const uint8_t *p, int bytes)
+{
+  uint32_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+static void
+writeLE (FILE *out, uint64_t value, int bytes)
+{
+  for (int i = 0; i < bytes; i++)
+    fputc ((value >> (8 * i)) & 0xff, out);
+}
+
+static bool
+vp8KeyFrame (const uint8_t *buf, size_t size)
+{
+  return size > 0 && !(buf[0] & 1);
+}
+
+// Uncompressed header up to frame_type
+static bool
+vp9KeyFrame (const uint8_t *buf, size_t size)
+{
+  if (!size)
+    return false;
+  const int profile = ((buf[0] >> 5) & 1) | (((buf[0] >> 4) & 1) << 1);
+  int bit = profile == 3 ? 2 : 3;
+  // show_existing_frame
+  if ((buf[0] >> bit) & 1)
+    return false;
+  bit--;
+  return !((buf[0] >> bit) & 1);
+}
+
+static bool
+readIvf (const uint8_t *buf, size_t size, DroidCodecType & codec,
+    int32_t & width, int32_t & height, vector<unit_t> & units)
+{
+  if (size < 32 || memcmp (buf, "DKIF", 4))
+    return false;
+
+  const size_t headerSize = readLE (buf + 6, 2);
+  if (!memcmp (buf + 8, "VP80", 4))
+    codec = DROID_CODEC_VP8;
+  else if (!memcmp (buf + 8, "VP90", 4))
+    codec = DROID_CODEC_VP9;
+  else if (!memcmp (buf + 8, "H264", 4))
+    codec = DROID_CODEC_H264;
+  else
+    return false;
+  width = readLE (buf + 12, 2);
+  height = readLE (buf + 14, 2);
+  const uint32_t rate = readLE (buf + 16, 4);
+  const uint32_t scale = readLE (buf + 20, 4);
+
+  size_t pos = headerSize;
+  while (pos + 12 <= size) {
+    const size_t frameSize = readLE (buf + pos, 4);
+    const uint64_t pts = readLE (buf + pos + 4, 4)
+        | ((uint64_t) readLE (buf + pos + 8, 4) << 32);
+    pos += 12;
+    if (pos + frameSize > size)
+      break;
+
+    unit_t unit;
+    unit.data = buf + pos;
+    unit.size = frameSize;
+    unit.ts = rate ? pts * 1000000 * scale / rate : 0;
+    if (codec == DROID_CODEC_VP8)
+      unit.keyFrame = vp8KeyFrame (unit.data, unit.size);
+    else if (codec == DROID_CODEC_VP9)
+      unit.keyFrame = vp9KeyFrame (unit.data, unit.size);
+    else
+      unit.keyFrame = units.empty ();
+    units.push_back (unit);
+    pos += frameSize;
+  }
+  return true;
+}
+
+// Position of the next three byte start code at or after pos, or size
+static size_t
+nextStartCode (const uint8_t *buf, size_t size, size_t pos)
+{
+  for (; pos + 3 <= size; pos++) {
+    if (buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 1)
+      return pos;
+  }
+  return size;
+}
+
+// Split an Annex B stream into access units. A unit starts at an access
+// unit delimiter, SPS, PPS or SEI, or at the first slice of a picture,
+// following the slices of the previous one.
+static void
+readAnnexB (const uint8_t *buf, size_t size, uint32_t fps,
+    vector<unit_t> & units)
+{
+  size_t unitStart = nextStartCode (buf, size, 0);
+  bool hasSlice = false;
+  bool keyFrame = false;
+
+  auto emit = [&] (size_t end) {
+    unit_t unit;
+    unit.data = buf + unitStart;
+    unit.size = end - unitStart;
+    unit.ts = (int64_t) units.size () * 1000000 / fps;
+    unit.keyFrame = keyFrame;
+    units.push_back (unit);
+  };
+
+  size_t pos = unitStart;
+  while (pos < size) {
+    // Include the leading zero of a four byte start code
+    const size_t nalStart = pos > 0 && buf[pos - 1] == 0 ? pos - 1 : pos;
+    const size_t header = pos + 3;
+    if (header >= size)
+      break;
+
+    const int type = buf[header] & 0x1f;
+    const bool slice = type >= 1 && type <= 5;
+    const bool firstSlice = slice && header + 1 < size
+        && (buf[header + 1] & 0x80);
+    if (hasSlice && (type == 6 || type == 7 || type == 8 || type == 9
+            || firstSlice)) {
+      emit (nalStart);
+      unitStart = nalStart;
+      hasSlice = false;
+      keyFrame = false;
+    }
+    hasSlice = hasSlice || slice;
+    keyFrame = keyFrame || type == 5;
+    pos = nextStartCode (buf, size, header);
+  }
+  if (hasSlice)
+    emit (size);
+}
+
+class Transcoder : public DroidDecoderListener, public DroidEncoderListener
+{
+public:
+  Transcoder (const options_t & options, DroidCodecType outputCodec,
+      FILE *output)
+      : m_options (options), m_outputCodec (outputCodec), m_output (output),
+        m_decoder (DroidDecoder::Create (this)),
+        m_encoder (DroidEncoder::Create (this))
+  {
+  }
+
+  ~Transcoder ()
+  {
+    delete m_decoder;
+    delete m_encoder;
+  }
+
+  bool Init (DroidCodecType codec, int32_t width, int32_t height)
+  {
+    DroidDecoderSettings settings;
+    settings.codec = codec;
+    settings.width = width;
+    settings.height = height;
+    settings.fps = m_options.fps;
+    return m_decoder->Init (settings);
+  }
+
+  // The input is mapped for the whole run, so packets need no release
+  bool Decode (const unit_t & unit)
+  {
+    {
+      unique_lock<mutex> lock (m_lock);
+      m_wake.wait (lock, [this] {
+            return m_inFlight < MAX_PACKETS_IN_FLIGHT || m_failed;
+          });
+      if (m_failed)
+        return false;
+      m_inFlight++;
+    }
+
+    DroidPacket packet;
+    packet.data = (uint8_t *) unit.data;
+    packet.size = unit.size;
+    packet.ts = unit.ts;
+    packet.duration = 1000000 / m_options.fps;
+    packet.keyFrame = unit.keyFrame;
+    m_decoder->Decode (packet);
+    return true;
+  }
+
+  // Drain the decoder and wait for the encoder to catch up. droidmedia
+  // encoders can't be drained, so frames still in the encoder after the
+  // timeout are lost.
+  bool Finish ()
+  {
+    m_decoder->Drain ();
+
+    unique_lock<mutex> lock (m_lock);
+    m_wake.wait (lock, [this] { return m_drained || m_failed; });
+
+    uint64_t encoded = m_encoded;
+    while (!m_failed && m_encoded < m_submitted) {
+      m_wake.wait_for (lock, chrono::seconds (ENCODER_FLUSH_TIMEOUT_S));
+      if (m_encoded == encoded) {
+        cerr << "Encoder stalled, " << m_submitted - m_encoded
+             << " frames lost\n";
+        break;
+      }
+      encoded = m_encoded;
+    }
+    lock.unlock ();
+
+    m_decoder->Stop ();
+    m_encoder->Stop ();
+    return !m_failed;
+  }
+
+  void Report (double seconds)
+  {
+    lock_guard<mutex> guard (m_lock);
+    printf ("Transcoded %llu frames in %.2f s: %.1f fps\n",
+        (unsigned long long) m_encoded, seconds,
+        seconds > 0 ? m_encoded / seconds : 0.0);
+    printf ("  handed over in the decoder's %s layout: %llu, converted: %llu\n",
+        m_layout == DROID_LAYOUT_NV12 ? "NV12" : "I420",
+        (unsigned long long) m_direct, (unsigned long long) m_converted);
+    printf ("  output: %llu bytes\n", (unsigned long long) m_bytes);
+  }
+
+  // Called on a codec thread
+  void Decoded (DroidDecodedFrame & frame) override
+  {
+    if (!m_encoderStarted && !StartEncoder (frame)) {
+      Fail ("Can't create the encoder");
+      return;
+    }
+
+    DroidPicture picture;
+    DroidPictureLayout layout = DROID_LAYOUT_I420;
+    const bool direct = !m_options.convert
+        && frame.Planes (layout, picture.planes)
+        && layout == m_encoder->InputLayout ();
+
+    if (direct) {
+      picture.layout = layout;
+      picture.width = frame.Width ();
+      picture.height = frame.Height ();
+      picture.ts = frame.Timestamp ();
+      picture.duration = frame.Duration ();
+      // The planes are only valid until this call returns
+      picture.release = HandedOver;
+      picture.opaque = this;
+      m_handedOver = false;
+    } else if (!frame.Convert (m_pool, picture)) {
+      Fail ("Colour conversion failed");
+      return;
+    }
+
+    {
+      lock_guard<mutex> guard (m_lock);
+      m_submitted++;
+      if (direct) {
+        m_direct++;
+        m_layout = layout;
+      } else {
+        m_converted++;
+      }
+    }
+
+    if (!m_encoder->Encode (picture)) {
+      Fail ("Encoding failed");
+      return;
+    }
+
+    if (direct) {
+      unique_lock<mutex> lock (m_lock);
+      m_wake.wait (lock, [this] { return m_handedOver || m_failed; });
+    }
+  }
+
+  void InputConsumed () override
+  {
+    lock_guard<mutex> guard (m_lock);
+    m_inFlight--;
+    m_wake.notify_all ();
+  }
+
+  void DrainComplete () override
+  {
+    lock_guard<mutex> guard (m_lock);
+    m_drained = true;
+    m_wake.notify_all ();
+  }
+
+  void ResetComplete () override
+  {
+  }
+
+  // DroidDecoderListener and DroidEncoderListener
+  void Error (DroidCoreError error) override
+  {
+    Fail ("Codec error " + to_string (error));
+  }
+
+  // Called on a codec thread
+  void Encoded (const DroidPacket & packet) override
+  {
+    lock_guard<mutex> guard (m_lock);
+    if (m_outputCodec != DROID_CODEC_H264) {
+      writeLE (m_output, packet.size, 4);
+      writeLE (m_output, packet.ts, 8);
+    }
+    fwrite (packet.data, 1, packet.size, m_output);
+    m_bytes += packet.size;
+    packet.Release ();
+    if (packet.complete) {
+      m_encoded++;
+      m_wake.notify_all ();
+    }
+  }
+
+  uint64_t EncodedFrames ()
+  {
+    lock_guard<mutex> guard (m_lock);
+    return m_encoded;
+  }
+
+private:
+  static void HandedOver (void *opaque)
+  {
+    Transcoder *self = static_cast<Transcoder *> (opaque);
+    lock_guard<mutex> guard (self->m_lock);
+    self->m_handedOver = true;
+    self->m_wake.notify_all ();
+  }
+
+  // The encoder takes the size of the decoded pictures
+  bool StartEncoder (DroidDecodedFrame & frame)
+  {
+    DroidEncoderSettings settings;
+    settings.codec = m_outputCodec;
+    settings.width = frame.Width ();
+    settings.height = frame.Height ();
+    settings.fps = m_options.fps;
+    settings.bitrate = m_options.bitrate ? m_options.bitrate
+        : (uint32_t) ((uint64_t) settings.width * settings.height
+            * settings.fps / 10000);
+    settings.mode = DROID_ENCODER_RECORDING;
+    settings.cores = max (1u, thread::hardware_concurrency ());
+    if (!m_encoder->Init (settings))
+      return false;
+
+    cerr << "Encoding " << settings.width << "x" << settings.height
+         << " at " << settings.bitrate << " kbps\n";
+    if (m_outputCodec != DROID_CODEC_H264)
+      WriteIvfHeader (settings.width, settings.height);
+    m_encoderStarted = true;
+    return true;
+  }
+
+  // The frame count is filled in by main () once it is known
+  void WriteIvfHeader (int32_t width, int32_t height)
+  {
+    lock_guard<mutex> guard (m_lock);
+    fwrite ("DKIF", 1, 4, m_output);
+    writeLE (m_output, 0, 2);
+    writeLE (m_output, 32, 2);
+    fwrite (m_outputCodec == DROID_CODEC_VP8 ? "VP80" : "VP90", 1, 4,
+        m_output);
+    writeLE (m_output, width, 2);
+    writeLE (m_output, height, 2);
+    // Timestamps are in microseconds
+    writeLE (m_output, 1000000, 4);
+    writeLE (m_output, 1, 4);
+    writeLE (m_output, 0, 4);
+    writeLE (m_output, 0, 4);
+  }
+
+  void Fail (const string & reason)
+  {
+    lock_guard<mutex> guard (m_lock);
+    if (!m_failed)
+      cerr << reason << "\n";
+    m_failed = true;
+    m_wake.notify_all ();
+  }
+
+  const options_t & m_options;
+  const DroidCodecType m_outputCodec;
+  FILE *m_output;
+  DroidDecoder *m_decoder;
+  DroidEncoder *m_encoder;
+  DroidBufferPool m_pool;
+  // Only used on the decoder's codec thread
+  bool m_encoderStarted = false;
+
+  mutex m_lock;
+  condition_variable m_wake;
+  int m_inFlight = 0;
+  bool m_handedOver = false;
+  bool m_drained = false;
+  bool m_failed = false;
+  DroidPictureLayout m_layout = DROID_LAYOUT_I420;
+  uint64_t m_submitted = 0;
+  uint64_t m_encoded = 0;
+  uint64_t m_direct = 0;
+  uint64_t m_converted = 0;
+  uint64_t m_bytes = 0;
+};
+
+static void
+usage (const char *name)
+{
+  cerr << "Usage: " << name << " [OPTIONS] INPUT OUTPUT\n"
+       << "INPUT is IVF (VP8, VP9, H.264) or an H.264 Annex B stream.\n"
+       << "  -c CODEC    output codec: h264, vp8 or vp9 (default: input)\n"
+       << "  -b KBPS     output bitrate (default: from size and rate)\n"
+       << "  -r FPS      frame rate (default 30)\n"
+       << "  -s WxH      input size, needed for Annex B input\n"
+       << "  -w COUNT    worker threads (default 4)\n"
+       << "  -i          always convert through I420\n";
+}
+
+int
+main (int argc, char **argv)
+{
+  options_t options;
+  int opt;
+  while ((opt = getopt (argc, argv, "c:b:r:s:w:i")) != -1) {
+    switch (opt) {
+      case 'c':
+        options.codec = optarg;
+        break;
+      case 'b':
+        options.bitrate = atoi (optarg);
+        break;
+      case 'r':
+        options.fps = atoi (optarg);
+        break;
+      case 's':
+        if (sscanf (optarg, "%dx%d", &options.width, &options.height) != 2) {
+          usage (argv[0]);
+          return 1;
+        }
+        break;
+      case 'w':
+        options.workers = atoi (optarg);
+        break;
+      case 'i':
+        options.convert = true;
+        break;
+      default:
+        usage (argv[0]);
+        return 1;
+    }
+  }
+  if (argc - optind != 2 || options.fps == 0) {
+    usage (argv[0]);
+    return 1;
+  }
+  options.input = argv[optind];
+  options.output = argv[optind + 1];
+
+  // Mapped copy on write, as the decoder may rewrite packets in place
+  int fd = open (options.input, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat (fd, &st) != 0 || st.st_size == 0) {
+    cerr << "Can't read " << options.input << "\n";
+    return 1;
+  }
+  const size_t size = st.st_size;
+  uint8_t *input = (uint8_t *) mmap (nullptr, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (input == MAP_FAILED) {
+    cerr << "Can't map " << options.input << "\n";
+    return 1;
+  }
+
+  DroidCodecType inputCodec = DROID_CODEC_H264;
+  int32_t width = options.width;
+  int32_t height = options.height;
+  vector<unit_t> units;
+  if (!readIvf (input, size, inputCodec, width, height, units)) {
+    if (!width || !height) {
+      cerr << "Annex B input needs the size, see -s\n";
+      return 1;
+    }
+    readAnnexB (input, size, options.fps, units);
+  }
+  if (units.empty ()) {
+    cerr << "No frames in " << options.input << "\n";
+    return 1;
+  }
+
+  DroidCodecType outputCodec = inputCodec;
+  if (options.codec && !parseCodec (options.codec, outputCodec)) {
+    usage (argv[0]);
+    return 1;
+  }
+
+  FILE *output = fopen (options.output, "wb");
+  if (!output) {
+    cerr << "Can't write " << options.output << "\n";
+    return 1;
+  }
+
+  DroidCoreOptions coreOptions;
+  coreOptions.workers = options.workers;
+  string error;
+  if (!DroidCoreInit (coreOptions, error)) {
+    cerr << "Hardware codecs not available: " << error << "\n";
+    return 1;
+  }
+
+  bool ok;
+  uint64_t encoded;
+  {
+    Transcoder transcoder (options, outputCodec, output);
+    if (!transcoder.Init (inputCodec, width, height)) {
+      cerr << "Can't create the decoder\n";
+      DroidCoreShutdown ();
+      return 1;
+    }
+
+    const double start = nowS ();
+    ok = true;
+    for (const unit_t & unit : units) {
+      if (!transcoder.Decode (unit)) {
+        ok = false;
+        break;
+      }
+    }
+    ok = transcoder.Finish () && ok;
+    transcoder.Report (nowS () - start);
+    encoded = transcoder.EncodedFrames ();
+  }
+  DroidCoreShutdown ();
+
+  if (outputCodec != DROID_CODEC_H264) {
+    fseek (output, 24, SEEK_SET);
+    writeLE (output, encoded, 4);
+  }
+  fclose (output);
+  munmap (input, size);
+  return ok ? 0 : 1;
+}
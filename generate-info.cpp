@@ -8,12 +8,32 @@
 **
 ****************************************************************************/
 
+#include "droidmedia.h"
 #include "droidmediacodec.h"
+#include "droidmediaconstants.h"
+#include <cstring>
 #include <iostream>
+#include <sstream>
 #include <vector>
 
 using namespace std;
 
+// Instances created per probe before giving up looking for the limit
+#define MAX_PROBE_INSTANCES 16
+
+typedef struct {
+  int32_t width;
+  int32_t height;
+} resolution_t;
+
+// Common video sizes, in increasing order
+static const resolution_t probeResolutions[] = {
+  { 640, 480 },
+  { 1280, 720 },
+  { 1920, 1080 },
+  { 3840, 2160 },
+};
+
 typedef struct {
   std::string androidName;
   std::string gmpName;
@@ -40,6 +60,106 @@ isSupportedEncoder (const codec_desc_t& codec)
   return isSupported (codec, true);
 }
 
+DroidMediaCodec *
+createDecoder (const codec_desc_t& codec, const resolution_t& size)
+{
+  DroidMediaCodecDecoderMetaData meta;
+  memset (&meta, 0, sizeof (meta));
+  meta.parent.type = codec.androidName.c_str ();
+  meta.parent.flags = static_cast <DroidMediaCodecFlags> (
+      DROID_MEDIA_CODEC_HW_ONLY | DROID_MEDIA_CODEC_NO_MEDIA_BUFFER);
+  meta.parent.width = size.width;
+  meta.parent.height = size.height;
+  meta.parent.fps = 30;
+  return droid_media_codec_create_decoder (&meta);
+}
+
+DroidMediaCodec *
+createEncoder (const codec_desc_t& codec, const resolution_t& size)
+{
+  DroidMediaCodecEncoderMetaData meta;
+  memset (&meta, 0, sizeof (meta));
+  meta.parent.type = codec.androidName.c_str ();
+  meta.parent.flags = static_cast <DroidMediaCodecFlags> (DROID_MEDIA_CODEC_HW_ONLY);
+  meta.parent.width = size.width;
+  meta.parent.height = size.height;
+  meta.parent.fps = 30;
+  meta.bitrate = size.width * size.height * 3;
+  meta.stride = size.width;
+  meta.slice_height = size.height;
+  meta.meta_data = false;
+
+  // The first planar or semi-planar format, as the plugin picks
+  DroidMediaColourFormatConstants constants;
+  droid_media_colour_format_constants_init (&constants);
+  uint32_t formats[32];
+  unsigned int count = droid_media_codec_get_supported_color_formats (
+      &meta.parent, 1, formats, 32);
+  meta.color_format = -1;
+  for (unsigned int i = 0; i < count && meta.color_format == -1; i++) {
+    int format = static_cast<int>(formats[i]);
+    if (format == constants.OMX_COLOR_FormatYUV420Planar
+        || format == constants.OMX_COLOR_FormatYUV420SemiPlanar)
+      meta.color_format = format;
+  }
+  if (meta.color_format == -1)
+    return nullptr;
+  return droid_media_codec_create_encoder (&meta);
+}
+
+// Start instances of the codec at the size until one fails, and return
+// how many ran at once
+int
+probeInstances (const codec_desc_t& codec, const resolution_t& size,
+    bool isEncoder)
+{
+  std::vector<DroidMediaCodec *> instances;
+
+  while (instances.size () < MAX_PROBE_INSTANCES) {
+    DroidMediaCodec *instance = isEncoder ? createEncoder (codec, size)
+        : createDecoder (codec, size);
+    if (!instance)
+      break;
+    if (!droid_media_codec_start (instance)) {
+      droid_media_codec_destroy (instance);
+      break;
+    }
+    instances.push_back (instance);
+  }
+
+  for (DroidMediaCodec *instance : instances) {
+    droid_media_codec_stop (instance);
+    droid_media_codec_destroy (instance);
+  }
+  return instances.size ();
+}
+
+// Limits of one codec as "h264[640x480=8:1280x720=4:...]". A size the
+// codec can't run at all ends the probe, as larger ones won't run either.
+std::string
+probeCodec (const codec_desc_t& codec, bool isEncoder)
+{
+  std::ostringstream limits;
+  bool first = true;
+
+  limits << codec.gmpName << "[";
+  for (const resolution_t& size : probeResolutions) {
+    int count = probeInstances (codec, size, isEncoder);
+    if (!first)
+      limits << ":";
+    first = false;
+    limits << size.width << "x" << size.height << "=";
+    if (count == MAX_PROBE_INSTANCES)
+      limits << count << "+";
+    else
+      limits << count;
+    if (!count)
+      break;
+  }
+  limits << "]";
+  return limits.str ();
+}
+
 void
 printSupportedApi (std::string api, std::vector<std::string> codecs)
 {
@@ -59,6 +179,18 @@ printSupportedApi (std::string api, std::vector<std::string> codecs)
   cout << "]";
 }
 
+std::string
+joinLimits (const std::vector<std::string>& limits)
+{
+  std::string joined;
+  for (const std::string& codec : limits) {
+    if (!joined.empty ())
+      joined += ", ";
+    joined += codec;
+  }
+  return joined;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -69,14 +201,28 @@ main (int argc, char **argv)
   };
   std::vector<std::string> supportedDecoders;
   std::vector<std::string> supportedEncoders;
+  std::vector<std::string> decoderLimits;
+  std::vector<std::string> encoderLimits;
+
+  // Codecs can only be created once droidmedia is up
+  const bool probe = droid_media_init ();
 
   for (codec_desc_t codec : codecs) {
-    if (isSupportedDecoder (codec))
+    if (isSupportedDecoder (codec)) {
       supportedDecoders.push_back (codec.gmpName);
-    if (isSupportedEncoder (codec))
+      if (probe)
+        decoderLimits.push_back (probeCodec (codec, false));
+    }
+    if (isSupportedEncoder (codec)) {
       supportedEncoders.push_back (codec.gmpName);
+      if (probe)
+        encoderLimits.push_back (probeCodec (codec, true));
+    }
   }
 
+  if (probe)
+    droid_media_deinit ();
+
   cout << "Name: gmp-droid\n"
        << "Description: gst-droid GMP plugin for Gecko\n"
        << "Version: 0.1\n";
@@ -86,4 +232,11 @@ main (int argc, char **argv)
   cout << ", ";
   printSupportedApi ("encode-video", supportedEncoders);
   cout << "\n";
+
+  // Hardware instances that can be started at once, per codec and size.
+  // Gecko ignores keys it doesn't know.
+  if (probe) {
+    cout << "Max-Decoders: " << joinLimits (decoderLimits) << "\n"
+         << "Max-Encoders: " << joinLimits (encoderLimits) << "\n";
+  }
 }
@@ -0,0 +1,217 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include "gmp-droid-bitstream.h"
+
+bool
+DroidParseVP9Superframe (const uint8_t * buf, uint32_t size,
+    std::vector<DroidVP9SubFrame> & frames)
+{
+  frames.clear ();
+  if (size < 1)
+    return false;
+
+  // The index is marked by 0b110xxxxx at both its start and end
+  const uint8_t marker = buf[size - 1];
+  if ((marker & 0xe0) != 0xc0)
+    return false;
+
+  const uint32_t count = (marker & 0x7) + 1;
+  const uint32_t mag = ((marker >> 3) & 0x3) + 1;
+  const uint32_t indexSize = 2 + mag * count;
+  if (size < indexSize || buf[size - indexSize] != marker)
+    return false;
+
+  const uint8_t *p = buf + size - indexSize + 1;
+  const uint32_t dataSize = size - indexSize;
+  uint32_t offset = 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t frameSize = 0;
+    for (uint32_t b = 0; b < mag; b++)
+      frameSize |= (uint32_t) (*p++) << (b * 8);
+
+    if (frameSize == 0 || frameSize > dataSize - offset) {
+      frames.clear ();
+      return false;
+    }
+
+    DroidVP9SubFrame frame;
+    frame.offset = offset;
+    frame.size = frameSize;
+    frame.shown = DroidVP9FrameShown (buf + offset, frameSize);
+    frames.push_back (frame);
+    offset += frameSize;
+  }
+
+  return true;
+}
+
+bool
+DroidVP9FrameShown (const uint8_t * buf, uint32_t size)
+{
+  if (size < 1)
+    return false;
+
+  // Uncompressed header: frame_marker(2) profile_low_bit(1)
+  // profile_high_bit(1) [reserved_zero(1) for profile 3]
+  // show_existing_frame(1) [frame_to_show(3)] frame_type(1) show_frame(1)
+  uint32_t bits = buf[0] << 8 | (size > 1 ? buf[1] : 0);
+  int pos = 15;
+  auto read = [&bits, &pos] () { return (bits >> pos--) & 1; };
+
+  pos -= 2;                     // frame_marker
+  int profile = read ();
+  profile |= read () << 1;
+  if (profile == 3)
+    pos--;                      // reserved_zero
+  if (read ())                  // show_existing_frame
+    return true;
+  pos--;                        // frame_type
+  return read ();               // show_frame
+}
+
+// Exp-Golomb ue(v) at the start of a NAL payload, skipping emulation
+// prevention bytes
+static bool
+ReadH264Ue (const uint8_t * buf, uint32_t size, uint32_t & value)
+{
+  uint32_t pos = 0, zeros = 0;
+  int bit = -1;
+  uint8_t byte = 0;
+  auto read = [&] () -> int {
+    if (bit < 0) {
+      if (pos >= size)
+        return -1;
+      if (zeros >= 2 && buf[pos] == 3) {
+        zeros = 0;
+        if (++pos >= size)
+          return -1;
+      }
+      byte = buf[pos++];
+      zeros = byte ? 0 : zeros + 1;
+      bit = 7;
+    }
+    return (byte >> bit--) & 1;
+  };
+
+  int leadingZeros = 0;
+  int b;
+  while ((b = read ()) == 0) {
+    if (++leadingZeros > 31)
+      return false;
+  }
+  if (b < 0)
+    return false;
+  value = 0;
+  for (int i = 0; i < leadingZeros; i++) {
+    if ((b = read ()) < 0)
+      return false;
+    value = value << 1 | b;
+  }
+  value += (1u << leadingZeros) - 1;
+  return true;
+}
+
+bool
+DroidH264LastSliceMb (const uint8_t * buf, uint32_t size, uint32_t & mb)
+{
+  bool found = false;
+  for (uint32_t i = 0; i + 3 < size; i++) {
+    if (buf[i] != 0 || buf[i + 1] != 0 || buf[i + 2] != 1)
+      continue;
+    const uint8_t *nal = buf + i + 3;
+    const uint32_t nalType = nal[0] & 0x1f;
+    // Coded slices, non-IDR and IDR
+    if ((nalType == 1 || nalType == 5)
+        && ReadH264Ue (nal + 1, size - i - 4, mb))
+      found = true;
+    i += 2;
+  }
+  return found;
+}
+
+bool
+DroidValidateH264Nal (const uint8_t * nal, uint32_t size)
+{
+  return size > 0 && (nal[0] & 0x80) == 0;
+}
+
+bool
+DroidValidateH264AnnexB (const uint8_t * buf, uint32_t size)
+{
+  uint32_t start;
+  if (size >= 4 && buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] == 1)
+    start = 4;
+  else if (size >= 3 && buf[0] == 0 && buf[1] == 0 && buf[2] == 1)
+    start = 3;
+  else
+    return false;
+  return DroidValidateH264Nal (buf + start, size - start);
+}
+
+bool
+DroidValidateVP8Frame (const uint8_t * buf, uint32_t size)
+{
+  // 3 byte frame tag: key_frame(1) version(3) show_frame(1) first_part_size(19)
+  if (size < 3)
+    return false;
+
+  const uint32_t tag = buf[0] | (buf[1] << 8) | (buf[2] << 16);
+  const bool keyFrame = !(tag & 1);
+  const uint32_t version = (tag >> 1) & 7;
+  const uint32_t firstPartSize = (tag >> 5) & 0x7ffff;
+  const uint32_t headerSize = keyFrame ? 10 : 3;
+
+  if (version > 3 || size < headerSize || firstPartSize > size - headerSize)
+    return false;
+
+  // Key frames carry a start code followed by the dimensions
+  if (keyFrame && (buf[3] != 0x9d || buf[4] != 0x01 || buf[5] != 0x2a))
+    return false;
+
+  return true;
+}
+
+bool
+DroidValidateVP9Frame (const uint8_t * buf, uint32_t size)
+{
+  if (size < 1 || (buf[0] >> 6) != 2)
+    return false;
+
+  const int profile = ((buf[0] >> 5) & 1) | (((buf[0] >> 4) & 1) << 1);
+  int pos = 4;                  // bits consumed from buf[0]
+  if (profile == 3) {
+    if (buf[0] & 0x8)           // reserved_zero
+      return false;
+    pos++;
+  }
+
+  // show_existing_frame is a complete frame on its own
+  if ((buf[0] >> (7 - pos)) & 1)
+    return true;
+  pos++;
+
+  // Key frames (frame_type 0) are followed by show_frame, error_resilient
+  // and the 0x49 0x83 0x42 sync code
+  const bool keyFrame = !((buf[0] >> (7 - pos)) & 1);
+  if (keyFrame) {
+    pos += 3;
+    if (size < 5)
+      return false;
+    uint64_t bits = 0;
+    for (int i = 0; i < 5; i++)
+      bits = (bits << 8) | buf[i];
+    if (((bits >> (40 - pos - 24)) & 0xffffff) != 0x498342)
+      return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,57 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_BITSTREAM
+#define GMP_DROID_BITSTREAM
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Bitstream helpers for the decoder input and encoder output paths
+ */
+
+struct DroidVP9SubFrame
+{
+  uint32_t offset;
+  uint32_t size;
+  bool shown;
+};
+
+// Split a VP9 superframe into its frames using the superframe index.
+// Returns false when the packet is a single frame or the index is broken.
+bool DroidParseVP9Superframe (const uint8_t * buf, uint32_t size,
+    std::vector<DroidVP9SubFrame> & frames);
+
+// Whether a single VP9 frame is displayed, either directly or as
+// show_existing_frame
+bool DroidVP9FrameShown (const uint8_t * buf, uint32_t size);
+
+// first_mb_in_slice of the last slice in an H.264 Annex B buffer. Returns
+// false when the buffer has no slice.
+bool DroidH264LastSliceMb (const uint8_t * buf, uint32_t size,
+    uint32_t & mb);
+
+// Structural sanity checks. These are cheap header checks meant to catch
+// truncated or corrupted packets, not a full conformance check.
+
+// H.264 NAL unit header: non-empty and forbidden_zero_bit clear
+bool DroidValidateH264Nal (const uint8_t * nal, uint32_t size);
+
+// H.264 Annex B buffer: starts with a start code and a valid NAL header
+bool DroidValidateH264AnnexB (const uint8_t * buf, uint32_t size);
+
+// VP8 frame tag, key frame start code and first partition size
+bool DroidValidateVP8Frame (const uint8_t * buf, uint32_t size);
+
+// VP9 frame marker, profile and key frame sync code
+bool DroidValidateVP9Frame (const uint8_t * buf, uint32_t size);
+
+#endif
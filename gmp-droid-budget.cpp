@@ -0,0 +1,269 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gmp-droid-budget.h"
+
+#define BUDGET_NAME "/gmp-droid-budget"
+#define BUDGET_MAGIC 0x47444231
+#define BUDGET_SLOTS 32
+// How long to wait for another process to finish creating the registry
+#define BUDGET_ATTACH_TRIES 100
+#define BUDGET_ATTACH_DELAY_US 1000
+
+struct BudgetSlot
+{
+  pid_t pid;
+  // Process start time, to tell a reused pid from the original owner
+  uint64_t startTime;
+  uint8_t encoder;
+  uint8_t priority;
+};
+
+struct BudgetRegistry
+{
+  std::atomic<uint32_t> magic;
+  int32_t maxDecoders;
+  int32_t maxEncoders;
+  pthread_mutex_t lock;
+  BudgetSlot slots[BUDGET_SLOTS];
+};
+
+static BudgetRegistry *g_registry = nullptr;
+static pid_t g_pid = 0;
+static uint64_t g_startTime = 0;
+
+// Start time of a process in clock ticks since boot, 0 if unknown
+static uint64_t
+ProcessStartTime (pid_t pid)
+{
+  char path[32];
+  snprintf (path, sizeof (path), "/proc/%d/stat", (int) pid);
+  FILE *file = fopen (path, "r");
+  if (!file)
+    return 0;
+  char buf[1024];
+  size_t len = fread (buf, 1, sizeof (buf) - 1, file);
+  fclose (file);
+  buf[len] = '\0';
+
+  // The command name may contain spaces, fields are counted after it
+  char *p = strrchr (buf, ')');
+  if (!p)
+    return 0;
+  // starttime is field 22, the field after ')' is field 3
+  for (int field = 2; field < 22 && p; field++)
+    p = strchr (p + 1, ' ');
+  return p ? strtoull (p + 1, nullptr, 10) : 0;
+}
+
+static bool
+SlotOwnerAlive (const BudgetSlot & slot)
+{
+  if (kill (slot.pid, 0) < 0 && errno == ESRCH)
+    return false;
+  if (slot.startTime) {
+    uint64_t startTime = ProcessStartTime (slot.pid);
+    if (startTime && startTime != slot.startTime)
+      return false;
+  }
+  return true;
+}
+
+static bool
+Lock ()
+{
+  int rc = pthread_mutex_lock (&g_registry->lock);
+  if (rc == EOWNERDEAD) {
+    // The holder died, the slots are still consistent as each update is a
+    // single store of the pid
+    pthread_mutex_consistent (&g_registry->lock);
+    return true;
+  }
+  return rc == 0;
+}
+
+static void
+Unlock ()
+{
+  pthread_mutex_unlock (&g_registry->lock);
+}
+
+static void
+ReapSlots ()
+{
+  for (int i = 0; i < BUDGET_SLOTS; i++) {
+    BudgetSlot & slot = g_registry->slots[i];
+    if (slot.pid && !SlotOwnerAlive (slot))
+      slot.pid = 0;
+  }
+}
+
+static BudgetRegistry *
+CreateRegistry (int fd, int maxDecoders, int maxEncoders)
+{
+  if (ftruncate (fd, sizeof (BudgetRegistry)) < 0)
+    return nullptr;
+  void *addr = mmap (nullptr, sizeof (BudgetRegistry),
+      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+    return nullptr;
+
+  // The file starts zeroed, so all slots are free
+  BudgetRegistry *registry = static_cast<BudgetRegistry *> (addr);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init (&attr);
+  pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init (&registry->lock, &attr);
+  pthread_mutexattr_destroy (&attr);
+  registry->maxDecoders = maxDecoders;
+  registry->maxEncoders = maxEncoders;
+  registry->magic.store (BUDGET_MAGIC, std::memory_order_release);
+  return registry;
+}
+
+static BudgetRegistry *
+AttachRegistry (int fd)
+{
+  struct stat st;
+  int tries = 0;
+  // Wait for the creating process to size the file
+  while (fstat (fd, &st) == 0 && st.st_size < (off_t) sizeof (BudgetRegistry)) {
+    if (++tries > BUDGET_ATTACH_TRIES)
+      return nullptr;
+    usleep (BUDGET_ATTACH_DELAY_US);
+  }
+  void *addr = mmap (nullptr, sizeof (BudgetRegistry),
+      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+    return nullptr;
+
+  BudgetRegistry *registry = static_cast<BudgetRegistry *> (addr);
+  while (registry->magic.load (std::memory_order_acquire) != BUDGET_MAGIC) {
+    if (++tries > BUDGET_ATTACH_TRIES) {
+      munmap (addr, sizeof (BudgetRegistry));
+      return nullptr;
+    }
+    usleep (BUDGET_ATTACH_DELAY_US);
+  }
+  return registry;
+}
+
+bool
+DroidBudgetInit (int & maxDecoders, int & maxEncoders)
+{
+  if (g_registry) {
+    maxDecoders = g_registry->maxDecoders;
+    maxEncoders = g_registry->maxEncoders;
+    return true;
+  }
+  if (maxDecoders <= 0 && maxEncoders <= 0)
+    return false;
+
+  g_pid = getpid ();
+  g_startTime = ProcessStartTime (g_pid);
+
+  int fd = shm_open (BUDGET_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) {
+    g_registry = CreateRegistry (fd, maxDecoders, maxEncoders);
+    if (!g_registry)
+      shm_unlink (BUDGET_NAME);
+  } else if (errno == EEXIST) {
+    fd = shm_open (BUDGET_NAME, O_RDWR, 0600);
+    if (fd >= 0)
+      g_registry = AttachRegistry (fd);
+  }
+  if (fd >= 0)
+    close (fd);
+  if (!g_registry)
+    return false;
+  maxDecoders = g_registry->maxDecoders;
+  maxEncoders = g_registry->maxEncoders;
+  return true;
+}
+
+void
+DroidBudgetShutdown ()
+{
+  if (!g_registry)
+    return;
+  if (Lock ()) {
+    for (int i = 0; i < BUDGET_SLOTS; i++) {
+      if (g_registry->slots[i].pid == g_pid)
+        g_registry->slots[i].pid = 0;
+    }
+    Unlock ();
+  }
+  munmap (g_registry, sizeof (BudgetRegistry));
+  g_registry = nullptr;
+}
+
+bool
+DroidBudgetAcquire (bool encoder, DroidBudgetPriority priority, int & slot)
+{
+  slot = -1;
+  if (!g_registry)
+    return true;
+  const int max = encoder ? g_registry->maxEncoders : g_registry->maxDecoders;
+  if (max <= 0)
+    return true;
+  if (!Lock ())
+    return true;
+
+  ReapSlots ();
+  int used = 0;
+  int free = -1;
+  for (int i = 0; i < BUDGET_SLOTS; i++) {
+    const BudgetSlot & s = g_registry->slots[i];
+    if (!s.pid) {
+      if (free < 0)
+        free = i;
+    } else if (s.encoder == encoder) {
+      used++;
+    }
+  }
+
+  const int reserve = priority == DROID_BUDGET_LOW ? 1 : 0;
+  if (free >= 0 && used + reserve < max) {
+    BudgetSlot & s = g_registry->slots[free];
+    s.startTime = g_startTime;
+    s.encoder = encoder;
+    s.priority = priority;
+    s.pid = g_pid;
+    slot = free;
+  }
+  Unlock ();
+  return slot >= 0;
+}
+
+void
+DroidBudgetRelease (int slot)
+{
+  if (!g_registry || slot < 0 || slot >= BUDGET_SLOTS)
+    return;
+  if (Lock ()) {
+    if (g_registry->slots[slot].pid == g_pid)
+      g_registry->slots[slot].pid = 0;
+    Unlock ();
+  }
+}
@@ -0,0 +1,48 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_BUDGET
+#define GMP_DROID_BUDGET
+
+/*
+ * Hardware codec budget shared by all plugin processes.
+ *
+ * Gecko runs a plugin process per origin, each of which would otherwise
+ * create codecs until the hardware runs out. The budget is a registry in
+ * shared memory, guarded by a robust process shared mutex, with a slot for
+ * every hardware codec in use. Slots of processes which have exited are
+ * reclaimed when the registry is next locked.
+ */
+
+enum DroidBudgetPriority
+{
+  // Codecs serving playback or encoding
+  DROID_BUDGET_NORMAL,
+  // Optional codecs, admitted only while a slot remains free for others
+  DROID_BUDGET_LOW,
+};
+
+// Attach to the registry, creating it if needed. A limit of 0 leaves that
+// codec kind unlimited. Returns false if the registry is unavailable, in
+// which case every request is admitted. The registry keeps the limits of
+// the process that created it, so all processes count against the same
+// budget; on success the arguments are set to the limits in force.
+bool DroidBudgetInit (int & maxDecoders, int & maxEncoders);
+// Release the slots still held by this process and detach
+void DroidBudgetShutdown ();
+
+// Reserve a slot before creating a codec. Returns false when the budget is
+// exhausted. On success slot receives a handle for DroidBudgetRelease (),
+// or -1 if the codec kind is not limited.
+bool DroidBudgetAcquire (bool encoder, DroidBudgetPriority priority,
+    int & slot);
+void DroidBudgetRelease (int slot);
+
+#endif
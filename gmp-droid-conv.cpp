@@ -10,16 +10,89 @@
 
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "gmp-droid-conv.h"
-#include "gmp-video-frame-i420.h"
-#include "gmp-video-frame-encoded.h"
 #include "droidmediacodec.h"
+#include "gmp-droid-media.h"
+
+#define ALIGN_SIZE(size, to) (((size) + to  - 1) & ~(to - 1))
+
+// Copy a plane, in one go when the strides match
+static void
+CopyPlane (const uint8_t * in, int32_t inStride, uint8_t * out,
+    int32_t outStride, int32_t width, int32_t height)
+{
+  if (height <= 0)
+    return;
+  if (inStride == outStride) {
+    memcpy (out, in, (size_t) inStride * (height - 1) + width);
+    return;
+  }
+  for (int32_t y = 0; y < height; y++)
+    memcpy (out + y * outStride, in + y * inStride, width);
+}
+
+static void
+CopyPackedPlanes (uint8_t * out0, uint8_t * out1, const uint8_t * in,
+    int32_t outSize)
+{
+  int x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  for (; x + 16 <= outSize; x += 16) {
+    uint8x16x2_t planes = vld2q_u8 (in + 2 * x);
+    vst1q_u8 (out0 + x, planes.val[0]);
+    vst1q_u8 (out1 + x, planes.val[1]);
+  }
+#elif defined(__SSE2__)
+  const __m128i mask = _mm_set1_epi16 (0x00ff);
+  for (; x + 16 <= outSize; x += 16) {
+    __m128i a = _mm_loadu_si128 ((const __m128i *) (in + 2 * x));
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (in + 2 * x + 16));
+    _mm_storeu_si128 ((__m128i *) (out0 + x),
+        _mm_packus_epi16 (_mm_and_si128 (a, mask), _mm_and_si128 (b, mask)));
+    _mm_storeu_si128 ((__m128i *) (out1 + x),
+        _mm_packus_epi16 (_mm_srli_epi16 (a, 8), _mm_srli_epi16 (b, 8)));
+  }
+#endif
+  const uint8_t *place = in + 2 * x;
+  for (; x < outSize; x++) {
+    out0[x] = place[0];
+    out1[x] = place[1];
+    place += 2;
+  }
+}
+
+// Deinterleave a plane of pairs into two planes, in one go when the rows
+// are contiguous
+static void
+SplitPlane (const uint8_t * in, int32_t inStride, uint8_t * out0,
+    int32_t out0Stride, uint8_t * out1, int32_t out1Stride, int32_t width,
+    int32_t height)
+{
+  if (height <= 0)
+    return;
+  if (inStride == 2 * out0Stride && out0Stride == out1Stride) {
+    CopyPackedPlanes (out0, out1, in, out0Stride * (height - 1) + width);
+    return;
+  }
+  for (int32_t y = 0; y < height; y++) {
+    CopyPackedPlanes (out0 + y * out0Stride, out1 + y * out1Stride,
+        in + y * inStride, width);
+  }
+}
 
 class ConvertNative: public DroidColourConvert
 {
 private:
   DroidMediaConvert * m_convert;
+  std::vector<uint8_t> m_buffer;
 public:
   ConvertNative (DroidMediaConvert * convert)
     : m_convert (convert) { }
@@ -29,18 +102,23 @@ public:
     droid_media_convert_destroy (m_convert);
   }
 
-  GMPErr Convert (GMPVideoHost * host, DroidMediaData * in,
-      GMPVideoi420Frame * out)
+  bool Convert (DroidMediaData * in, const DroidPlanes & out)
   {
     int32_t size = m_stride * m_slice_height;
-    uint8_t *buf = (uint8_t *) malloc (size * 3 / 2);
+    m_buffer.resize (size * 3 / 2);
+    uint8_t *buf = m_buffer.data ();
     droid_media_convert_to_i420 (m_convert, in, buf);
-    out->CreateFrame (size, buf,
-        size / 4, buf + size,
-        size / 4, buf + size + (size / 4),
-        m_width, m_height, m_width, m_width / 2, m_width / 2);
-    free (buf);
-    return GMPNoErr;
+    CopyPlane (buf, m_width, out.data[0], out.stride[0], m_width, m_height);
+    CopyPlane (buf + size, m_width / 2, out.data[1], out.stride[1],
+        (m_width + 1) / 2, (m_height + 1) / 2);
+    CopyPlane (buf + size + (size / 4), m_width / 2, out.data[2],
+        out.stride[2], (m_width + 1) / 2, (m_height + 1) / 2);
+    return true;
+  }
+
+  int32_t Stride (int plane)
+  {
+    return plane ? (m_width + 1) / 2 : m_width;
   }
 
   void SetFormat (DroidMediaRect * rect, int32_t width, int32_t height)
@@ -49,27 +127,17 @@ public:
     droid_media_convert_set_crop_rect (m_convert, *rect, width, height);
   }
 
-};
-
-#define ALIGN_SIZE(size, to) (((size) + to  - 1) & ~(to - 1))
-
-static void
-CopyPackedPlanes (uint8_t * out0, uint8_t * out1, uint8_t * in, int32_t outSize)
-{
-  int x;
-  uint8_t *place = in;
-  for (x = 0; x < outSize; x++) {
-    out0[x] = place[0];
-    out1[x] = place[1];
-    place += 2;
+  const uint8_t *LumaPlane (DroidMediaData * in)
+  {
+    return nullptr;
   }
-}
+
+};
 
 class ConvertYUV420PackedSemiPlanar32m:public DroidColourConvert
 {
 public:
-  GMPErr Convert (GMPVideoHost * host, DroidMediaData * in,
-      GMPVideoi420Frame * out)
+  bool Convert (DroidMediaData * in, const DroidPlanes & out)
   {
     /* copy to the output buffer swapping the u and v planes and cropping if necessary */
     /* NV12 format with 128 byte alignment */
@@ -79,30 +147,18 @@ public:
         (uint8_t *) in->data + (m_stride * m_slice_height) +
         (m_top * m_stride / 2) + m_left / 2;
 
-    GMPPlane *outY, *outU, *outV;
-    // Create plane buffers
-    host->CreatePlane (&outY);
-    host->CreatePlane (&outU);
-    host->CreatePlane (&outV);
     // Copy Y directly
-    outY->Copy (m_stride * m_height, m_stride, y);
-    // U and V are packed, so we'll have to create empty buffers and copy manually
-    outU->CreateEmptyPlane (m_stride * m_height / 4, m_stride / 2,
-        m_stride * m_height / 4);
-    outV->CreateEmptyPlane (m_stride * m_height / 4, m_stride / 2,
-        m_stride * m_height / 4);
-    CopyPackedPlanes (outU->Buffer (), outV->Buffer (), uv,
-        m_stride * m_height / 4);
-    // Create Frame from the plane buffers to return
-    out->CreateFrame (m_stride * m_height, outY->Buffer (),
-        m_stride * m_height / 4, outU->Buffer (),
-        m_stride * m_height / 4, outV->Buffer (),
-        m_width, m_height, m_stride, m_stride / 2, m_stride / 2);
-    // Destroy the planes
-    outY->Destroy ();
-    outU->Destroy ();
-    outV->Destroy ();
-    return GMPNoErr;
+    CopyPlane (y, m_stride, out.data[0], out.stride[0], m_width, m_height);
+    // U and V are packed, so we'll have to copy manually
+    SplitPlane (uv, m_stride, out.data[1], out.stride[1], out.data[2],
+        out.stride[2], (m_width + 1) / 2, (m_height + 1) / 2);
+    return true;
+  }
+
+  bool Planes (DroidMediaData * in, DroidPictureLayout & layout,
+      DroidPlanes & planes)
+  {
+    return SemiPlanar (in, layout, planes);
   }
 
   void SetFormat (DroidMediaRect * rect, int32_t width, int32_t height)
@@ -118,8 +174,7 @@ public:
 class ConvertYUV420Planar:public DroidColourConvert
 {
 public:
-  GMPErr Convert (GMPVideoHost * host, DroidMediaData * in,
-      GMPVideoi420Frame * out)
+  bool Convert (DroidMediaData * in, const DroidPlanes & out)
   {
     /* Buffer is already I420, so we can copy it straight over */
     /* though we need to handle the cropping using stride and an offset */
@@ -130,25 +185,19 @@ public:
     uint8_t *v = (uint8_t *) in->data + (m_stride * m_slice_height) +
         (m_stride * m_slice_height / 4)
         + (m_top * m_stride / 2) + (m_left / 2);
-    // Create plane buffers
-    GMPPlane *outY, *outU, *outV;
-    host->CreatePlane (&outY);
-    host->CreatePlane (&outU);
-    host->CreatePlane (&outV);
-    // Copy all buffers directly
-    outY->Copy (m_stride * m_height, m_stride, y);
-    outU->Copy (m_stride * m_height / 4, m_stride / 2, u);
-    outV->Copy (m_stride * m_height / 4, m_stride / 2, v);
-    // Create Frame from the plane buffers to return
-    out->CreateFrame (m_stride * m_height, outY->Buffer (),
-        m_stride * m_height / 4, outU->Buffer (),
-        m_stride * m_height / 4, outV->Buffer (),
-        m_width, m_height, m_stride, m_stride / 2, m_stride / 2);
-    // Destroy the planes
-    outY->Destroy ();
-    outU->Destroy ();
-    outV->Destroy ();
-    return GMPNoErr;
+    // Copy all planes directly
+    CopyPlane (y, m_stride, out.data[0], out.stride[0], m_width, m_height);
+    CopyPlane (u, m_stride / 2, out.data[1], out.stride[1],
+        (m_width + 1) / 2, (m_height + 1) / 2);
+    CopyPlane (v, m_stride / 2, out.data[2], out.stride[2],
+        (m_width + 1) / 2, (m_height + 1) / 2);
+    return true;
+  }
+
+  bool Planes (DroidMediaData * in, DroidPictureLayout & layout,
+      DroidPlanes & planes)
+  {
+    return Planar (in, m_stride / 2, false, layout, planes);
   }
 
   void SetFormat (DroidMediaRect * rect, int32_t width, int32_t height)
@@ -161,36 +210,23 @@ public:
 class ConvertYUV420SemiPlanar:public DroidColourConvert
 {
 public:
-  GMPErr Convert (GMPVideoHost * host, DroidMediaData * in,
-      GMPVideoi420Frame * out)
+  bool Convert (DroidMediaData * in, const DroidPlanes & out)
   {
     uint8_t *y = (uint8_t *) in->data + (m_top * m_stride) + m_left;
     uint8_t *uv = (uint8_t *) in->data + (m_stride * m_slice_height) +
         (m_top * m_stride / 2) + m_left / 2;
-    // Create plane buffers
-    GMPPlane *outY, *outU, *outV;
-    host->CreatePlane (&outY);
-    host->CreatePlane (&outU);
-    host->CreatePlane (&outV);
     // Copy Y directly
-    outY->Copy (m_stride * m_height, m_stride, y);
-    // U and V are packed, so we'll have to create empty buffers and copy manually
-    outU->CreateEmptyPlane (m_stride * m_height, m_stride / 2,
-        m_stride * m_height / 4);
-    outV->CreateEmptyPlane (m_stride * m_height, m_stride / 2,
-        m_stride * m_height / 4);
-    CopyPackedPlanes (outU->Buffer (), outV->Buffer (), uv,
-        m_stride * m_height / 4);
-    // Create Frame from the plane buffers to return
-    out->CreateFrame (m_stride * m_height, outY->Buffer (),
-        m_stride * m_height / 4, outU->Buffer (),
-        m_stride * m_height / 4, outV->Buffer (),
-        m_width, m_height, m_stride, m_stride / 2, m_stride / 2);
-    // Destroy the planes
-    outY->Destroy ();
-    outU->Destroy ();
-    outV->Destroy ();
-    return GMPNoErr;
+    CopyPlane (y, m_stride, out.data[0], out.stride[0], m_width, m_height);
+    // U and V are packed, so we'll have to copy manually
+    SplitPlane (uv, m_stride, out.data[1], out.stride[1], out.data[2],
+        out.stride[2], (m_width + 1) / 2, (m_height + 1) / 2);
+    return true;
+  }
+
+  bool Planes (DroidMediaData * in, DroidPictureLayout & layout,
+      DroidPlanes & planes)
+  {
+    return SemiPlanar (in, layout, planes);
   }
 
   void SetFormat (DroidMediaRect * rect, int32_t width, int32_t height)
@@ -200,13 +236,193 @@ public:
   }
 };
 
+class ConvertYV12:public DroidColourConvert
+{
+public:
+  bool Convert (DroidMediaData * in, const DroidPlanes & out)
+  {
+    /* Planar with V before U and 16 byte aligned chroma stride */
+
+    uint8_t *y = (uint8_t *) in->data + (m_top * m_stride) + m_left;
+    uint8_t *v = (uint8_t *) in->data + (m_stride * m_slice_height) +
+        (m_top / 2 * m_chroma_stride) + (m_left / 2);
+    uint8_t *u = (uint8_t *) in->data + (m_stride * m_slice_height) +
+        (m_chroma_stride * m_slice_height / 2)
+        + (m_top / 2 * m_chroma_stride) + (m_left / 2);
+    // Copy all planes directly, swapping U and V
+    CopyPlane (y, m_stride, out.data[0], out.stride[0], m_width, m_height);
+    CopyPlane (u, m_chroma_stride, out.data[1], out.stride[1],
+        (m_width + 1) / 2, (m_height + 1) / 2);
+    CopyPlane (v, m_chroma_stride, out.data[2], out.stride[2],
+        (m_width + 1) / 2, (m_height + 1) / 2);
+    return true;
+  }
+
+  bool Planes (DroidMediaData * in, DroidPictureLayout & layout,
+      DroidPlanes & planes)
+  {
+    return Planar (in, m_chroma_stride, true, layout, planes);
+  }
+
+  int32_t Stride (int plane)
+  {
+    return plane ? m_chroma_stride : m_stride;
+  }
+
+  void SetFormat (DroidMediaRect * rect, int32_t width, int32_t height)
+  {
+    this->DroidColourConvert::SetFormat (rect, width, height);
+    m_stride = ALIGN_SIZE (m_stride, 16);
+    m_chroma_stride = ALIGN_SIZE (m_stride / 2, 16);
+  }
+
+private:
+  int32_t m_chroma_stride = 0;
+};
+
+class ConvertNV21:public DroidColourConvert
+{
+public:
+  bool Convert (DroidMediaData * in, const DroidPlanes & out)
+  {
+    /* Semi-planar with interleaved V and U */
+
+    uint8_t *y = (uint8_t *) in->data + (m_top * m_stride) + m_left;
+    uint8_t *vu = (uint8_t *) in->data + (m_stride * m_slice_height) +
+        (m_top / 2 * m_stride) + m_left;
+    // Copy Y directly
+    CopyPlane (y, m_stride, out.data[0], out.stride[0], m_width, m_height);
+    // V and U are packed, deinterleave them swapping the order
+    SplitPlane (vu, m_stride, out.data[2], out.stride[2], out.data[1],
+        out.stride[1], (m_width + 1) / 2, (m_height + 1) / 2);
+    return true;
+  }
+
+  void SetFormat (DroidMediaRect * rect, int32_t width, int32_t height)
+  {
+    this->DroidColourConvert::SetFormat (rect, width, height);
+    m_top = m_top & ~1;
+    m_left = m_left & ~1;
+  }
+};
+
+// Every other sample of a row, through the deinterleave kernel with the
+// odd samples going to scratch
+static void
+SampleRow (const uint8_t * in, int32_t inWidth, uint8_t * out,
+    uint8_t * scratch)
+{
+  const int32_t pairs = inWidth / 2;
+  CopyPackedPlanes (out, scratch, in, pairs);
+  if (inWidth & 1)
+    out[pairs] = in[inWidth - 1];
+}
+
+// Every other sample of every other row
+static void
+SamplePlane (const uint8_t * in, int32_t inStride, int32_t inWidth,
+    int32_t inHeight, uint8_t * out, int32_t outStride, uint8_t * scratch)
+{
+  for (int32_t y = 0; 2 * y < inHeight; y++)
+    SampleRow (in + 2 * y * inStride, inWidth, out + y * outStride, scratch);
+}
+
+bool
+DroidColourConvert::ConvertHalf (DroidMediaData * in, const DroidPlanes & out)
+{
+  // Sample the decoded planes in place. Other layouts, and the native
+  // converter's opaque one, are converted at full size first.
+  DroidPictureLayout layout;
+  DroidPlanes src;
+  if (!Planes (in, layout, src)) {
+    size_t offsets[3];
+    size_t size = 0;
+    for (int plane = 0; plane < 3; plane++) {
+      src.stride[plane] = Stride (plane);
+      offsets[plane] = size;
+      size += (size_t) src.stride[plane]
+          * (plane ? (m_height + 1) / 2 : m_height);
+    }
+    m_full.resize (size);
+    for (int plane = 0; plane < 3; plane++)
+      src.data[plane] = m_full.data () + offsets[plane];
+
+    if (!Convert (in, src))
+      return false;
+    layout = DROID_LAYOUT_I420;
+  }
+
+  const int32_t chromaWidth = (m_width + 1) / 2;
+  const int32_t chromaHeight = (m_height + 1) / 2;
+  // Odd samples, then a row of each chroma plane of NV12
+  m_scratch.resize (3 * chromaWidth);
+  uint8_t *odd = m_scratch.data ();
+
+  SamplePlane (src.data[0], src.stride[0], m_width, m_height, out.data[0],
+      out.stride[0], odd);
+  if (layout == DROID_LAYOUT_I420) {
+    SamplePlane (src.data[1], src.stride[1], chromaWidth, chromaHeight,
+        out.data[1], out.stride[1], odd);
+    SamplePlane (src.data[2], src.stride[2], chromaWidth, chromaHeight,
+        out.data[2], out.stride[2], odd);
+  } else {
+    uint8_t *u = odd + chromaWidth;
+    uint8_t *v = u + chromaWidth;
+    for (int32_t y = 0; 2 * y < chromaHeight; y++) {
+      CopyPackedPlanes (u, v, src.data[1] + 2 * y * src.stride[1],
+          chromaWidth);
+      SampleRow (u, chromaWidth, out.data[1] + y * out.stride[1], odd);
+      SampleRow (v, chromaWidth, out.data[2] + y * out.stride[2], odd);
+    }
+  }
+  return true;
+}
+
+bool
+DroidColourConvert::Planar (DroidMediaData * in, int32_t chromaStride,
+    bool swapped, DroidPictureLayout & layout, DroidPlanes & planes)
+{
+  uint8_t *base = (uint8_t *) in->data;
+  uint8_t *first = base + (m_stride * m_slice_height);
+  uint8_t *second = first + (chromaStride * m_slice_height / 2);
+  const size_t chromaOffset = (m_top / 2) * chromaStride + (m_left / 2);
+
+  layout = DROID_LAYOUT_I420;
+  planes.data[0] = base + (m_top * m_stride) + m_left;
+  planes.data[1] = (swapped ? second : first) + chromaOffset;
+  planes.data[2] = (swapped ? first : second) + chromaOffset;
+  planes.stride[0] = m_stride;
+  planes.stride[1] = chromaStride;
+  planes.stride[2] = chromaStride;
+  return true;
+}
+
+bool
+DroidColourConvert::SemiPlanar (DroidMediaData * in,
+    DroidPictureLayout & layout, DroidPlanes & planes)
+{
+  uint8_t *base = (uint8_t *) in->data;
+
+  layout = DROID_LAYOUT_NV12;
+  planes.data[0] = base + (m_top * m_stride) + m_left;
+  planes.data[1] = base + (m_stride * m_slice_height)
+      + (m_top / 2) * m_stride + (m_left & ~1);
+  planes.data[2] = nullptr;
+  planes.stride[0] = m_stride;
+  planes.stride[1] = m_stride;
+  planes.stride[2] = 0;
+  return true;
+}
+
 DroidColourConvert *
 DroidColourConvert::GetConverter (DroidMediaCodecMetaData * md,
-    DroidMediaRect * rect, const char **conv_name)
+    DroidMediaRect * rect, const char **conv_name, bool allowNative,
+    int32_t strideAlign, int32_t sliceAlign)
 {
   DroidColourConvert *converter;
   *conv_name = "None";
-  DroidMediaConvert *droidConvert = droid_media_convert_create ();
+  DroidMediaConvert *droidConvert =
+      allowNative ? droid_media_convert_create () : nullptr;
   if (droidConvert) {
     //TODO: Check DONT_USE_DROID_CONVERT_VALUE quirk. May not be needed.
     converter = new ConvertNative (droidConvert);
@@ -214,6 +430,8 @@ DroidColourConvert::GetConverter (DroidMediaCodecMetaData * md,
   } else {
     DroidMediaColourFormatConstants constants;
     droid_media_colour_format_constants_init (&constants);
+    DroidMediaPixelFormatConstants halConstants;
+    droid_media_pixel_format_constants_init (&halConstants);
 
     if (md->hal_format == constants.QOMX_COLOR_FormatYUV420PackedSemiPlanar32m) {
       converter = new ConvertYUV420PackedSemiPlanar32m ();
@@ -224,11 +442,25 @@ DroidColourConvert::GetConverter (DroidMediaCodecMetaData * md,
     } else if (md->hal_format == constants.OMX_COLOR_FormatYUV420SemiPlanar) {
       converter = new ConvertYUV420SemiPlanar ();
       *conv_name = "ConvertYUV420SemiPlanar";
+    } else if (md->hal_format == halConstants.HAL_PIXEL_FORMAT_YV12) {
+      converter = new ConvertYV12 ();
+      *conv_name = "ConvertYV12";
+    } else if (md->hal_format == halConstants.HAL_PIXEL_FORMAT_YCrCb_420_SP) {
+      converter = new ConvertNV21 ();
+      *conv_name = "ConvertNV21";
     } else {
       return nullptr;
     }
   }
 
-  converter->SetFormat (rect, md->width, md->height);
+  // Device quirks can raise the alignment the converter assumes
+  int32_t width = md->width;
+  int32_t height = md->height;
+  if (strideAlign > 0)
+    width = ALIGN_SIZE (width, strideAlign);
+  if (sliceAlign > 0)
+    height = ALIGN_SIZE (height, sliceAlign);
+
+  converter->SetFormat (rect, width, height);
   return converter;
 }
@@ -11,8 +11,9 @@
 #ifndef GMP_DROID_CONV
 #define GMP_DROID_CONV
 
-#include "gmp-video-host.h"
-#include "gmp-video-frame-i420.h"
+#include <vector>
+
+#include "gmp-droid-core.h"
 #include "droidmediacodec.h"
 #include "droidmediaconvert.h"
 #include "droidmediaconstants.h"
@@ -22,11 +23,38 @@ class DroidColourConvert
 public:
   virtual ~DroidColourConvert () { }
 
-  virtual GMPErr Convert (GMPVideoHost * host, DroidMediaData * in,
-      GMPVideoi420Frame * out) = 0;
+  // Convert to I420 planes of m_width x m_height
+  virtual bool Convert (DroidMediaData * in, const DroidPlanes & out) = 0;
+
+  // Convert to planes of half the width and height, for previews that
+  // don't need the full picture. Every other sample is taken straight
+  // from the decoded planes where Planes () gives them.
+  bool ConvertHalf (DroidMediaData * in, const DroidPlanes & out);
+
+  // The cropped planes of a decoded buffer when they are I420 or NV12.
+  // Not available for other layouts or with the native converter.
+  virtual bool Planes (DroidMediaData * in, DroidPictureLayout & layout,
+      DroidPlanes & planes)
+  {
+    return false;
+  }
+
+  // Output plane strides at which Convert () copies planes in one go
+  virtual int32_t Stride (int plane)
+  {
+    return plane ? m_stride / 2 : m_stride;
+  }
 
   static DroidColourConvert *GetConverter (DroidMediaCodecMetaData * md,
-      DroidMediaRect * rect, const char **conv_name);
+      DroidMediaRect * rect, const char **conv_name, bool allowNative = true,
+      int32_t strideAlign = 0, int32_t sliceAlign = 0);
+
+  // Cropped luma plane of a decoded buffer. Not available with the native
+  // converter, whose buffer layout is opaque.
+  virtual const uint8_t *LumaPlane (DroidMediaData * in)
+  {
+    return (const uint8_t *) in->data + (m_top * m_stride) + m_left;
+  }
 
   virtual void SetFormat (DroidMediaRect * rect, int32_t width, int32_t height)
   {
@@ -45,6 +73,18 @@ public:
   int32_t m_top = 0;
   int32_t m_left = 0;
 
+protected:
+  // Planes () of planar buffers, with V first when swapped
+  bool Planar (DroidMediaData * in, int32_t chromaStride, bool swapped,
+      DroidPictureLayout & layout, DroidPlanes & planes);
+  // Planes () of buffers with interleaved UV after the Y plane
+  bool SemiPlanar (DroidMediaData * in, DroidPictureLayout & layout,
+      DroidPlanes & planes);
+
+private:
+  // Full size picture and row scratch for ConvertHalf ()
+  std::vector<uint8_t> m_full;
+  std::vector<uint8_t> m_scratch;
 };
 
 #endif
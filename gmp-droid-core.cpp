@@ -0,0 +1,206 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <mutex>
+#include <vector>
+#include <stdlib.h>
+
+#include "gmp-droid-core.h"
+#include "gmp-droid-budget.h"
+#include "gmp-droid-executor.h"
+#include "gmp-droid-history.h"
+#include "gmp-droid-lock.h"
+#include "gmp-droid-log.h"
+#include "gmp-droid-media.h"
+#include "gmp-droid-quirks.h"
+
+// Allocations are rounded up so that buffers of varying sizes, e.g.
+// compressed frames, can be reused for each other
+#define BUFFER_ROUND 4096
+
+bool
+DroidCoreInit (const DroidCoreOptions & options, std::string & error)
+{
+  DroidLockStatsEnable (options.lockStats);
+  DroidExecutor::Init (options.workers, options.blockingWorkers);
+  DroidHistoryInit (options.historyFile, options.historyMaxBytes);
+  if (options.quirksFile && DroidLoadQuirks (options.quirksFile)) {
+    LOG (INFO, "Loaded quirks from " << options.quirksFile
+        << " for device " << DroidQuirksDevice ());
+  }
+  if (!DroidMediaLoad (options.droidmedia, error))
+    return false;
+  int maxDecoders = options.maxDecoders;
+  int maxEncoders = options.maxEncoders;
+  if (DroidBudgetInit (maxDecoders, maxEncoders)) {
+    LOG (INFO, "Hardware codec budget: decoders=" << maxDecoders
+        << " encoders=" << maxEncoders);
+    if (maxDecoders != options.maxDecoders
+        || maxEncoders != options.maxEncoders) {
+      LOG (ERROR, "Hardware codec budget of another process in use, ignoring"
+          << " decoders=" << options.maxDecoders
+          << " encoders=" << options.maxEncoders);
+    }
+  }
+  if (!droid_media_init ()) {
+    error = "droid_media_init failed";
+    return false;
+  }
+  return true;
+}
+
+void
+DroidCoreShutdown ()
+{
+  DroidHistoryShutdown ();
+  DroidExecutor::Shutdown ();
+  DroidBudgetShutdown ();
+  // droidmedia stays mapped, see DroidMediaLoad ()
+  if (DroidMediaLoaded ())
+    droid_media_deinit ();
+}
+
+/*
+ * Buffer pool. Buffers on the idle list don't reference the pool, the
+ * ones handed out do, so the pool state lives as long as either the pool
+ * or a buffer out of it.
+ */
+struct DroidBuffer::Pool
+{
+  explicit Pool (size_t keep) : keep (keep) { }
+
+  ~Pool ()
+  {
+    for (DroidBuffer *buffer : idle)
+      delete buffer;
+  }
+
+  std::mutex lock;
+  std::vector<DroidBuffer *> idle;
+  const size_t keep;
+};
+
+DroidBuffer::DroidBuffer (std::shared_ptr<Pool> pool, size_t capacity)
+    : m_pool (pool), m_data ((uint8_t *) malloc (capacity)),
+      m_capacity (capacity)
+{
+}
+
+DroidBuffer::~DroidBuffer ()
+{
+  free (m_data);
+}
+
+void
+DroidBuffer::Release ()
+{
+  std::shared_ptr<Pool> pool = std::move (m_pool);
+  {
+    std::lock_guard<std::mutex> guard (pool->lock);
+    if (pool->idle.size () < pool->keep) {
+      pool->idle.push_back (this);
+      return;
+    }
+  }
+  delete this;
+}
+
+void
+DroidBuffer::Release (void *buffer)
+{
+  static_cast<DroidBuffer *> (buffer)->Release ();
+}
+
+DroidBufferPool::DroidBufferPool (size_t keep)
+    : m_pool (std::make_shared<DroidBuffer::Pool> (keep))
+{
+}
+
+DroidBufferPool::~DroidBufferPool ()
+{
+}
+
+DroidBuffer *
+DroidBufferPool::Acquire (size_t size)
+{
+  DroidBuffer *buffer = nullptr;
+  {
+    std::lock_guard<std::mutex> guard (m_pool->lock);
+    std::vector<DroidBuffer *> & idle = m_pool->idle;
+    // Best fit. If nothing fits drop the smallest buffer, which the stream
+    // seems to have outgrown.
+    size_t best = idle.size ();
+    size_t smallest = idle.size ();
+    for (size_t i = 0; i < idle.size (); i++) {
+      if (idle[i]->m_capacity >= size
+          && (best == idle.size () || idle[i]->m_capacity < idle[best]->m_capacity))
+        best = i;
+      if (smallest == idle.size ()
+          || idle[i]->m_capacity < idle[smallest]->m_capacity)
+        smallest = i;
+    }
+    if (best < idle.size ()) {
+      buffer = idle[best];
+      idle.erase (idle.begin () + best);
+    } else if (smallest < idle.size ()) {
+      delete idle[smallest];
+      idle.erase (idle.begin () + smallest);
+    }
+  }
+
+  if (buffer) {
+    buffer->m_pool = m_pool;
+    return buffer;
+  }
+  return new DroidBuffer (m_pool,
+      (size + BUFFER_ROUND - 1) / BUFFER_ROUND * BUFFER_ROUND);
+}
+
+bool
+DroidDecodedFrame::Convert (DroidBufferPool & pool, DroidPicture & picture,
+    bool half)
+{
+  const int32_t width = Width (half);
+  const int32_t height = Height (half);
+  const int32_t chromaHeight = (height + 1) / 2;
+  int32_t strides[3];
+  for (int plane = 0; plane < 3; plane++) {
+    if (!half)
+      strides[plane] = Stride (plane);
+    else
+      strides[plane] = plane ? (width + 1) / 2 : width;
+  }
+
+  const size_t ySize = (size_t) strides[0] * height;
+  const size_t uSize = (size_t) strides[1] * chromaHeight;
+  const size_t vSize = (size_t) strides[2] * chromaHeight;
+  DroidBuffer *buffer = pool.Acquire (ySize + uSize + vSize);
+
+  picture.planes.data[0] = buffer->Data ();
+  picture.planes.data[1] = buffer->Data () + ySize;
+  picture.planes.data[2] = buffer->Data () + ySize + uSize;
+  for (int plane = 0; plane < 3; plane++)
+    picture.planes.stride[plane] = strides[plane];
+
+  if (!Convert (picture.planes, half)) {
+    buffer->Release ();
+    return false;
+  }
+
+  picture.layout = DROID_LAYOUT_I420;
+  picture.width = width;
+  picture.height = height;
+  picture.ts = Timestamp ();
+  picture.duration = Duration ();
+  picture.keyFrame = false;
+  picture.release = DroidBuffer::Release;
+  picture.opaque = buffer;
+  return true;
+}
@@ -0,0 +1,338 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_CORE
+#define GMP_DROID_CORE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+/*
+ * gmp-droid core library.
+ *
+ * Hardware video decoding and encoding through droidmedia, with the
+ * bitstream handling, colour conversion, buffer pooling and threading of
+ * the Gecko plugin, for native applications. Work is queued and results
+ * come back through listener callbacks on codec or worker threads; there
+ * is no main thread. The Gecko plugin is an adapter over this API.
+ *
+ * Unless noted otherwise, the methods of one decoder or encoder must be
+ * called from one thread at a time.
+ */
+
+struct DroidCoreOptions
+{
+  // Worker threads shared by all codec instances
+  int workers = 4;
+  // Worker threads for calls that block in droidmedia, shared the same way
+  int blockingWorkers = 4;
+  // droidmedia implementation, null for the system library
+  const char *droidmedia = nullptr;
+  // Device quirks file, null for none
+  const char *quirksFile = nullptr;
+  // Hardware codecs shared by all processes using the library, 0 for no
+  // limit
+  int maxDecoders = 0;
+  int maxEncoders = 0;
+  // Measure lock wait and hold times
+  bool lockStats = false;
+  // Performance history file, null for none, and its size limit
+  const char *historyFile = nullptr;
+  size_t historyMaxBytes = 256 * 1024;
+};
+
+// Called once per process before any codec is created. Returns false with
+// a reason in error if hardware codecs can't be used.
+bool DroidCoreInit (const DroidCoreOptions & options, std::string & error);
+// Called once after all codecs have been destroyed
+void DroidCoreShutdown ();
+
+enum DroidCodecType
+{
+  DROID_CODEC_H264,
+  DROID_CODEC_VP8,
+  DROID_CODEC_VP9,
+};
+
+enum DroidCoreError
+{
+  DROID_ERROR_GENERIC,
+  DROID_ERROR_NOT_SUPPORTED,
+  DROID_ERROR_DECODE,
+  DROID_ERROR_ENCODE,
+};
+
+// Planes of a picture, see DroidPictureLayout
+struct DroidPlanes
+{
+  uint8_t *data[3] = { nullptr, nullptr, nullptr };
+  int32_t stride[3] = { 0, 0, 0 };
+};
+
+/*
+ * Pooled memory. Released buffers are kept for reuse, so that a steady
+ * stream runs without allocating. A pool may be destroyed while buffers
+ * are still out; they are freed when released.
+ */
+class DroidBuffer
+{
+public:
+  uint8_t *Data () const { return m_data; }
+  size_t Capacity () const { return m_capacity; }
+  // Hand the buffer back to its pool. May be called on any thread.
+  void Release ();
+
+  // Release () for buffer callbacks taking the buffer as an opaque pointer
+  static void Release (void *buffer);
+
+private:
+  friend class DroidBufferPool;
+  struct Pool;
+
+  DroidBuffer (std::shared_ptr<Pool> pool, size_t capacity);
+  ~DroidBuffer ();
+
+  std::shared_ptr<Pool> m_pool;
+  uint8_t *m_data;
+  size_t m_capacity;
+};
+
+class DroidBufferPool
+{
+public:
+  // At most keep released buffers are held for reuse
+  explicit DroidBufferPool (size_t keep = 4);
+  ~DroidBufferPool ();
+
+  // A buffer of at least size bytes. May be called on any thread.
+  DroidBuffer *Acquire (size_t size);
+
+private:
+  std::shared_ptr<DroidBuffer::Pool> m_pool;
+};
+
+// Compressed data: decoder input and encoder output
+struct DroidPacket
+{
+  uint8_t *data = nullptr;
+  size_t size = 0;
+  // In microseconds
+  int64_t ts = 0;
+  uint64_t duration = 0;
+  bool keyFrame = false;
+  // Decoder input: size of the H.264 NAL length fields (1, 2 or 4), 0 for
+  // Annex B start codes. Length fields are rewritten in place.
+  int nalLengthSize = 0;
+  // Encoder output: last piece of the access unit
+  bool complete = true;
+  // Called once the data is no longer needed, on any thread
+  void (*release) (void *opaque) = nullptr;
+  void *opaque = nullptr;
+
+  void Release () const { if (release) release (opaque); }
+};
+
+enum DroidPictureLayout
+{
+  // Y, U and V planes
+  DROID_LAYOUT_I420,
+  // Y plane and interleaved UV plane, in planes 0 and 1
+  DROID_LAYOUT_NV12,
+};
+
+// An uncompressed picture: encoder input, or decoder output converted
+// into a pooled buffer
+struct DroidPicture
+{
+  DroidPlanes planes;
+  DroidPictureLayout layout = DROID_LAYOUT_I420;
+  int32_t width = 0;
+  int32_t height = 0;
+  // In microseconds
+  int64_t ts = 0;
+  uint64_t duration = 0;
+  // Encoder input: request a keyframe
+  bool keyFrame = false;
+  // Called once the planes are no longer needed, on any thread
+  void (*release) (void *opaque) = nullptr;
+  void *opaque = nullptr;
+
+  void Release () const { if (release) release (opaque); }
+};
+
+/*
+ * Decoder
+ */
+
+struct DroidDecoderSettings
+{
+  DroidCodecType codec = DROID_CODEC_H264;
+  int32_t width = 0;
+  int32_t height = 0;
+  // Maximum frame rate, 0 if not known
+  uint32_t fps = 0;
+  // H.264 avcC record, copied by Init ()
+  const uint8_t *codecData = nullptr;
+  size_t codecDataSize = 0;
+};
+
+// A picture straight from the hardware decoder. Only valid during the
+// DroidDecoderListener::Decoded () call it is passed to.
+class DroidDecodedFrame
+{
+public:
+  virtual int64_t Timestamp () const = 0;
+  virtual uint64_t Duration () const = 0;
+  // Size of the picture converted at full or half size
+  virtual int32_t Width (bool half = false) const = 0;
+  virtual int32_t Height (bool half = false) const = 0;
+  // Plane strides at which a full size conversion is a plain copy
+  virtual int32_t Stride (int plane) const = 0;
+
+  // Convert to I420 planes of Width (half) x Height (half)
+  virtual bool Convert (const DroidPlanes & out, bool half = false) = 0;
+  // The cropped planes in the decoder's buffer, without conversion. False
+  // when the decoder's layout is neither I420 nor NV12.
+  virtual bool Planes (DroidPictureLayout & layout, DroidPlanes & planes)
+      const = 0;
+  // Convert to a pooled picture, which the caller releases
+  bool Convert (DroidBufferPool & pool, DroidPicture & picture,
+      bool half = false);
+
+protected:
+  ~DroidDecodedFrame () { }
+};
+
+class DroidDecoderListener
+{
+public:
+  virtual ~DroidDecoderListener () { }
+
+  // A decoded picture. Called on a codec thread, which is blocked until
+  // the call returns; Reset () and Stop () wait for it.
+  virtual void Decoded (DroidDecodedFrame & frame) = 0;
+  // A packet queued with notify set has been consumed and the decoder is
+  // ready for more input. While many packets are waiting for the codec,
+  // this is held back until there is room, so callers that wait for it
+  // never queue more than a few packets.
+  virtual void InputConsumed () = 0;
+  virtual void DrainComplete () = 0;
+  virtual void ResetComplete () = 0;
+  virtual void Error (DroidCoreError error) = 0;
+};
+
+class DroidDecoder
+{
+public:
+  static DroidDecoder *Create (DroidDecoderListener * listener);
+  // Stops the decoder and waits for the queued work
+  virtual ~DroidDecoder () { }
+
+  virtual bool Init (const DroidDecoderSettings & settings) = 0;
+  // Queue a packet. Validation, bitstream rewriting and the hardware
+  // codec are run on worker threads, so this does not touch the data.
+  virtual void Decode (const DroidPacket & packet, bool notify = true) = 0;
+  // Output the queued packets, then call DrainComplete ()
+  virtual void Drain () = 0;
+  // Discard queued packets and pending output, then call ResetComplete ()
+  virtual void Reset () = 0;
+  // Release the hardware codec. No callbacks are made after this.
+  virtual void Stop () = 0;
+  // Log decoding statistics
+  virtual void ReportStats () = 0;
+};
+
+/*
+ * Encoder
+ */
+
+enum DroidEncoderMode
+{
+  // Low latency, e.g. video calls
+  DROID_ENCODER_REALTIME,
+  DROID_ENCODER_SCREENSHARE,
+  // Compression over latency, e.g. recording
+  DROID_ENCODER_RECORDING,
+};
+
+struct DroidEncoderSettings
+{
+  DroidCodecType codec = DROID_CODEC_H264;
+  int32_t width = 0;
+  int32_t height = 0;
+  // Maximum frame rate, 0 if not known
+  uint32_t fps = 0;
+  // Target bitrate in kbps
+  uint32_t bitrate = 0;
+  DroidEncoderMode mode = DROID_ENCODER_REALTIME;
+  // Frames between keyframes, 0 to pick one for the mode
+  int32_t keyFrameInterval = 0;
+  // Replace H.264 start codes with 32-bit NAL lengths in host byte order,
+  // the framing GMP expects
+  bool nalLengthPrefix = false;
+
+  // Drop keyframe requests repeating one answered by the previous frame
+  bool coalesceKeyFrames = false;
+  // Temporal denoise of the input, 0 disables, 1-2 increase strength
+  int denoiseStrength = 0;
+  // Pixel difference treated as motion by the denoiser
+  int denoiseThreshold = 12;
+  // Measure luma PSNR/SSIM on every Nth frame, 0 disables
+  int qualityInterval = 0;
+  // Encode high resolution recordings on two instances, a GOP each
+  bool gopParallel = true;
+  // Deliver realtime H.264 access units split by the encoder piece by piece
+  bool sliceOutput = false;
+  // CPU cores available for packing large input pictures
+  int cores = 1;
+};
+
+class DroidEncoderListener
+{
+public:
+  virtual ~DroidEncoderListener () { }
+
+  // An encoded access unit, or a piece of one in slice output mode, in
+  // decoding order. Called on a codec thread, which waits for the call to
+  // return, so the packet should be handed on rather than processed here.
+  // The listener releases the packet.
+  virtual void Encoded (const DroidPacket & packet) = 0;
+  virtual void Error (DroidCoreError error) = 0;
+};
+
+class DroidEncoder
+{
+public:
+  static DroidEncoder *Create (DroidEncoderListener * listener);
+  // Stops the encoder
+  virtual ~DroidEncoder () { }
+
+  virtual bool Init (const DroidEncoderSettings & settings) = 0;
+  // Layout the hardware encoder takes, known after Init (). Pictures in
+  // this layout are copied in as they are, others are converted.
+  virtual DroidPictureLayout InputLayout () const = 0;
+  // Queue a picture of the configured size. The hardware codec is created
+  // on the first call. Returns false if it couldn't be, in which case the
+  // picture has been released. Never blocks: while the codec is too far
+  // behind, pictures are released without being encoded.
+  virtual bool Encode (const DroidPicture & picture) = 0;
+  // Target bitrate in kbps
+  virtual void SetRates (uint32_t bitrate) = 0;
+  virtual void SetPeriodicKeyFrames (bool enable) = 0;
+  // Release the hardware codecs, after waiting for a callback in progress.
+  // Frames still being encoded are not waited for; wait for their output
+  // first to have it. No callbacks are made after this. The next Encode ()
+  // starts over.
+  virtual void Stop () = 0;
+};
+
+#endif
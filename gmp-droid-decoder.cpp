@@ -0,0 +1,810 @@
+/****************************************************************************
+**
+** Copyright (c) 2020-2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <set>
+#include <vector>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "droidmediacodec.h"
+
+#include "gmp-droid-core.h"
+#include "gmp-droid-bitstream.h"
+#include "gmp-droid-budget.h"
+#include "gmp-droid-conv.h"
+#include "gmp-droid-history.h"
+#include "gmp-droid-lock.h"
+#include "gmp-droid-log.h"
+#include "gmp-droid-media.h"
+#include "gmp-droid-pipeline.h"
+#include "gmp-droid-quirks.h"
+#include "gmp-task-utils.h"
+
+// Compressed input buffers kept for reuse
+#define INPUT_POOL_KEEP 8
+// Packets waiting for the parse stage, about what the codec input queue
+// holds. Callers off the main thread block beyond it.
+#define PARSE_QUEUE_DEPTH 8
+// Packets taken by Decode () and not yet queued to the codec. Beyond this
+// InputConsumed () is held back until there is room, which is how the
+// main thread, which never blocks, is kept from queueing more.
+#define INPUT_QUEUE_DEPTH 8
+// Delta frames dropped after a corrupt frame while waiting for a keyframe.
+// Realtime streams may not send one unasked, so past this the deltas are
+// decoded with whatever artifacts they carry.
+#define KEYFRAME_WAIT_MAX_FRAMES 30
+
+// Codec output wrapped for the listener
+class DroidMediaDecodedFrame : public DroidDecodedFrame
+{
+public:
+  DroidMediaDecodedFrame (DroidColourConvert * conv, DroidMediaData * data,
+      int64_t ts, uint64_t duration)
+      : m_conv (conv), m_data (data), m_ts (ts), m_duration (duration) { }
+
+  using DroidDecodedFrame::Convert;
+
+  int64_t Timestamp () const override { return m_ts; }
+  uint64_t Duration () const override { return m_duration; }
+
+  int32_t Width (bool half) const override
+  {
+    return half ? (m_conv->m_width + 1) / 2 : m_conv->m_width;
+  }
+
+  int32_t Height (bool half) const override
+  {
+    return half ? (m_conv->m_height + 1) / 2 : m_conv->m_height;
+  }
+
+  int32_t Stride (int plane) const override
+  {
+    return m_conv->Stride (plane);
+  }
+
+  bool Convert (const DroidPlanes & out, bool half) override
+  {
+    if (half)
+      return m_conv->ConvertHalf (m_data, out);
+    return m_conv->Convert (m_data, out);
+  }
+
+  bool Planes (DroidPictureLayout & layout, DroidPlanes & planes)
+      const override
+  {
+    return m_conv->Planes (m_data, layout, planes);
+  }
+
+private:
+  DroidColourConvert *m_conv;
+  DroidMediaData *m_data;
+  int64_t m_ts;
+  uint64_t m_duration;
+};
+
+class DroidMediaDecoder : public DroidDecoder
+{
+public:
+  explicit DroidMediaDecoder (DroidDecoderListener * listener)
+      : m_listener (listener),
+        m_codec_lock (DroidCreateMutex ("decoder m_codec_lock"))
+  {
+    memset (&m_metadata, 0x0, sizeof (m_metadata));
+  }
+
+  ~DroidMediaDecoder ()
+  {
+    Stop ();
+    // Parse feeds submit, so it is joined first
+    m_parse.Join ();
+    m_submit.Join ();
+    ReleaseBudget ();
+    free (m_metadata.codec_data.data);
+    delete m_conv;
+    m_codec_lock->Destroy ();
+  }
+
+  bool Init (const DroidDecoderSettings & settings) override
+  {
+    m_metadata.parent.flags =
+        static_cast <DroidMediaCodecFlags> (DROID_MEDIA_CODEC_HW_ONLY | DROID_MEDIA_CODEC_NO_MEDIA_BUFFER);
+
+    switch (settings.codec) {
+      case DROID_CODEC_VP8:
+        m_metadata.parent.type = "video/x-vnd.on2.vp8";
+        break;
+      case DROID_CODEC_VP9:
+        m_metadata.parent.type = "video/x-vnd.on2.vp9";
+        break;
+      case DROID_CODEC_H264:
+      default:
+        m_metadata.parent.type = "video/avc";
+        break;
+    }
+
+    m_quirks = DroidGetQuirks (m_metadata.parent.type, false);
+    // Set codec parameters
+    m_metadata.parent.width = settings.width;
+    m_metadata.parent.height = settings.height;
+
+    if (settings.fps) {
+      /* variable fps with a max-framerate */
+      m_metadata.parent.fps = settings.fps;
+    }
+
+    free (m_metadata.codec_data.data);
+    m_metadata.codec_data.data = nullptr;
+    m_metadata.codec_data.size = 0;
+    if (settings.codecDataSize && settings.codec == DROID_CODEC_H264) {
+      // Copy AVCC data
+      m_metadata.codec_data.size = settings.codecDataSize;
+      m_metadata.codec_data.data = malloc (settings.codecDataSize);
+      memcpy (m_metadata.codec_data.data, settings.codecData,
+          settings.codecDataSize);
+      LOG (DEBUG, "Got H264 codec data size: " << settings.codecDataSize);
+    }
+    LOG (INFO,
+        "InitDecode: Codec metadata prepared: " << m_metadata.parent.type
+        << " width=" << m_metadata.parent.width
+        << " height=" << m_metadata.parent.height
+        << " fps=" << m_metadata.parent.fps
+        << " extra=" << m_metadata.codec_data.size);
+
+    // Check that the requested codec is actually available on this device
+    if (!droid_media_codec_is_supported (&m_metadata.parent, false)) {
+      LOG (ERROR, "Codec not supported");
+      return false;
+    }
+
+    // Take the hardware slot here, so an exhausted budget fails Init where
+    // the caller can still pick another decoder, rather than the first
+    // frame. The slot is kept across codec resets until Stop ().
+    if (!m_budgetHeld) {
+      if (!DroidBudgetAcquire (false, DROID_BUDGET_NORMAL, m_budgetSlot)) {
+        LOG (ERROR, "Hardware decoder budget exhausted");
+        return false;
+      }
+      m_budgetHeld = true;
+    }
+    return true;
+  }
+
+  // Bitstream preprocessing and the copy to codec memory are done on the
+  // parse stage, so Decode returns without touching the payload.
+  void Decode (const DroidPacket & packet, bool notify) override
+  {
+    m_codec_lock->Acquire ();
+    m_pendingPackets++;
+    m_codec_lock->Release ();
+
+    GMPErr err = m_parse.Post (WrapTask (this,
+            &DroidMediaDecoder::PrepareBuffer, packet, notify));
+    if (err != GMPNoErr) {
+      LOG (ERROR, "Couldn't create new thread");
+      m_listener->Error (DROID_ERROR_GENERIC);
+      packet.Release ();
+      PacketDone (false);
+    }
+  }
+
+  // Lifecycle operations pass through the parse stage to the submit stage,
+  // so they stay in order with the packets. Flags are set before the hop
+  // so that packets still in flight are discarded instead of being decoded.
+  void Reset () override
+  {
+    m_codec_lock->Acquire ();
+    if (!m_resetting) {
+      m_resetting = true;
+      m_parse.Post (WrapTask (this, &DroidMediaDecoder::ResetParse));
+    }
+    m_codec_lock->Release ();
+  }
+
+  void Drain () override
+  {
+    // m_draining is set on the submit stage, after the packets queued
+    // before this call have been submitted
+    m_parse.Post (WrapTask (this, &DroidMediaDecoder::DrainParse));
+  }
+
+  void Stop () override
+  {
+    m_codec_lock->Acquire ();
+    if (!m_stopped) {
+      m_stopped = true;
+      m_session.Finish ();
+      m_resetting = true;
+      if (m_parse.Active ())
+        m_parse.Post (WrapTask (this, &DroidMediaDecoder::ResetParse));
+      else
+        ReleaseBudget ();
+    }
+    m_codec_lock->Release ();
+  }
+
+  void ReportStats () override
+  {
+    LOG (INFO, "Decoder stats: " << m_metadata.parent.type
+        << " decoded=" << m_decodedFrames
+        << " dropped_corrupt=" << m_droppedFrames);
+    LOG (INFO, "  " << m_parse.Stats ());
+    LOG (INFO, "  " << m_submit.Stats ());
+  }
+
+private:
+  // Called on the parse stage
+  void PrepareBuffer (DroidPacket packet, bool notify)
+  {
+    const bool isH264 = !strcmp (m_metadata.parent.type, "video/avc");
+    const bool isVP9 = !strcmp (m_metadata.parent.type, "video/x-vnd.on2.vp9");
+    // Cheap structural check so corrupt packets never reach the hardware
+    bool valid = true;
+
+    if (isH264 && packet.nalLengthSize) {
+      // H264: Replace each NAL length with the start code
+      // The length is in network byte order
+      const uint32_t start_code_len = packet.nalLengthSize;
+      if (start_code_len != 1 && start_code_len != 2 && start_code_len != 4) {
+        LOG (ERROR, "Unsupported H264 buffer size");
+        m_session.Error ();
+        m_listener->Error (DROID_ERROR_DECODE);
+        packet.Release ();
+        PacketDone (false);
+        return;
+      }
+
+      uint32_t offset = 0;
+      while (offset < packet.size) {
+        // Get NAL length
+        uint32_t len = 0;
+
+        if (offset + start_code_len > packet.size) {
+          LOG (DEBUG, "Truncated NAL length at " << offset);
+          valid = false;
+          break;
+        }
+
+        switch (start_code_len) {
+          case 4:
+            len = ntohl (*(reinterpret_cast <int32_t *>(packet.data + offset)));
+            break;
+
+          case 2:
+            len = ntohs (*(reinterpret_cast <int16_t *>(packet.data + offset)));
+            break;
+
+          default:
+            len = packet.data[offset];
+            break;
+        }
+
+        if (len == 1) {
+          // Start code already processed
+          LOG (DEBUG, "NAL start code found. Skipping");
+          valid = DroidValidateH264AnnexB (packet.data + offset,
+              packet.size - offset);
+          break;
+        } else if (offset + start_code_len + len > packet.size) {
+          // Make sure that we won't run out of space in the buffer
+          LOG (DEBUG,
+              "NAL length more than buffer size: " << len << " bytes");
+          valid = false;
+          break;
+        } else if (!DroidValidateH264Nal (packet.data + offset
+                + start_code_len, len)) {
+          LOG (DEBUG, "Invalid NAL header at " << offset);
+          valid = false;
+          break;
+        } else {
+            // Write NAL start code over the length
+          static const uint8_t code[] = { 0x00, 0x00, 0x00, 0x01 };
+          const uint8_t *start_code = code + (4 - start_code_len);
+          memcpy (packet.data + offset, start_code, start_code_len);
+          offset += start_code_len + len;
+
+          LOG (DEBUG, "Parsed nal unit of size " << len);
+        }
+      }
+    } else if (isH264) {
+      valid = DroidValidateH264AnnexB (packet.data, packet.size);
+    } else if (!isVP9) {
+      valid = DroidValidateVP8Frame (packet.data, packet.size);
+    }
+
+    std::vector<DroidVP9SubFrame> subFrames;
+    if (isVP9) {
+      if (DroidParseVP9Superframe (packet.data, packet.size, subFrames)) {
+        for (const DroidVP9SubFrame & f : subFrames) {
+          valid = valid && DroidValidateVP9Frame (packet.data + f.offset,
+              f.size);
+        }
+      } else {
+        valid = DroidValidateVP9Frame (packet.data, packet.size);
+      }
+    }
+
+    // After a corrupt frame, delta frames are dropped until the next
+    // keyframe as they would only reference broken pictures
+    if (!valid) {
+      m_waitKeyFrame = true;
+      m_waitFrames = 0;
+    } else if (m_waitKeyFrame && packet.keyFrame) {
+      LOG (INFO, "Keyframe received, resuming decoding");
+      m_waitKeyFrame = false;
+    } else if (m_waitKeyFrame && ++m_waitFrames > KEYFRAME_WAIT_MAX_FRAMES) {
+      LOG (INFO, "No keyframe in " << KEYFRAME_WAIT_MAX_FRAMES
+          << " frames, resuming decoding at a delta frame");
+      m_waitKeyFrame = false;
+    }
+
+    if (!valid || m_waitKeyFrame) {
+      m_droppedFrames++;
+      m_session.Dropped ();
+      LOG (INFO, "Dropping " << (valid ? "delta" : "corrupt")
+          << " frame ts: " << packet.ts
+          << " dropped: " << m_droppedFrames);
+      packet.Release ();
+      PacketDone (notify);
+      return;
+    }
+
+    const int64_t ts = packet.ts;
+    const bool sync = packet.keyFrame;
+
+    if (!subFrames.empty ()) {
+      // Submit the frames of a superframe one by one. Hidden frames (e.g.
+      // alt-ref) get their own timestamps so that any output the decoder
+      // produces for them can be dropped before conversion.
+      LOG (DEBUG, "VP9 superframe with " << subFrames.size () << " frames");
+      int64_t hiddenTs = ts;
+      for (size_t i = 0; i < subFrames.size (); i++) {
+        const DroidVP9SubFrame & f = subFrames[i];
+        SubmitBuffer (packet.data + f.offset, f.size,
+            f.shown ? ts : --hiddenTs, packet.duration, f.shown,
+            sync && i == 0, i + 1 == subFrames.size (), notify);
+      }
+    } else {
+      SubmitBuffer (packet.data, packet.size, ts, packet.duration, true, sync,
+          true, notify);
+    }
+
+    packet.Release ();
+  }
+
+  // Called on the parse stage. Copies the frame to codec memory so the
+  // packet can be released before the submit stage gets to it. last is
+  // set for the last frame of the packet.
+  void SubmitBuffer (const uint8_t * buf, uint32_t size, int64_t ts,
+      uint64_t duration, bool shown, bool sync, bool last, bool notify)
+  {
+    DroidMediaBufferCallbacks cb;
+    DroidMediaCodecData cdata;
+
+    DroidBuffer *buffer = m_inputPool.Acquire (size);
+    memcpy (buffer->Data (), buf, size);
+    cdata.data.size = size;
+    cdata.data.data = buffer->Data ();
+    cdata.ts = ts;
+    cdata.sync = sync;
+
+    cb.data = buffer;
+    cb.unref = DroidBuffer::Release;
+
+    if (m_submit.Post (WrapTask (this, &DroidMediaDecoder::SubmitBufferThread,
+                cdata, cb, duration, shown, last, notify)) != GMPNoErr) {
+      LOG (ERROR, "Couldn't create new thread");
+      m_listener->Error (DROID_ERROR_GENERIC);
+      cb.unref (cb.data);
+      if (last)
+        PacketDone (false);
+    }
+  }
+
+  // Called on the submit stage, which runs on the blocking workers as
+  // queueing blocks while the codec input is full
+  void SubmitBufferThread (DroidMediaCodecData cdata,
+      DroidMediaBufferCallbacks cb, uint64_t duration, bool shown, bool last,
+      bool notify)
+  {
+    m_codec_lock->Acquire ();
+
+    if (m_resetting || m_draining || (!m_codec && !CreateCodec ())) {
+      LOG (ERROR, "Buffer submitted while draining or resetting");
+      cb.unref (cb.data);
+      m_codec_lock->Release ();
+      if (last)
+        PacketDone (false);
+      return;
+    }
+
+    // Android doesn't pass duration through the codec - we'll have to keep
+    // it. Only shown frames have output to wait for, so a superframe of
+    // hidden frames records no duration that would hold up the drain.
+    if (shown)
+      m_dur[cdata.ts] = duration;
+    else
+      m_hidden.insert (cdata.ts);
+
+    m_codec_lock->Release ();
+
+    if (shown)
+      m_session.FrameIn (cdata.ts);
+
+    // This blocks when the input Source is full
+    droid_media_codec_queue (m_codec, &cdata, &cb);
+
+    if (last)
+      PacketDone (notify);
+  }
+
+  // A packet has been queued to the codec or dropped. The notifications
+  // owed for it and the packets before it go out once the packets still
+  // waiting fit in INPUT_QUEUE_DEPTH.
+  void PacketDone (bool notify)
+  {
+    int consumed = 0;
+    m_codec_lock->Acquire ();
+    m_pendingPackets--;
+    if (notify)
+      m_owedNotify++;
+    if (m_draining || m_stopped) {
+      m_owedNotify = 0;
+    } else if (m_pendingPackets < INPUT_QUEUE_DEPTH) {
+      consumed = m_owedNotify;
+      m_owedNotify = 0;
+    } else if (notify) {
+      LOG (DEBUG, "Input queue full, " << m_pendingPackets
+          << " packets waiting");
+    }
+    m_codec_lock->Release ();
+
+    while (consumed-- > 0)
+      m_listener->InputConsumed ();
+  }
+
+  void ReleaseBudget ()
+  {
+    DroidBudgetRelease (m_budgetSlot);
+    m_budgetSlot = -1;
+    m_budgetHeld = false;
+  }
+
+  bool CreateCodec ()
+  {
+    m_codec = droid_media_codec_create_decoder (&m_metadata);
+    if (!m_codec) {
+      LOG (ERROR, "Failed to start the decoder");
+      m_session.Error ();
+      m_listener->Error (DROID_ERROR_DECODE);
+      return false;
+    }
+
+    LOG (INFO, "Codec created for " << m_metadata.parent.type);
+
+    {
+      DroidMediaCodecCallbacks cb;
+      memset(&cb, 0, sizeof(cb));
+      cb.error = DroidMediaDecoder::DroidError;
+      cb.size_changed = DroidMediaDecoder::SizeChanged;
+      cb.signal_eos = DroidMediaDecoder::SignalEOS;
+      droid_media_codec_set_callbacks (m_codec, &cb, this);
+    }
+
+    {
+      DroidMediaCodecDataCallbacks cb;
+      memset(&cb, 0, sizeof(cb));
+      cb.data_available = DroidMediaDecoder::DataAvailable;
+      droid_media_codec_set_data_callbacks (m_codec, &cb, this);
+    }
+    // Reset state
+    m_draining = false;
+
+    if (!droid_media_codec_start (m_codec)) {
+      droid_media_codec_destroy (m_codec);
+      m_codec = nullptr;
+      LOG (ERROR, "Failed to start the decoder");
+      m_session.Error ();
+      m_listener->Error (DROID_ERROR_DECODE);
+      return false;
+    }
+    LOG (DEBUG, "Codec started for " << m_metadata.parent.type);
+    m_session.Start (m_metadata.parent.type, m_metadata.parent.width,
+        m_metadata.parent.height);
+    return true;
+  }
+
+  void ConfigureOutput ()
+  {
+    DroidMediaCodecMetaData md;
+    DroidMediaRect rect;
+    memset (&md, 0x0, sizeof (md));
+    memset (&rect, 0x0, sizeof (rect));
+    droid_media_codec_get_output_info (m_codec, &md, &rect);
+    LOG (INFO,
+        "ConfigureOutput: Configuring converter for stride:" << md.width
+        << " slice-height: " << md.height << " top: " << rect.top
+        << " left:" << rect.left << " width: " << rect.right - rect.left
+        << " height: " << rect.bottom - rect.top << " format: " << md.hal_format);
+    const char *convName;
+    m_conv = DroidColourConvert::GetConverter (&md, &rect, &convName,
+        m_quirks.nativeConvert, m_quirks.strideAlign, m_quirks.sliceAlign);
+    LOG (INFO, "Colour converter class: " << convName);
+    if (m_conv)
+      m_session.SetConverter (convName);
+  }
+
+  void RequestNewConverter ()
+  {
+    LOG (DEBUG, "Resetting converter");
+    m_dropConverter = true;
+  }
+
+  // Called on a codec thread
+  void ProcessFrame (DroidMediaCodecData * decoded)
+  {
+    m_codec_lock->Acquire ();
+
+    // Delete the current colour converter if requested
+    if (m_dropConverter) {
+      if (m_conv)
+        delete m_conv;
+      m_conv = nullptr;
+      m_dropConverter = false;
+    }
+
+    if (m_resetting) {
+        LOG(INFO, "Discarding decoded frame received while resetting");
+        m_codec_lock->Release ();
+        return;
+    }
+
+    // Drop output for hidden VP9 frames without converting it
+    const int64_t ts = decoded->ts / 1000;
+    if (!m_hidden.empty ()) {
+      std::set <int64_t>::iterator hiddenIt = m_hidden.find (ts);
+      if (hiddenIt != m_hidden.end ()) {
+        LOG (DEBUG, "Dropping output of hidden frame ts: " << ts);
+        m_hidden.erase (hiddenIt);
+        m_codec_lock->Release ();
+        return;
+      }
+      // Hidden frames preceding a shown frame produced no output
+      m_hidden.erase (m_hidden.begin (), m_hidden.upper_bound (ts));
+    }
+
+    // Look up duration in our cache
+    uint64_t dur = 0;
+    std::map <int64_t, uint64_t>::iterator durIt = m_dur.find (ts);
+    if (durIt != m_dur.end ()) {
+      dur = durIt->second;
+      m_dur.erase (durIt);
+    }
+    const size_t pending = m_dur.size ();
+
+    // ResetCodec () waits for the frame before destroying the codec
+    m_processing = true;
+    m_codec_lock->Release ();
+
+    if (!m_conv) {
+      ConfigureOutput ();
+    }
+    // Bail out if that didn't work
+    if (!m_conv) {
+      LOG (CRITICAL, "Converter not found");
+      m_session.Error ();
+      m_listener->Error (DROID_ERROR_DECODE);
+    } else {
+      DroidMediaDecodedFrame frame (m_conv, &decoded->data, ts, dur);
+      m_listener->Decoded (frame);
+      m_decodedFrames++;
+      m_session.FrameOut (ts);
+    }
+
+    m_codec_lock->Acquire ();
+    m_processing = false;
+    // Wake up ResetCodec() if it is waiting for this frame
+    m_processing_done.notify_all ();
+    // TODO: we never get the buffers down to 0 with the current SimpleDecodingSource, but EOS will do it
+    const bool drained = pending == 0 && m_draining && !m_resetting;
+    if (drained)
+      m_draining = false;
+    else
+      LOG (DEBUG, "Buffers still out " << pending);
+    m_codec_lock->Release ();
+
+    if (drained)
+      m_listener->DrainComplete ();
+  }
+
+  // Called on the parse stage
+  void ResetParse ()
+  {
+    m_waitKeyFrame = false;
+    m_submit.Post (WrapTask (this, &DroidMediaDecoder::ResetCodec));
+  }
+
+  // Called on the parse stage
+  void DrainParse ()
+  {
+    m_submit.Post (WrapTask (this, &DroidMediaDecoder::DrainCodec));
+  }
+
+  // Called on the submit stage
+  void ResetCodec ()
+  {
+    DroidMediaCodec *codec = nullptr;
+
+    m_codec_lock->Acquire ();
+    m_resetting = true;
+
+    // A frame that started processing before the reset is with the
+    // listener. No new one can start as m_resetting is set, so wait for it
+    // here rather than rescheduling the reset.
+    {
+      GMPMutexLockable lock (m_codec_lock);
+      m_processing_done.wait (lock, [this] { return !m_processing; });
+    }
+
+    if (m_codec) {
+      codec = m_codec;
+      m_codec = nullptr;
+    }
+    m_codec_lock->Release ();
+
+    if (codec) {
+      LOG (DEBUG, "Codec draining");
+      droid_media_codec_drain (codec);
+      LOG (DEBUG, "Codec stopping");
+      droid_media_codec_stop (codec);
+      LOG (DEBUG, "Destroying codec");
+      droid_media_codec_destroy (codec);
+      LOG (DEBUG, "Codec destroyed");
+    }
+
+    m_session.Flush ();
+    m_codec_lock->Acquire ();
+    m_dur.clear ();
+    m_hidden.clear ();
+    RequestNewConverter ();
+    // The caller waits for ResetComplete () instead
+    m_owedNotify = 0;
+    m_draining = false;
+    // A stopped decoder keeps discarding
+    m_resetting = m_stopped;
+    const bool stopped = m_stopped;
+    m_codec_lock->Release ();
+
+    if (!stopped)
+      m_listener->ResetComplete ();
+    else
+      ReleaseBudget ();
+  }
+
+  // Called on the submit stage
+  void DrainCodec ()
+  {
+    m_codec_lock->Acquire ();
+    if (m_draining || m_stopped) {
+      m_codec_lock->Release ();
+      return;
+    }
+    m_draining = true;
+    m_owedNotify = 0;
+    DroidMediaCodec *codec = m_codec;
+    m_codec_lock->Release ();
+
+    if (codec) {
+      droid_media_codec_drain (codec);
+    }
+
+    //TODO: This never happens because the codec never really drains, except for EOS
+    m_codec_lock->Acquire ();
+    const bool drained = m_draining && (!m_codec || m_dur.empty ());
+    if (drained)
+      m_draining = false;
+    m_codec_lock->Release ();
+
+    if (drained)
+      m_listener->DrainComplete ();
+  }
+
+  // Called on a codec thread
+  void EOS ()
+  {
+    LOG (DEBUG, "Codec EOS");
+    m_codec_lock->Acquire ();
+    m_dur.clear ();
+    const bool drained = m_draining && !m_resetting;
+    m_draining = false;
+    m_codec_lock->Release ();
+
+    if (drained)
+      m_listener->DrainComplete ();
+  }
+
+  /*
+   * Droidmedia callbacks
+   */
+  static void
+  DataAvailable (void *data, DroidMediaCodecData * decoded)
+  {
+    DroidMediaDecoder *decoder = (DroidMediaDecoder *) data;
+    decoder->ProcessFrame (decoded);
+  }
+
+  static int
+  SizeChanged (void *data, int32_t width, int32_t height)
+  {
+    DroidMediaDecoder *decoder = (DroidMediaDecoder *) data;
+    LOG (INFO, "Received size changed " << width << " x " << height);
+    decoder->RequestNewConverter ();
+    return 0;
+  }
+
+  static void
+  DroidError (void *data, int err)
+  {
+    DroidMediaDecoder *decoder = (DroidMediaDecoder *) data;
+    LOG (ERROR, "Droidmedia error");
+    decoder->m_session.Error ();
+    decoder->m_listener->Error (DROID_ERROR_DECODE);
+  }
+
+  static void
+  SignalEOS (void *data)
+  {
+    DroidMediaDecoder *decoder = (DroidMediaDecoder *) data;
+    decoder->EOS ();
+  }
+
+  DroidDecoderListener *m_listener;
+  GMPMutex *m_codec_lock;
+  // Stages: parse -> submit -> hardware decode -> listener
+  DroidStage m_parse { "decoder parse", DROID_STAGE_WORKER,
+      PARSE_QUEUE_DEPTH };
+  DroidStage m_submit { "decoder submit", DROID_STAGE_BLOCKING };
+  DroidBufferPool m_inputPool { INPUT_POOL_KEEP };
+  DroidMediaCodecDecoderMetaData m_metadata;
+  DroidMediaCodec *m_codec = nullptr;
+  // Hardware codec budget slot, held from Init until the codec is gone
+  int m_budgetSlot = -1;
+  bool m_budgetHeld = false;
+  // Used on codec threads only
+  DroidColourConvert *m_conv = nullptr;
+  bool m_dropConverter = false;
+  bool m_draining = false;
+  bool m_resetting = false;
+  bool m_stopped = false;
+  bool m_processing = false;
+  std::condition_variable_any m_processing_done;
+  // Packets between Decode () and the codec, and InputConsumed () calls
+  // held back while there are too many
+  int m_pendingPackets = 0;
+  int m_owedNotify = 0;
+  std::map <int64_t, uint64_t> m_dur;
+  // Timestamps given to hidden VP9 frames
+  std::set <int64_t> m_hidden;
+  // Parse stage only
+  bool m_waitKeyFrame = false;
+  int m_waitFrames = 0;
+  uint64_t m_droppedFrames = 0;
+  uint64_t m_decodedFrames = 0;
+  DroidQuirks m_quirks;
+  DroidSessionStats m_session { "decoder" };
+};
+
+DroidDecoder *
+DroidDecoder::Create (DroidDecoderListener * listener)
+{
+  return new DroidMediaDecoder (listener);
+}
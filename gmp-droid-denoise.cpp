@@ -0,0 +1,212 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <cstring>
+
+#include "gmp-droid-denoise.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DENOISE_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define DENOISE_SSE2 1
+#endif
+
+// Rounded average, matching vrhadd/pavgb
+static inline uint8_t
+Avg (uint8_t a, uint8_t b)
+{
+  return (a + b + 1) >> 1;
+}
+
+static inline uint8_t
+FilterPixel (uint8_t cur, uint8_t prev, int strength, uint8_t threshold)
+{
+  uint8_t diff = cur > prev ? cur - prev : prev - cur;
+  if (diff >= threshold)
+    return cur;
+  uint8_t out = Avg (prev, cur);
+  return strength > 1 ? Avg (prev, out) : out;
+}
+
+// Filter n pixels of cur against hist, updating hist and writing out
+static void
+FilterRow (const uint8_t * cur, uint8_t * hist, uint8_t * out, int32_t n,
+    int strength, uint8_t threshold)
+{
+  int32_t x = 0;
+#if defined(DENOISE_NEON)
+  const uint8x16_t thr = vdupq_n_u8 (threshold);
+  for (; x + 16 <= n; x += 16) {
+    uint8x16_t c = vld1q_u8 (cur + x);
+    uint8x16_t p = vld1q_u8 (hist + x);
+    uint8x16_t still = vcltq_u8 (vabdq_u8 (c, p), thr);
+    uint8x16_t f = vrhaddq_u8 (p, c);
+    if (strength > 1)
+      f = vrhaddq_u8 (p, f);
+    f = vbslq_u8 (still, f, c);
+    vst1q_u8 (hist + x, f);
+    vst1q_u8 (out + x, f);
+  }
+#elif defined(DENOISE_SSE2)
+  // diff < threshold  <=>  min (diff, threshold - 1) == diff
+  const __m128i thr = _mm_set1_epi8 ((char) (threshold ? threshold - 1 : 0));
+  const bool none = threshold == 0;
+  for (; x + 16 <= n && !none; x += 16) {
+    __m128i c = _mm_loadu_si128 ((const __m128i *) (cur + x));
+    __m128i p = _mm_loadu_si128 ((const __m128i *) (hist + x));
+    __m128i diff = _mm_or_si128 (_mm_subs_epu8 (c, p), _mm_subs_epu8 (p, c));
+    __m128i still = _mm_cmpeq_epi8 (_mm_min_epu8 (diff, thr), diff);
+    __m128i f = _mm_avg_epu8 (p, c);
+    if (strength > 1)
+      f = _mm_avg_epu8 (p, f);
+    f = _mm_or_si128 (_mm_and_si128 (still, f), _mm_andnot_si128 (still, c));
+    _mm_storeu_si128 ((__m128i *) (hist + x), f);
+    _mm_storeu_si128 ((__m128i *) (out + x), f);
+  }
+#endif
+  for (; x < n; x++) {
+    uint8_t f = FilterPixel (cur[x], hist[x], strength, threshold);
+    hist[x] = f;
+    out[x] = f;
+  }
+}
+
+// As FilterRow, but for a U and V row pair written interleaved to out
+static void
+FilterRowInterleave (const uint8_t * u, const uint8_t * v,
+    uint8_t * histU, uint8_t * histV, uint8_t * out, int32_t n,
+    int strength, uint8_t threshold)
+{
+  int32_t x = 0;
+#if defined(DENOISE_NEON)
+  const uint8x16_t thr = vdupq_n_u8 (threshold);
+  for (; x + 16 <= n; x += 16) {
+    uint8x16x2_t f;
+    uint8x16_t c = vld1q_u8 (u + x);
+    uint8x16_t p = vld1q_u8 (histU + x);
+    uint8x16_t still = vcltq_u8 (vabdq_u8 (c, p), thr);
+    uint8x16_t b = vrhaddq_u8 (p, c);
+    if (strength > 1)
+      b = vrhaddq_u8 (p, b);
+    f.val[0] = vbslq_u8 (still, b, c);
+
+    c = vld1q_u8 (v + x);
+    p = vld1q_u8 (histV + x);
+    still = vcltq_u8 (vabdq_u8 (c, p), thr);
+    b = vrhaddq_u8 (p, c);
+    if (strength > 1)
+      b = vrhaddq_u8 (p, b);
+    f.val[1] = vbslq_u8 (still, b, c);
+
+    vst1q_u8 (histU + x, f.val[0]);
+    vst1q_u8 (histV + x, f.val[1]);
+    vst2q_u8 (out + 2 * x, f);
+  }
+#elif defined(DENOISE_SSE2)
+  const __m128i thr = _mm_set1_epi8 ((char) (threshold ? threshold - 1 : 0));
+  const bool none = threshold == 0;
+  for (; x + 16 <= n && !none; x += 16) {
+    __m128i fu, fv;
+    {
+      __m128i c = _mm_loadu_si128 ((const __m128i *) (u + x));
+      __m128i p = _mm_loadu_si128 ((const __m128i *) (histU + x));
+      __m128i diff = _mm_or_si128 (_mm_subs_epu8 (c, p), _mm_subs_epu8 (p, c));
+      __m128i still = _mm_cmpeq_epi8 (_mm_min_epu8 (diff, thr), diff);
+      __m128i b = _mm_avg_epu8 (p, c);
+      if (strength > 1)
+        b = _mm_avg_epu8 (p, b);
+      fu = _mm_or_si128 (_mm_and_si128 (still, b), _mm_andnot_si128 (still, c));
+    }
+    {
+      __m128i c = _mm_loadu_si128 ((const __m128i *) (v + x));
+      __m128i p = _mm_loadu_si128 ((const __m128i *) (histV + x));
+      __m128i diff = _mm_or_si128 (_mm_subs_epu8 (c, p), _mm_subs_epu8 (p, c));
+      __m128i still = _mm_cmpeq_epi8 (_mm_min_epu8 (diff, thr), diff);
+      __m128i b = _mm_avg_epu8 (p, c);
+      if (strength > 1)
+        b = _mm_avg_epu8 (p, b);
+      fv = _mm_or_si128 (_mm_and_si128 (still, b), _mm_andnot_si128 (still, c));
+    }
+    _mm_storeu_si128 ((__m128i *) (histU + x), fu);
+    _mm_storeu_si128 ((__m128i *) (histV + x), fv);
+    _mm_storeu_si128 ((__m128i *) (out + 2 * x), _mm_unpacklo_epi8 (fu, fv));
+    _mm_storeu_si128 ((__m128i *) (out + 2 * x + 16), _mm_unpackhi_epi8 (fu, fv));
+  }
+#endif
+  for (; x < n; x++) {
+    uint8_t fu = FilterPixel (u[x], histU[x], strength, threshold);
+    uint8_t fv = FilterPixel (v[x], histV[x], strength, threshold);
+    histU[x] = fu;
+    histV[x] = fv;
+    out[2 * x] = fu;
+    out[2 * x + 1] = fv;
+  }
+}
+
+DroidTemporalDenoiser::DroidTemporalDenoiser (int strength, int threshold)
+  : m_strength (strength)
+  , m_threshold (threshold < 0 ? 0 : threshold > 255 ? 255 : threshold)
+{
+}
+
+void
+DroidTemporalDenoiser::Reset ()
+{
+  m_width = 0;
+  m_height = 0;
+  m_histY.clear ();
+  m_histU.clear ();
+  m_histV.clear ();
+}
+
+void
+DroidTemporalDenoiser::Process (const uint8_t * y, int32_t yStride,
+    const uint8_t * u, int32_t uStride,
+    const uint8_t * v, int32_t vStride,
+    int32_t width, int32_t height, uint8_t * out, bool semiPlanar)
+{
+  const int32_t cw = width / 2;
+  const int32_t ch = height / 2;
+  // With no history the threshold of 0 passes every pixel through and
+  // primes the history
+  uint8_t threshold = m_threshold;
+
+  if (width != m_width || height != m_height) {
+    m_width = width;
+    m_height = height;
+    m_histY.assign (width * height, 0);
+    m_histU.assign (cw * ch, 0);
+    m_histV.assign (cw * ch, 0);
+    threshold = 0;
+  }
+
+  for (int32_t row = 0; row < height; row++) {
+    FilterRow (y + row * yStride, &m_histY[row * width], out, width,
+        m_strength, threshold);
+    out += width;
+  }
+
+  for (int32_t row = 0; row < ch; row++) {
+    if (semiPlanar) {
+      FilterRowInterleave (u + row * uStride, v + row * vStride,
+          &m_histU[row * cw], &m_histV[row * cw], out, cw,
+          m_strength, threshold);
+      out += 2 * cw;
+    } else {
+      FilterRow (u + row * uStride, &m_histU[row * cw], out, cw,
+          m_strength, threshold);
+      FilterRow (v + row * vStride, &m_histV[row * cw], out + cw * ch, cw,
+          m_strength, threshold);
+      out += cw;
+    }
+  }
+}
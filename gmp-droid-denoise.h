@@ -0,0 +1,50 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_DENOISE
+#define GMP_DROID_DENOISE
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Motion-adaptive recursive temporal filter for encoder input.
+ *
+ * Each output pixel is blended with the previous filtered frame unless the
+ * difference exceeds the motion threshold, in which case the input pixel is
+ * passed through. Filtering is fused with packing the I420 input into the
+ * encoder input layout, so it adds no extra pass over the frame.
+ */
+class DroidTemporalDenoiser
+{
+public:
+  // strength 1 blends 1/2 of the history, 2 blends 3/4
+  DroidTemporalDenoiser (int strength, int threshold);
+
+  // Filter the I420 planes and write them to out, either as planar I420
+  // or as semi-planar NV12 when semiPlanar is set.
+  void Process (const uint8_t * y, int32_t yStride,
+      const uint8_t * u, int32_t uStride,
+      const uint8_t * v, int32_t vStride,
+      int32_t width, int32_t height, uint8_t * out, bool semiPlanar);
+
+  void Reset ();
+
+private:
+  int m_strength;
+  uint8_t m_threshold;
+  int32_t m_width = 0;
+  int32_t m_height = 0;
+  std::vector<uint8_t> m_histY;
+  std::vector<uint8_t> m_histU;
+  std::vector<uint8_t> m_histV;
+};
+
+#endif
@@ -0,0 +1,1252 @@
+/****************************************************************************
+**
+** Copyright (c) 2020-2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <stdlib.h>
+#include <time.h>
+
+#include "droidmediacodec.h"
+
+#include "gmp-droid-core.h"
+#include "gmp-droid-bitstream.h"
+#include "gmp-droid-budget.h"
+#include "gmp-droid-conv.h"
+#include "gmp-droid-denoise.h"
+#include "gmp-droid-executor.h"
+#include "gmp-droid-gop.h"
+#include "gmp-droid-history.h"
+#include "gmp-droid-lock.h"
+#include "gmp-droid-log.h"
+#include "gmp-droid-media.h"
+#include "gmp-droid-pack.h"
+#include "gmp-droid-pipeline.h"
+#include "gmp-droid-quality.h"
+#include "gmp-droid-quirks.h"
+#include "gmp-task-utils.h"
+
+// Recordings above 1080p are encoded on two instances when possible
+#define GOP_PARALLEL_MIN_PIXELS (1920 * 1088)
+
+// Input above 1080p is packed in bands on several cores
+#define PARALLEL_PACK_MIN_PIXELS (1920 * 1088)
+#define MAX_PACK_BANDS 8
+
+// Raw input buffers kept for reuse. They are large, so only enough for
+// the codec to pick up the next frame while one is being packed.
+#define INPUT_POOL_KEEP 3
+// Encoded output buffers kept for reuse
+#define OUTPUT_POOL_KEEP 8
+// Input pictures packed or queued for the codec. Gecko does not wait for
+// the encoder, so pictures beyond this are dropped rather than queued
+// without bound or made to block the main thread.
+#define INPUT_QUEUE_BYTES (96 * 1024 * 1024)
+#define MIN_INPUT_QUEUE_FRAMES 2
+
+/*
+ * Encoder rate control and GOP selection. droidmedia takes no profile,
+ * level or B-frame settings, so each device uses its own defaults for
+ * those, and only the bitrate mode and the keyframe spacing are chosen.
+ */
+struct EncoderProfile
+{
+  const char *name;
+  // Frames between periodic keyframes, 0 for on demand only
+  int32_t gopFrames;
+  DroidMediaCodecBitrateMode bitrateMode;
+};
+
+// Real-time sessions get CBR and keyframes on demand for the lowest
+// latency, everything else (e.g. recording) VBR with a two second GOP
+static EncoderProfile
+SelectEncoderProfile (const DroidEncoderSettings & settings)
+{
+  EncoderProfile p;
+  const uint32_t fps = settings.fps ? settings.fps : 30;
+
+  if (settings.mode != DROID_ENCODER_RECORDING) {
+    p.name = "realtime";
+    p.gopFrames = 0;
+    p.bitrateMode = DROID_MEDIA_CODEC_BITRATE_CONTROL_CBR;
+  } else {
+    p.name = "recording";
+    p.gopFrames = 2 * fps;
+    p.bitrateMode = DROID_MEDIA_CODEC_BITRATE_CONTROL_VBR;
+  }
+
+  if (settings.keyFrameInterval > 0)
+    p.gopFrames = settings.keyFrameInterval;
+  return p;
+}
+
+/*
+ * Encoder quality probe. Encoded output is decoded by a second hardware
+ * codec instance and every Nth frame is compared with the retained input.
+ * Only the luma planes are compared, so the metrics are Y-PSNR and Y-SSIM.
+ */
+class DroidQualityProbe
+{
+public:
+  DroidQualityProbe (const char *type, int32_t width, int32_t height,
+      int32_t interval)
+      : m_interval (interval)
+  {
+    memset (&m_metadata, 0x0, sizeof (m_metadata));
+    m_metadata.parent.flags =
+        static_cast <DroidMediaCodecFlags> (DROID_MEDIA_CODEC_HW_ONLY | DROID_MEDIA_CODEC_NO_MEDIA_BUFFER);
+    m_metadata.parent.type = type;
+    m_metadata.parent.width = width;
+    m_metadata.parent.height = height;
+    m_lock = DroidCreateMutex ("quality probe m_lock");
+  }
+
+  ~DroidQualityProbe ()
+  {
+    // Output still queued is dropped, Join () runs it on this thread
+    m_lock->Acquire ();
+    m_stopping = true;
+    m_lock->Release ();
+    m_submit.Join ();
+    if (m_codec) {
+      droid_media_codec_stop (m_codec);
+      droid_media_codec_destroy (m_codec);
+    }
+    DroidBudgetRelease (m_budgetSlot);
+    delete m_conv;
+    m_lock->Destroy ();
+  }
+
+  bool Start ()
+  {
+    // Measurement is optional, leave the last hardware slot to playback
+    if (!DroidBudgetAcquire (false, DROID_BUDGET_LOW, m_budgetSlot)) {
+      LOG (INFO, "Quality probe: hardware decoder budget exhausted");
+      return false;
+    }
+
+    m_codec = droid_media_codec_create_decoder (&m_metadata);
+    if (!m_codec) {
+      LOG (ERROR, "Quality probe: failed to create the decoder");
+      return false;
+    }
+
+    {
+      DroidMediaCodecCallbacks cb;
+      memset(&cb, 0, sizeof(cb));
+      cb.size_changed = DroidQualityProbe::SizeChanged;
+      droid_media_codec_set_callbacks (m_codec, &cb, this);
+    }
+
+    {
+      DroidMediaCodecDataCallbacks cb;
+      memset(&cb, 0, sizeof(cb));
+      cb.data_available = DroidQualityProbe::DataAvailable;
+      droid_media_codec_set_data_callbacks (m_codec, &cb, this);
+    }
+
+    if (!droid_media_codec_start (m_codec)) {
+      droid_media_codec_destroy (m_codec);
+      m_codec = nullptr;
+      LOG (ERROR, "Quality probe: failed to start the decoder");
+      return false;
+    }
+    return true;
+  }
+
+  // Called on the encoding thread. Keep the luma of every Nth input frame.
+  void RetainInput (const DroidPicture & picture)
+  {
+    if (m_inputCount++ % m_interval)
+      return;
+
+    const int32_t width = picture.width;
+    const int32_t height = picture.height;
+    const int32_t stride = picture.planes.stride[0];
+    const uint8_t *y = picture.planes.data[0];
+    std::vector<uint8_t> luma (width * height);
+    for (int32_t row = 0; row < height; row++)
+      memcpy (&luma[row * width], y + row * stride, width);
+
+    m_lock->Acquire ();
+    // Bound the retained frames if the probe decoder falls behind
+    if (m_retained.size () >= 8)
+      m_retained.erase (m_retained.begin ());
+    m_retained[picture.ts] = std::move (luma);
+    m_lock->Release ();
+  }
+
+  // Called on a codec thread with the raw encoder output
+  void SubmitEncoded (DroidMediaCodecData * encoded)
+  {
+    DroidMediaCodecData cdata;
+    DroidMediaBufferCallbacks cb;
+
+    memset (&cdata, 0x0, sizeof (cdata));
+    cdata.data.size = encoded->data.size;
+    cdata.data.data = malloc (encoded->data.size);
+    memcpy (cdata.data.data, encoded->data.data, encoded->data.size);
+    // Encoder output is in nanoseconds, the decoder input in microseconds
+    cdata.ts = encoded->ts / 1000;
+    cdata.sync = encoded->sync;
+
+    cb.data = cdata.data.data;
+    cb.unref = free;
+
+    if (m_submit.Post (WrapTask (this,
+            &DroidQualityProbe::SubmitBufferThread, cdata, cb)) != GMPNoErr)
+      free (cdata.data.data);
+  }
+
+  void Report ()
+  {
+    m_lock->Acquire ();
+    if (m_samples) {
+      LOG (INFO, "Quality probe: samples=" << m_samples
+          << " y_psnr_avg=" << m_psnrSum / m_samples
+          << " y_psnr_min=" << m_psnrMin
+          << " y_ssim_avg=" << m_ssimSum / m_samples
+          << " y_ssim_min=" << m_ssimMin);
+    }
+    m_lock->Release ();
+    LOG (INFO, "  " << m_submit.Stats ());
+  }
+
+private:
+  // Called on submit thread
+  void SubmitBufferThread (DroidMediaCodecData cdata,
+      DroidMediaBufferCallbacks cb)
+  {
+    m_lock->Acquire ();
+    const bool stopping = m_stopping;
+    m_lock->Release ();
+    if (stopping) {
+      cb.unref (cb.data);
+      return;
+    }
+
+    // This blocks when the input Source is full
+    droid_media_codec_queue (m_codec, &cdata, &cb);
+  }
+
+  // Called on a codec thread
+  void Compare (DroidMediaCodecData * decoded)
+  {
+    if (m_dropConverter) {
+      delete m_conv;
+      m_conv = nullptr;
+      m_dropConverter = false;
+    }
+
+    if (!m_conv) {
+      DroidMediaCodecMetaData md;
+      DroidMediaRect rect;
+      const char *convName;
+      memset (&md, 0x0, sizeof (md));
+      memset (&rect, 0x0, sizeof (rect));
+      droid_media_codec_get_output_info (m_codec, &md, &rect);
+      m_conv = DroidColourConvert::GetConverter (&md, &rect, &convName, false);
+      if (!m_conv) {
+        LOG (ERROR, "Quality probe: unsupported output format " << md.hal_format);
+        return;
+      }
+    }
+
+    const uint8_t *luma = m_conv->LumaPlane (&decoded->data);
+    const int64_t ts = decoded->ts / 1000;
+    std::vector<uint8_t> ref;
+
+    m_lock->Acquire ();
+    std::map <int64_t, std::vector<uint8_t>>::iterator it = m_retained.find (ts);
+    if (it != m_retained.end ()) {
+      ref = std::move (it->second);
+      m_retained.erase (m_retained.begin (), ++it);
+    }
+    m_lock->Release ();
+
+    const int32_t width = m_metadata.parent.width;
+    const int32_t height = m_metadata.parent.height;
+    if (!luma || ref.size () != (size_t) (width * height)
+        || m_conv->m_width < width || m_conv->m_height < height)
+      return;
+
+    double psnr = DroidPsnr (DroidPlaneSse (ref.data (), width, luma,
+            m_conv->m_stride, width, height), (uint64_t) width * height);
+    double ssim = DroidPlaneSsim (ref.data (), width, luma, m_conv->m_stride,
+        width, height);
+    LOG (DEBUG, "Quality probe: ts=" << ts << " y_psnr=" << psnr
+        << " y_ssim=" << ssim);
+
+    m_lock->Acquire ();
+    m_samples++;
+    m_psnrSum += psnr;
+    m_ssimSum += ssim;
+    if (psnr < m_psnrMin)
+      m_psnrMin = psnr;
+    if (ssim < m_ssimMin)
+      m_ssimMin = ssim;
+    m_lock->Release ();
+  }
+
+  static void
+  DataAvailable (void *data, DroidMediaCodecData * decoded)
+  {
+    DroidQualityProbe *probe = (DroidQualityProbe *) data;
+    probe->Compare (decoded);
+  }
+
+  static int
+  SizeChanged (void *data, int32_t width, int32_t height)
+  {
+    DroidQualityProbe *probe = (DroidQualityProbe *) data;
+    probe->m_dropConverter = true;
+    return 0;
+  }
+
+  int32_t m_interval;
+  GMPMutex *m_lock = nullptr;
+  DroidStage m_submit { "quality probe submit", DROID_STAGE_BLOCKING };
+  DroidMediaCodecDecoderMetaData m_metadata;
+  DroidMediaCodec *m_codec = nullptr;
+  int m_budgetSlot = -1;
+  DroidColourConvert *m_conv = nullptr;
+  bool m_dropConverter = false;
+  uint64_t m_inputCount = 0;
+  std::map <int64_t, std::vector<uint8_t>> m_retained;
+  bool m_stopping = false;
+  uint64_t m_samples = 0;
+  double m_psnrSum = 0;
+  double m_psnrMin = 99.0;
+  double m_ssimSum = 0;
+  double m_ssimMin = 1.0;
+};
+
+class DroidMediaEncoder : public DroidEncoder
+{
+public:
+  explicit DroidMediaEncoder (DroidEncoderListener * listener)
+      : m_listener (listener),
+        m_output_lock (DroidCreateMutex ("encoder m_output_lock"))
+  {
+    memset (&m_metadata, 0x0, sizeof (m_metadata));
+  }
+
+  ~DroidMediaEncoder ()
+  {
+    Stop ();
+    ReleaseBudget ();
+    delete m_denoiser;
+    delete m_packBands;
+    m_output_lock->Destroy ();
+  }
+
+  bool Init (const DroidEncoderSettings & settings) override
+  {
+    m_settings = settings;
+
+    m_metadata.parent.flags =
+        static_cast <DroidMediaCodecFlags> (DROID_MEDIA_CODEC_HW_ONLY);
+
+    switch (settings.codec) {
+      case DROID_CODEC_VP8:
+        m_metadata.parent.type = "video/x-vnd.on2.vp8";
+        break;
+      case DROID_CODEC_VP9:
+        m_metadata.parent.type = "video/x-vnd.on2.vp9";
+        break;
+      case DROID_CODEC_H264:
+      default:
+        m_metadata.parent.type = "video/avc";
+        break;
+    }
+
+    // Check that the requested encoder is actually available on this device
+    if (!droid_media_codec_is_supported (&m_metadata.parent, true)) {
+      LOG (ERROR, "Codec not supported: " << m_metadata.parent.type);
+      return false;
+    }
+
+    m_quirks = DroidGetQuirks (m_metadata.parent.type, true);
+    if (settings.codec == DROID_CODEC_H264) {
+      // Devices that can't prepend SPS/PPS get them put before every IDR
+      // in FrameAvailable instead
+      m_metadata.codec_specific.h264.prepend_header_to_sync_frames =
+          m_quirks.prependHeader;
+    }
+    // Set codec parameters
+    m_metadata.parent.width = settings.width;
+    m_metadata.parent.height = settings.height;
+
+    if (settings.fps) {
+      m_metadata.parent.fps = settings.fps;
+    }
+
+    m_bitrate = settings.bitrate < 100 ? 100 : settings.bitrate;
+    m_metadata.bitrate = CodecBitrate (m_bitrate);
+    m_metadata.stride = settings.width;
+    m_metadata.slice_height = settings.height;
+    m_metadata.meta_data = false;
+
+    m_profile = SelectEncoderProfile (settings);
+    m_metadata.bitrate_mode = m_profile.bitrateMode;
+
+    // droidmedia does not expose the OMX intra refresh parameters. Bursts
+    // of keyframe requests are coalesced instead.
+    m_coalesceKeyFrames = settings.coalesceKeyFrames;
+
+    // Recording has no latency constraint, so high resolutions can be
+    // split into closed GOPs encoded on two instances in parallel.
+    m_gopParallel = settings.gopParallel
+        && settings.mode == DROID_ENCODER_RECORDING
+        && settings.width * settings.height > GOP_PARALLEL_MIN_PIXELS;
+    if (m_gopParallel) {
+      m_coalesceKeyFrames = false;
+      if (m_profile.gopFrames <= 0)
+        m_profile.gopFrames = m_metadata.parent.fps > 0 ? m_metadata.parent.fps : 30;
+    }
+
+    // Realtime H.264 output split into several buffers by the encoder is
+    // passed on without waiting for the rest of the picture
+    m_sliceOutput = settings.sliceOutput && !m_gopParallel
+        && settings.codec == DROID_CODEC_H264
+        && settings.mode == DROID_ENCODER_REALTIME;
+
+    if (settings.denoiseStrength > 0 && !m_denoiser) {
+      m_denoiser = new DroidTemporalDenoiser (settings.denoiseStrength,
+          settings.denoiseThreshold);
+    }
+
+    // Bands beyond the shared workers would only queue behind each other
+    delete m_packBands;
+    m_packBands = nullptr;
+    const int bands = std::min (std::min (settings.cores, MAX_PACK_BANDS),
+        DroidExecutor::Workers ());
+    if (bands > 1
+        && settings.width * settings.height > PARALLEL_PACK_MIN_PIXELS) {
+      if (m_denoiser) {
+        // The denoiser works on whole pictures
+        LOG (INFO, "Denoising input, packing it in one band");
+      } else {
+        m_packBands = new DroidPackBands (bands);
+        LOG (INFO, "Packing input in " << m_packBands->Bands () << " bands");
+      }
+    }
+
+    const size_t pictureBytes = settings.width * settings.height * 3 / 2;
+    m_maxInputFrames = std::max<size_t> (MIN_INPUT_QUEUE_FRAMES,
+        INPUT_QUEUE_BYTES / std::max<size_t> (pictureBytes, 1));
+
+    droid_media_colour_format_constants_init (&m_constants);
+    m_metadata.color_format = -1;
+
+    {
+      uint32_t supportedFormats[32];
+      unsigned int nFormats = droid_media_codec_get_supported_color_formats (
+          &m_metadata.parent, 1, supportedFormats, 32);
+
+      int preferred = -1;
+      if (m_quirks.colorFormat == DROID_COLOR_FORMAT_PLANAR)
+        preferred = m_constants.OMX_COLOR_FormatYUV420Planar;
+      else if (m_quirks.colorFormat == DROID_COLOR_FORMAT_SEMI_PLANAR)
+        preferred = m_constants.OMX_COLOR_FormatYUV420SemiPlanar;
+
+      LOG (INFO, "Found " << nFormats << " color formats supported:");
+      for (unsigned int i = 0; i < nFormats; i++) {
+        int fmt = static_cast<int>(supportedFormats[i]);
+        LOG (INFO, "  " << std::hex << fmt << std::dec);
+        // The list of formats is sorted in order of codec's preference,
+        // so pick the first one supported unless a quirk prefers another.
+        if (fmt == preferred) {
+          m_metadata.color_format = fmt;
+        } else if (m_metadata.color_format == -1 &&
+            (fmt == m_constants.OMX_COLOR_FormatYUV420Planar ||
+             fmt == m_constants.OMX_COLOR_FormatYUV420SemiPlanar)) {
+          m_metadata.color_format = fmt;
+        }
+      }
+    }
+
+    if (m_metadata.color_format == -1) {
+      LOG (ERROR, "No supported color format found");
+      return false;
+    }
+
+    LOG (INFO,
+        "InitEncode: Codec metadata prepared: " << m_metadata.parent.type
+        << " width=" << m_metadata.parent.width
+        << " height=" << m_metadata.parent.height
+        << " fps=" << m_metadata.parent.fps
+        << " bitrate=" << m_metadata.bitrate
+        << " color_format=" << m_metadata.color_format
+        << " coalesce_keyframes=" << m_coalesceKeyFrames
+        << " gop_parallel=" << m_gopParallel
+        << " slice_output=" << m_sliceOutput);
+    LOG (INFO, "InitEncode: Profile selected: " << m_profile.name
+        << " bitrate_mode=" << m_profile.bitrateMode
+        << " gop=" << m_profile.gopFrames);
+
+    // Take the slot of the first instance here, so an exhausted budget
+    // fails Init where the caller can still pick another encoder, rather
+    // than the first frame
+    return AcquireBudget ();
+  }
+
+  // The denoiser takes separate chroma planes
+  DroidPictureLayout InputLayout () const override
+  {
+    return (m_metadata.color_format == m_constants.OMX_COLOR_FormatYUV420Planar
+            || m_denoiser) ? DROID_LAYOUT_I420 : DROID_LAYOUT_NV12;
+  }
+
+  bool Encode (const DroidPicture & picture) override
+  {
+    if (!m_instanceCount && !CreateEncoder ()) {
+      LOG (ERROR, "Cannot create encoder");
+      picture.Release ();
+      return false;
+    }
+
+    m_session.FrameIn (picture.ts);
+    if (m_inputFrames >= m_maxInputFrames) {
+      // The codec is behind, a requested keyframe goes on the next
+      // picture that is accepted
+      LOG (DEBUG, "Input queue full, dropping frame ts=" << picture.ts);
+      m_keyFramePending = m_keyFramePending || picture.keyFrame;
+      m_session.Dropped ();
+      picture.Release ();
+      return true;
+    }
+    m_inputFrames++;
+
+    if (m_probe)
+      m_probe->RetainInput (picture);
+
+    bool sync = WantKeyFrame (picture.keyFrame || m_keyFramePending,
+        picture.ts);
+    m_keyFramePending = false;
+    // The GOP list is shared with the output side
+    m_output_lock->Acquire ();
+    Instance & instance = DispatchFrame (picture.ts, sync);
+    m_output_lock->Release ();
+
+    m_pack.Post (WrapTask (this, &DroidMediaEncoder::PackFrame, picture,
+            sync, &instance));
+    return true;
+  }
+
+  void SetRates (uint32_t bitrate) override
+  {
+    if (bitrate < 100) {
+      bitrate = 100;
+      LOG (INFO, "newBitrate is too low, setting to " << bitrate);
+    }
+
+    if (bitrate != m_bitrate) {
+      m_bitrate = bitrate;
+      // Codecs created later, e.g. on the first Encode (), start at it
+      m_metadata.bitrate = CodecBitrate (m_bitrate);
+      // Rate control spends bitrate / fps on a frame. Each instance is
+      // given GOPs of consecutive frames at the full frame rate, so with
+      // the full rate their GOPs together come to it too. Half the rate
+      // would halve the size of every frame.
+      for (int i = 0; i < m_instanceCount; i++) {
+        droid_media_codec_set_video_encoder_bitrate(m_instances[i].codec,
+            CodecBitrate (m_bitrate));
+      }
+    }
+  }
+
+  void SetPeriodicKeyFrames (bool enable) override
+  {
+    m_periodicKeyFrames = enable;
+  }
+
+  void Stop () override
+  {
+    // Pictures still being packed or queued are not encoded
+    m_discardInput = true;
+    m_pack.Join ();
+    if (m_packBands)
+      m_packBands->Join ();
+    for (DroidStage & submit : m_submit)
+      submit.Join ();
+    m_discardInput = false;
+
+    // A codec thread delivering output holds m_output_lock, so once it is
+    // taken no callback is in progress and later ones bail out. Frames
+    // still in the codecs are not waited for, the output held for
+    // reordering goes out as it is.
+    m_output_lock->Acquire ();
+    m_stopping = true;
+    FlushHeldFrames ();
+    FlushPiece ();
+    m_output_lock->Release ();
+
+    ReportFrameSizes ();
+    LOG (INFO, "  " << m_pack.Stats ());
+    for (int i = 0; i < m_instanceCount; i++)
+      LOG (INFO, "  " << m_submit[i].Stats ());
+    for (int i = 0; i < m_instanceCount; i++)
+      DestroyInstance (m_instances[i]);
+    if (m_instanceCount)
+      LOG (INFO, "Encoder stopped: Codec destroyed");
+    m_instanceCount = 0;
+    ReleaseBudget ();
+    if (m_probe) {
+      m_probe->Report ();
+      delete m_probe;
+      m_probe = nullptr;
+    }
+    m_session.Finish ();
+
+    m_output_lock->Acquire ();
+    m_stopping = false;
+    m_output_lock->Release ();
+  }
+
+private:
+  // A hardware encoder. GOP parallel mode runs two of them.
+  struct Instance
+  {
+    DroidMediaEncoder *encoder = nullptr;
+    int index = 0;
+    DroidMediaCodec *codec = nullptr;
+    // Budget slot of the optional second instance, the first one runs in
+    // the encoder's slot
+    int budgetSlot = -1;
+    // SPS/PPS to put before IDR frames when the codec can't do it
+    std::vector<uint8_t> codecConfig;
+  };
+
+  DroidEncoderListener *m_listener;
+  DroidEncoderSettings m_settings;
+  // Stages: pack -> submit -> hardware encode -> NAL framing and delivery.
+  // Each instance has its own submit stage, so that one blocked on a full
+  // codec does not hold up input to the other.
+  DroidStage m_pack { "encoder pack", DROID_STAGE_WORKER };
+  DroidStage m_submit[2] {
+    { "encoder submit 0", DROID_STAGE_BLOCKING },
+    { "encoder submit 1", DROID_STAGE_BLOCKING },
+  };
+  // Pictures accepted by Encode () and not yet queued to the codec
+  std::atomic<size_t> m_inputFrames { 0 };
+  size_t m_maxInputFrames = MIN_INPUT_QUEUE_FRAMES;
+  std::atomic<bool> m_discardInput { false };
+  bool m_keyFramePending = false;
+  DroidBufferPool m_inputPool { INPUT_POOL_KEEP };
+  DroidBufferPool m_outputPool { OUTPUT_POOL_KEEP };
+  DroidMediaCodecEncoderMetaData m_metadata;
+  Instance m_instances[2];
+  int m_instanceCount = 0;
+  // Hardware codec budget slot of the first instance
+  int m_budgetSlot = -1;
+  bool m_budgetHeld = false;
+  bool m_gopParallel = false;
+  // Output side state below is guarded by m_output_lock
+  GMPMutex *m_output_lock;
+  bool m_stopping = false;
+  DroidGopOrder m_gopOrder;
+  // Piece by piece output of access units
+  bool m_sliceOutput = false;
+  int64_t m_pieceTs = -1;
+  int m_pieceIndex = 0;
+  size_t m_pieceBytes = 0;
+  bool m_pieceSync = false;
+  // Last buffer received, held until it is known whether it ends its
+  // access unit
+  DroidPacket m_heldPiece;
+  bool m_pieceHeld = false;
+  // first_mb_in_slice of the last slice in the current buffer and in the
+  // current picture so far, -1 for none
+  int64_t m_pieceLastMb = -1;
+  int64_t m_pictureLastMb = -1;
+  // first_mb_in_slice that ends every picture, once two pictures in a row
+  // have agreed on it, and the value of the last picture
+  int64_t m_lastSliceMb = -1;
+  int64_t m_lastSliceCandidate = -1;
+  // Turned off for the session after a wrong prediction
+  bool m_predictLastSlice = true;
+  // Picture passed on as complete when its last slice arrived
+  int64_t m_completedTs = -1;
+  DroidMediaColourFormatConstants m_constants;
+  uint32_t m_bitrate = 0;
+  DroidQuirks m_quirks;
+  bool m_coalesceKeyFrames = false;
+  int64_t m_lastKeyFrameTs = -1;
+  EncoderProfile m_profile = {};
+  DroidTemporalDenoiser *m_denoiser = nullptr;
+  DroidPackBands *m_packBands = nullptr;
+  DroidQualityProbe *m_probe = nullptr;
+  DroidSessionStats m_session { "encoder" };
+  uint64_t m_denoiseFrames = 0;
+  int64_t m_denoiseTimeUs = 0;
+  bool m_periodicKeyFrames = true;
+  int32_t m_framesSinceKeyFrame = 0;
+
+  // Encoded frame size statistics
+  uint64_t m_frameCount = 0;
+  uint64_t m_keyFrameCount = 0;
+  double m_sizeSum = 0;
+  double m_sizeSumSq = 0;
+  uint64_t m_sizeMax = 0;
+
+  // Decide whether the frame at timestamp ts (usec) should be an IDR.
+  // When coalescing, a request within about one frame interval of the
+  // last IDR is taken as a duplicate that IDR already answers, e.g. PLIs
+  // from several receivers of a lost packet, and dropped. Requests are
+  // never delayed, as the receiver's video stays frozen until the IDR.
+  bool WantKeyFrame (bool requested, int64_t ts)
+  {
+    if (requested && m_coalesceKeyFrames && m_lastKeyFrameTs >= 0
+        && ts >= m_lastKeyFrameTs) {
+      const int64_t interval = 1000000 / (m_metadata.parent.fps > 0
+          ? m_metadata.parent.fps : 30);
+      // A quarter interval of slack for timestamp jitter
+      if (ts - m_lastKeyFrameTs <= interval + interval / 4) {
+        LOG (DEBUG, "Coalescing keyframe request at " << ts);
+        requested = false;
+      }
+    }
+
+    // Periodic keyframes from the selected GOP structure. GOP parallel
+    // mode depends on them to bound the GOPs.
+    if ((m_periodicKeyFrames || m_gopParallel) && m_profile.gopFrames > 0
+        && m_framesSinceKeyFrame >= m_profile.gopFrames) {
+      requested = true;
+    }
+
+    if (requested) {
+      m_lastKeyFrameTs = ts;
+      m_framesSinceKeyFrame = 0;
+    } else {
+      m_framesSinceKeyFrame++;
+    }
+    return requested;
+  }
+
+  // Bitrate in bps to configure the codec with for a target in kbps,
+  // compensating for codecs known to overshoot
+  uint32_t CodecBitrate (uint32_t kbps)
+  {
+    int32_t overshoot = m_quirks.bitrateOvershoot;
+    if (overshoot < 0)
+      overshoot = 0;
+    else if (overshoot > 90)
+      overshoot = 90;
+    // The codec produces target * (100 + N) / 100, so ask for the inverse
+    return static_cast<uint64_t> (kbps) * 1000 * 100 / (100 + overshoot);
+  }
+
+  void RecordFrameSize (size_t size, bool sync)
+  {
+    m_frameCount++;
+    if (sync)
+      m_keyFrameCount++;
+    m_sizeSum += size;
+    m_sizeSumSq += (double) size * size;
+    if (size > m_sizeMax)
+      m_sizeMax = size;
+  }
+
+  // Account an output buffer in slice output mode
+  void NextPiece (DroidMediaCodecData * encoded)
+  {
+    if (encoded->ts != m_pieceTs) {
+      if (m_pieceTs >= 0) {
+        RecordFrameSize (m_pieceBytes, m_pieceSync);
+        LearnLastSlice (m_pictureLastMb);
+      }
+      m_pieceTs = encoded->ts;
+      m_pieceIndex = 0;
+      m_pieceBytes = 0;
+      m_pieceSync = encoded->sync;
+      m_pictureLastMb = -1;
+    }
+    m_pieceIndex++;
+    m_pieceBytes += encoded->data.size;
+
+    uint32_t mb;
+    m_pieceLastMb = DroidH264LastSliceMb (
+        static_cast<const uint8_t *> (encoded->data.data),
+        encoded->data.size, mb) ? mb : -1;
+    if (m_pieceLastMb >= 0)
+      m_pictureLastMb = m_pieceLastMb;
+  }
+
+  // Encoders split pictures the same way from one to the next, so the
+  // slice that ended the last two pictures is taken to end the next one
+  void LearnLastSlice (int64_t mb)
+  {
+    if (mb >= 0 && mb == m_lastSliceCandidate) {
+      if (m_lastSliceMb != mb)
+        LOG (DEBUG, "Pictures end with the slice at mb " << mb);
+      m_lastSliceMb = mb;
+    } else {
+      m_lastSliceMb = -1;
+    }
+    m_lastSliceCandidate = mb;
+  }
+
+  // Pass on a buffer in slice output mode. droidmedia does not flag the end
+  // of an access unit. A buffer with the slice that ends pictures goes out
+  // as complete at once. Others are held back until the next one shows
+  // whether they were the last of their picture, which only delays the
+  // pieces before the last. Called with m_output_lock held.
+  void DeliverPiece (Instance & instance, const DroidPacket & packet)
+  {
+    if (packet.ts == m_completedTs) {
+      LOG (INFO, "Picture at " << packet.ts << " continued past slice at mb "
+          << m_lastSliceMb << ", holding every buffer from now on");
+      m_predictLastSlice = false;
+    }
+    m_completedTs = -1;
+
+    if (m_pieceHeld)
+      CompletePiece (instance, packet.ts != m_heldPiece.ts);
+    m_heldPiece = packet;
+    m_pieceHeld = true;
+
+    if (m_predictLastSlice && m_lastSliceMb >= 0
+        && m_pieceLastMb == m_lastSliceMb) {
+      CompletePiece (instance, true);
+      m_completedTs = packet.ts;
+    }
+  }
+
+  void CompletePiece (Instance & instance, bool complete)
+  {
+    m_heldPiece.complete = complete;
+    Deliver (instance, m_heldPiece);
+    if (complete)
+      m_session.FrameOut (m_heldPiece.ts);
+    m_pieceHeld = false;
+  }
+
+  // No more output is coming, so the held buffer ends its access unit.
+  // Called with m_output_lock held.
+  void FlushPiece ()
+  {
+    if (m_pieceHeld)
+      CompletePiece (m_instances[0], true);
+    if (m_pieceTs >= 0)
+      RecordFrameSize (m_pieceBytes, m_pieceSync);
+    m_pieceTs = -1;
+    m_pictureLastMb = -1;
+    m_lastSliceMb = -1;
+    m_lastSliceCandidate = -1;
+    m_predictLastSlice = true;
+    m_completedTs = -1;
+  }
+
+  void ReportFrameSizes ()
+  {
+    if (!m_frameCount)
+      return;
+
+    double mean = m_sizeSum / m_frameCount;
+    double variance = m_sizeSumSq / m_frameCount - mean * mean;
+    LOG (INFO, "Encoded frame sizes: frames=" << m_frameCount
+        << " keyframes=" << m_keyFrameCount
+        << " mean=" << mean
+        << " stddev=" << sqrt (variance > 0 ? variance : 0)
+        << " max=" << m_sizeMax
+        << " max/mean=" << m_sizeMax / mean
+        << " coalesce_keyframes=" << m_coalesceKeyFrames);
+    if (m_denoiseFrames) {
+      LOG (INFO, "Denoise cost: frames=" << m_denoiseFrames
+          << " avg_us=" << m_denoiseTimeUs / m_denoiseFrames);
+    }
+  }
+
+  // Copy the picture to a contiguous buffer in the codec's colour format.
+  // Called on a worker.
+  void PackFrame (DroidPicture picture, bool sync, Instance * instance)
+  {
+    DroidMediaCodecData data;
+    DroidMediaBufferCallbacks cb;
+
+    if (m_discardInput) {
+      picture.Release ();
+      m_inputFrames--;
+      return;
+    }
+
+    const int32_t width = picture.width;
+    const int32_t height = picture.height;
+    const unsigned y_size = width * height;
+    const unsigned u_size = y_size / 4;
+    const unsigned v_size = y_size / 4;
+    const uint8_t *const *planes = picture.planes.data;
+    const int32_t *strides = picture.planes.stride;
+
+    LOG (DEBUG, "plane sizes: " << y_size
+        << " " << u_size
+        << " " << v_size
+        << " timestamp: " << picture.ts
+        << " sync: " << sync);
+
+    DroidBuffer *buffer = m_inputPool.Acquire (y_size + u_size + v_size);
+    uint8_t *buf = buffer->Data ();
+    data.data.data = buf;
+    data.data.size = y_size + u_size + v_size;
+    data.ts = picture.ts;
+    data.sync = sync;
+
+    cb.unref = DroidBuffer::Release;
+    cb.data = buffer;
+
+    if (m_denoiser && picture.layout == DROID_LAYOUT_I420) {
+      struct timespec start, end;
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      m_denoiser->Process (planes[0], strides[0], planes[1], strides[1],
+          planes[2], strides[2], width, height, buf,
+          m_metadata.color_format != m_constants.OMX_COLOR_FormatYUV420Planar);
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      m_denoiseTimeUs += (end.tv_sec - start.tv_sec) * 1000000
+          + (end.tv_nsec - start.tv_nsec) / 1000;
+      m_denoiseFrames++;
+    } else if (m_packBands) {
+      // PackDone () runs on the worker packing the last band
+      m_packBands->Pack (picture, buf,
+          m_metadata.color_format != m_constants.OMX_COLOR_FormatYUV420Planar,
+          WrapTask (this, &DroidMediaEncoder::PackDone, picture, data, cb,
+              instance));
+      return;
+    } else {
+      DroidPackRows (picture, buf,
+          m_metadata.color_format != m_constants.OMX_COLOR_FormatYUV420Planar,
+          0, height);
+    }
+
+    PackDone (picture, data, cb, instance);
+  }
+
+  void PackDone (DroidPicture picture, DroidMediaCodecData data,
+      DroidMediaBufferCallbacks cb, Instance * instance)
+  {
+    picture.Release ();
+    m_submit[instance->index].Post (WrapTask (this,
+            &DroidMediaEncoder::SubmitFrame, instance, data, cb));
+  }
+
+  // This blocks when the codec input is full
+  void SubmitFrame (Instance * instance, DroidMediaCodecData data,
+      DroidMediaBufferCallbacks cb)
+  {
+    if (m_discardInput)
+      cb.unref (cb.data);
+    else
+      droid_media_codec_queue (instance->codec, &data, &cb);
+    m_inputFrames--;
+  }
+
+  bool AcquireBudget ()
+  {
+    if (m_budgetHeld)
+      return true;
+    if (!DroidBudgetAcquire (true, DROID_BUDGET_NORMAL, m_budgetSlot)) {
+      LOG (ERROR, "Hardware encoder budget exhausted");
+      return false;
+    }
+    m_budgetHeld = true;
+    return true;
+  }
+
+  void ReleaseBudget ()
+  {
+    DroidBudgetRelease (m_budgetSlot);
+    m_budgetSlot = -1;
+    m_budgetHeld = false;
+  }
+
+  bool CreateInstance (Instance & instance)
+  {
+    instance.codec = droid_media_codec_create_encoder (&m_metadata);
+
+    if (!instance.codec) {
+      LOG (ERROR, "Failed to create the encoder");
+      return false;
+    }
+
+    LOG (INFO, "Codec created for " << m_metadata.parent.type);
+
+    instance.encoder = this;
+    {
+      DroidMediaCodecCallbacks cb;
+      memset(&cb, 0, sizeof(cb));
+      cb.error = DroidMediaEncoder::DroidError;
+      cb.signal_eos = DroidMediaEncoder::SignalEOS;
+      droid_media_codec_set_callbacks (instance.codec, &cb, &instance);
+    }
+
+    {
+      DroidMediaCodecDataCallbacks cb;
+      memset(&cb, 0, sizeof(cb));
+      cb.data_available = DroidMediaEncoder::DataAvailableCallback;
+      droid_media_codec_set_data_callbacks (instance.codec, &cb, &instance);
+    }
+
+    LOG (DEBUG, "Starting the encoder..");
+    int result = droid_media_codec_start (instance.codec);
+    if (result == 0) {
+      droid_media_codec_stop (instance.codec);
+      droid_media_codec_destroy (instance.codec);
+      instance.codec = nullptr;
+      LOG (ERROR, "Failed to start the encoder!");
+      return false;
+    }
+    LOG (DEBUG, "Encoder started");
+    return true;
+  }
+
+  void DestroyInstance (Instance & instance)
+  {
+    if (!instance.codec)
+      return;
+    droid_media_codec_stop (instance.codec);
+    droid_media_codec_destroy (instance.codec);
+    instance.codec = nullptr;
+    DroidBudgetRelease (instance.budgetSlot);
+    instance.budgetSlot = -1;
+    instance.codecConfig.clear ();
+  }
+
+  bool CreateEncoder ()
+  {
+    m_instances[0].index = 0;
+    // The slot taken in Init is given back by Stop ()
+    if (!AcquireBudget () || !CreateInstance (m_instances[0])) {
+      m_session.Error ();
+      m_listener->Error (DROID_ERROR_ENCODE);
+      return false;
+    }
+    m_instanceCount = 1;
+    m_session.Start (m_metadata.parent.type, m_metadata.parent.width,
+        m_metadata.parent.height);
+    // Encoders have no converter, record the input layout instead
+    m_session.SetConverter (
+        m_metadata.color_format == m_constants.OMX_COLOR_FormatYUV420Planar
+        ? (m_denoiser ? "I420+denoise" : "I420")
+        : (m_denoiser ? "NV12+denoise" : "NV12"));
+
+    if (m_gopParallel) {
+      // The second instance is an optimisation, carry on without it
+      m_instances[1].index = 1;
+      if (DroidBudgetAcquire (true, DROID_BUDGET_LOW,
+              m_instances[1].budgetSlot)
+          && CreateInstance (m_instances[1])) {
+        m_instanceCount = 2;
+        LOG (INFO, "Encoding GOPs of " << m_profile.gopFrames
+            << " frames on two instances");
+      } else {
+        DroidBudgetRelease (m_instances[1].budgetSlot);
+        m_instances[1].budgetSlot = -1;
+        LOG (INFO, "Second encoder not available, using one instance");
+      }
+    }
+
+    // The probe decodes the output as one stream, which GOPs from two
+    // instances are not until they are put in order
+    if (m_settings.qualityInterval > 0 && m_instanceCount == 1) {
+      m_probe = new DroidQualityProbe (m_metadata.parent.type,
+          m_metadata.parent.width, m_metadata.parent.height,
+          m_settings.qualityInterval);
+      if (!m_probe->Start ()) {
+        LOG (ERROR, "Quality probe not available");
+        delete m_probe;
+        m_probe = nullptr;
+      }
+    }
+    return true;
+  }
+
+  // Pick the instance to encode the frame at timestamp ts (usec). In GOP
+  // parallel mode every GOP starts with a keyframe and goes to the
+  // instance that did not encode the previous one.
+  Instance & DispatchFrame (int64_t ts, bool & sync)
+  {
+    if (m_instanceCount < 2)
+      return m_instances[0];
+    return m_instances[m_gopOrder.Dispatch (ts, sync)];
+  }
+
+  // Pass an encoded packet to the listener. In GOP parallel mode packets
+  // of a GOP are held until all GOPs before it have been delivered.
+  void Deliver (Instance & instance, const DroidPacket & packet)
+  {
+    if (m_instanceCount < 2) {
+      m_listener->Encoded (packet);
+      return;
+    }
+
+    std::vector<DroidPacket> ready;
+    m_gopOrder.Output (instance.index, packet, ready);
+    for (const DroidPacket & out : ready)
+      m_listener->Encoded (out);
+  }
+
+  // Deliver the output still held, in GOP order. Called with
+  // m_output_lock held once no more output is taken from the instances.
+  void FlushHeldFrames ()
+  {
+    std::vector<DroidPacket> ready;
+    m_gopOrder.Flush (ready);
+    for (const DroidPacket & out : ready)
+      m_listener->Encoded (out);
+  }
+
+  // Called on a codec thread
+  static void DataAvailableCallback (void *data, DroidMediaCodecData* encoded)
+  {
+    Instance *instance = (Instance*) data;
+    instance->encoder->DataAvailable (instance, encoded);
+  }
+
+  // Called on a codec thread
+  void DataAvailable (Instance *instance, DroidMediaCodecData* encoded)
+  {
+    m_output_lock->Acquire ();
+    if (m_stopping) {
+      LOG (ERROR, "DataAvailable() while m_stopping is set");
+    } else {
+      FrameAvailable (instance, encoded);
+    }
+    m_output_lock->Release ();
+  }
+
+  // Called on a codec thread with m_output_lock held
+  void FrameAvailable (Instance *instance, DroidMediaCodecData* encoded)
+  {
+    LOG (DEBUG, "Received encoded frame of length " << encoded->data.size
+        << " ts " << encoded->ts
+        << " sync " << encoded->sync
+        << " codec_config " << encoded->codec_config);
+
+    // Pieces of an access unit share its timestamp
+    if (m_sliceOutput && !encoded->codec_config)
+      NextPiece (encoded);
+    else if (!encoded->codec_config)
+      RecordFrameSize (encoded->data.size, encoded->sync);
+
+    if (m_probe)
+      m_probe->SubmitEncoded (encoded);
+
+    const bool isH264 = m_settings.codec == DROID_CODEC_H264;
+    size_t headerSize = 0;
+    std::vector<uint8_t> & codecConfig = instance->codecConfig;
+    // Config of one instance must not be sent in the middle of the other's
+    // GOP, so in GOP parallel mode it only ever goes before an IDR
+    if (isH264 && (!m_quirks.prependHeader || m_instanceCount > 1)) {
+      if (encoded->codec_config) {
+        uint8_t *config = static_cast<uint8_t *> (encoded->data.data);
+        codecConfig.assign (config, config + encoded->data.size);
+        LOG (DEBUG, "Stored codec config of length " << encoded->data.size);
+        return;
+      }
+      if (encoded->sync && !m_quirks.prependHeader
+          && (!m_sliceOutput || m_pieceIndex == 1))
+        headerSize = codecConfig.size ();
+    }
+
+    DroidPacket packet;
+    DroidBuffer *buffer = m_outputPool.Acquire (headerSize + encoded->data.size);
+    packet.data = buffer->Data ();
+    packet.size = headerSize + encoded->data.size;
+    packet.ts = encoded->ts / 1000; // Convert to usec
+    packet.keyFrame = encoded->sync;
+    packet.release = DroidBuffer::Release;
+    packet.opaque = buffer;
+
+    // Copy encoded data to the output packet
+    if (headerSize)
+      memcpy (packet.data, codecConfig.data (), headerSize);
+    memcpy (packet.data + headerSize, encoded->data.data, encoded->data.size);
+
+    if (isH264 && m_settings.nalLengthPrefix)
+      ConvertNalUnits (packet.data, packet.size, 4, m_sliceOutput);
+
+    if (m_sliceOutput) {
+      DeliverPiece (*instance, packet);
+    } else {
+      Deliver (*instance, packet);
+      m_session.FrameOut (packet.ts);
+    }
+  }
+
+  static inline void UnalignedWrite32 (uint8_t *dest, uint32_t val)
+  {
+    dest[0] = val & 0xff;
+    dest[1] = (val >> 8) & 0xff;
+    dest[2] = (val >> 16) & 0xff;
+    dest[3] = (val >> 24) & 0xff;
+  }
+
+  // Replace start codes of nalStartSize bytes with NAL lengths. Unless
+  // multiSlice is set the first VCL unit is taken to end the buffer, which
+  // saves scanning the slice data for start codes.
+  static void ConvertNalUnits (uint8_t *buf, size_t bufSize,
+      unsigned nalStartSize, bool multiSlice = false)
+  {
+    const uint8_t nalStartCode[] = {0, 0, 0, 1};
+    uint8_t *p = buf, *end = buf + bufSize;
+    uint8_t *prevNalStart = NULL, *nalStart = NULL;
+
+    if (nalStartSize < 1 || nalStartSize > 4)
+      return;
+
+    while (p + nalStartSize <= end) {
+      // NAL Unit start code found
+      if (0 == memcmp (p, nalStartCode + (4 - nalStartSize), nalStartSize)) {
+        prevNalStart = nalStart;
+        nalStart = p;
+        if (prevNalStart) {
+          unsigned nalSize = p - prevNalStart - nalStartSize;
+          UnalignedWrite32 (prevNalStart, nalSize);
+          LOG (DEBUG, "found nal size: " << nalSize << " at " << prevNalStart - buf);
+        }
+        // Skip NALU Start code;
+        p += nalStartSize;
+        // VCL units are the last NALUs in the encoded chunk
+        if (!multiSlice && p < end && (p[0] & 0x1f) <= 5) {
+          break;
+        }
+      }
+      p += 1;
+    }
+    // Convert the last NALU
+    if (nalStart) {
+      unsigned nalSize = bufSize - (nalStart - buf) - nalStartSize;
+      UnalignedWrite32 (nalStart, nalSize);
+      LOG (DEBUG, "last nal size: " << nalSize << " at " << nalStart - buf);
+    }
+  }
+
+  static void SignalEOS (void *data)
+  {
+    LOG (INFO, "Encoder EOS");
+  }
+
+  static void DroidError (void *data, int err)
+  {
+    DroidMediaEncoder *encoder = ((Instance *) data)->encoder;
+    LOG (ERROR, "Droidmedia encoder error " << err);
+    encoder->m_session.Error ();
+    encoder->m_listener->Error (DROID_ERROR_ENCODE);
+  }
+};
+
+DroidEncoder *
+DroidEncoder::Create (DroidEncoderListener * listener)
+{
+  return new DroidMediaEncoder (listener);
+}
@@ -0,0 +1,224 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include "gmp-droid-executor.h"
+
+// Tasks a strand runs before yielding its worker to other strands
+#define STRAND_BATCH 8
+
+static DroidExecutor *g_executor = nullptr;
+// Workers for tasks that block in droidmedia
+static DroidExecutor *g_blocking = nullptr;
+static thread_local DroidExecutor *t_executor = nullptr;
+static thread_local int t_worker = -1;
+
+void
+DroidExecutor::Init (int workers, int blockingWorkers)
+{
+  if (!g_executor)
+    g_executor = new DroidExecutor (workers > 0 ? workers : 1);
+  if (!g_blocking)
+    g_blocking = new DroidExecutor (blockingWorkers > 0 ? blockingWorkers : 1);
+}
+
+void
+DroidExecutor::Shutdown ()
+{
+  delete g_executor;
+  g_executor = nullptr;
+  delete g_blocking;
+  g_blocking = nullptr;
+}
+
+GMPErr
+DroidExecutor::CreateStrand (GMPThread ** thread, bool blocking)
+{
+  DroidExecutor *executor = blocking ? g_blocking : g_executor;
+  if (!executor)
+    return GMPGenericErr;
+  *thread = new DroidStrand (executor);
+  return GMPNoErr;
+}
+
+int
+DroidExecutor::Workers ()
+{
+  return g_executor ? g_executor->m_workers.size () : 0;
+}
+
+bool
+DroidExecutor::OnWorker ()
+{
+  return t_executor && t_executor == g_executor;
+}
+
+DroidExecutor::DroidExecutor (int workers)
+{
+  for (int i = 0; i < workers; i++)
+    m_workers.emplace_back (new Worker);
+  for (int i = 0; i < workers; i++)
+    m_workers[i]->thread = std::thread (&DroidExecutor::Run, this, i);
+}
+
+DroidExecutor::~DroidExecutor ()
+{
+  {
+    std::lock_guard<std::mutex> guard (m_idleLock);
+    m_stopping = true;
+  }
+  m_idle.notify_all ();
+  for (auto & worker : m_workers)
+    worker->thread.join ();
+}
+
+void
+DroidExecutor::Schedule (DroidStrand * strand)
+{
+  // Work created on a worker stays local, other work is spread round robin
+  unsigned index = t_executor == this ? t_worker
+      : m_next++ % m_workers.size ();
+  {
+    std::lock_guard<std::mutex> guard (m_workers[index]->lock);
+    m_workers[index]->queue.push_back (strand);
+  }
+  {
+    std::lock_guard<std::mutex> guard (m_idleLock);
+    m_queued++;
+  }
+  m_idle.notify_one ();
+}
+
+DroidStrand *
+DroidExecutor::Take (int index)
+{
+  const size_t count = m_workers.size ();
+  for (size_t i = 0; i < count; i++) {
+    Worker & worker = *m_workers[(index + i) % count];
+    std::lock_guard<std::mutex> guard (worker.lock);
+    if (worker.queue.empty ())
+      continue;
+    DroidStrand *strand;
+    // Own queue from the back for locality, others from the front
+    if (i == 0) {
+      strand = worker.queue.back ();
+      worker.queue.pop_back ();
+    } else {
+      strand = worker.queue.front ();
+      worker.queue.pop_front ();
+    }
+    return strand;
+  }
+  return nullptr;
+}
+
+void
+DroidExecutor::Run (int index)
+{
+  t_executor = this;
+  t_worker = index;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock (m_idleLock);
+      m_idle.wait (lock, [this] { return m_stopping || m_queued > 0; });
+      if (!m_queued)
+        return;
+      m_queued--;
+    }
+
+    // Every counted entry is in some queue, so this finds one
+    DroidStrand *strand = nullptr;
+    while (!strand)
+      strand = Take (index);
+    strand->RunBatch ();
+  }
+}
+
+void
+DroidStrand::Post (GMPTask * task)
+{
+  bool schedule = false;
+  {
+    std::lock_guard<std::mutex> guard (m_lock);
+    m_tasks.push_back (task);
+    if (!m_scheduled) {
+      m_scheduled = true;
+      schedule = true;
+    }
+  }
+  if (schedule)
+    m_executor->Schedule (this);
+}
+
+void
+DroidStrand::Join ()
+{
+  std::unique_lock<std::mutex> lock (m_lock);
+  // Run what is left here, one task at a time with a worker that may be
+  // in the middle of one
+  for (;;) {
+    m_idle.wait (lock, [this] { return !m_running; });
+    if (m_tasks.empty ())
+      break;
+    GMPTask *task = m_tasks.front ();
+    m_tasks.pop_front ();
+    m_running = true;
+    lock.unlock ();
+    task->Run ();
+    task->Destroy ();
+    lock.lock ();
+    m_running = false;
+  }
+
+  // The worker still holding an entry for the strand releases it
+  if (m_scheduled) {
+    m_joined = true;
+    return;
+  }
+  lock.unlock ();
+  delete this;
+}
+
+void
+DroidStrand::RunBatch ()
+{
+  for (int i = 0; i < STRAND_BATCH; i++) {
+    GMPTask *task = nullptr;
+    bool release = false;
+    {
+      std::lock_guard<std::mutex> guard (m_lock);
+      // Out of work, or Join () is running the tasks
+      if (m_tasks.empty () || m_running) {
+        m_scheduled = false;
+        release = m_joined;
+      } else {
+        task = m_tasks.front ();
+        m_tasks.pop_front ();
+        m_running = true;
+      }
+    }
+    if (!task) {
+      // Joined while this worker held the strand, so nobody else does
+      if (release)
+        delete this;
+      return;
+    }
+
+    task->Run ();
+    task->Destroy ();
+    {
+      std::lock_guard<std::mutex> guard (m_lock);
+      m_running = false;
+    }
+    m_idle.notify_all ();
+  }
+
+  // More work left, give other strands a turn
+  m_executor->Schedule (this);
+}
@@ -0,0 +1,112 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_EXECUTOR
+#define GMP_DROID_EXECUTOR
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gmp-platform.h"
+
+class DroidStrand;
+
+/*
+ * Plugin wide worker pools.
+ *
+ * Codec instances get a strand, a serial queue implementing GMPThread, in
+ * place of a thread of their own. Strands with pending tasks are scheduled
+ * on the workers, each of which keeps a local queue and steals from the
+ * others when it runs dry. The number of threads stays fixed however many
+ * codec instances exist, while tasks of one strand still run one at a time
+ * and in order.
+ *
+ * Tasks on ordinary strands must not block for long: a strand waiting in
+ * droidmedia (e.g. on a full codec input queue) holds its worker, and
+ * enough of them would stall every codec. Blocking calls go to blocking
+ * strands, which run on a second, fixed set of workers. A codec blocked
+ * there holds one of those workers, so with more codecs blocked at once
+ * than blocking workers, the others wait their turn.
+ */
+class DroidExecutor
+{
+public:
+  // Create the pools. Called once from GMPInit.
+  static void Init (int workers, int blockingWorkers);
+  // Stop the workers after they have run all the scheduled work
+  static void Shutdown ();
+  // Create a serial queue, on the blocking workers for tasks that block.
+  // Released by calling Join () on it.
+  static GMPErr CreateStrand (GMPThread ** thread, bool blocking = false);
+  // Number of ordinary workers
+  static int Workers ();
+  // Whether the caller is one of the ordinary workers
+  static bool OnWorker ();
+
+  void Schedule (DroidStrand * strand);
+
+private:
+  struct Worker
+  {
+    std::mutex lock;
+    std::deque<DroidStrand *> queue;
+    std::thread thread;
+  };
+
+  explicit DroidExecutor (int workers);
+  ~DroidExecutor ();
+
+  void Run (int index);
+  DroidStrand *Take (int index);
+
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::mutex m_idleLock;
+  std::condition_variable m_idle;
+  size_t m_queued = 0;
+  bool m_stopping = false;
+  std::atomic<unsigned> m_next { 0 };
+};
+
+class DroidStrand : public GMPThread
+{
+public:
+  explicit DroidStrand (DroidExecutor * executor) : m_executor (executor) { }
+
+  // GMPThread methods
+  void Post (GMPTask * task) override;
+  // Wait for the queued tasks to finish and release the strand. Tasks no
+  // worker has picked up yet are run on the caller, so joining never
+  // waits for a worker to become free.
+  void Join () override;
+
+  // Called on a worker
+  void RunBatch ();
+
+private:
+  ~DroidStrand () { }
+
+  DroidExecutor *m_executor;
+  std::mutex m_lock;
+  std::condition_variable m_idle;
+  std::deque<GMPTask *> m_tasks;
+  // Queued on a worker or running there
+  bool m_scheduled = false;
+  // A task is running, on a worker or in Join ()
+  bool m_running = false;
+  // Joined while still scheduled, the worker releases the strand
+  bool m_joined = false;
+};
+
+#endif
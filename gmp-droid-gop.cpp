@@ -0,0 +1,82 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include "gmp-droid-gop.h"
+#include "gmp-droid-log.h"
+
+int
+DroidGopOrder::Dispatch (int64_t ts, bool & sync)
+{
+  if (m_gops.empty ())
+    sync = true;
+  if (sync) {
+    Gop gop;
+    gop.instance = m_nextInstance;
+    gop.firstTs = ts;
+    m_gops.push_back (gop);
+    m_nextInstance = 1 - m_nextInstance;
+  }
+  m_gops.back ().frames++;
+  return m_gops.back ().instance;
+}
+
+void
+DroidGopOrder::Output (int instance, const DroidPacket & packet,
+    std::vector<DroidPacket> & ready)
+{
+  // Frames of a closed GOP don't precede its keyframe, so the output
+  // belongs to the latest GOP of the instance starting at or before it.
+  // Earlier GOPs of the instance are done.
+  Gop *gop = nullptr;
+  for (Gop & g : m_gops) {
+    if (g.instance != instance || g.firstTs > packet.ts)
+      continue;
+    if (gop)
+      gop->closed = true;
+    gop = &g;
+  }
+
+  if (!gop) {
+    LOG (DEBUG, "Dropping output of a completed GOP, ts: " << packet.ts);
+    packet.Release ();
+    return;
+  }
+
+  gop->outputs++;
+  if (gop == &m_gops.front ())
+    ready.push_back (packet);
+  else
+    gop->held.push_back (packet);
+
+  // Move on past the GOPs which are done. The last GOP may still be
+  // receiving input.
+  while (m_gops.size () > 1) {
+    Gop & front = m_gops.front ();
+    if (!front.closed && front.outputs < front.frames)
+      break;
+    if (front.outputs < front.frames) {
+      LOG (DEBUG, "GOP at ts " << front.firstTs << " done with "
+          << front.frames - front.outputs << " frames missing");
+    }
+    m_gops.pop_front ();
+    Gop & next = m_gops.front ();
+    ready.insert (ready.end (), next.held.begin (), next.held.end ());
+    next.held.clear ();
+  }
+}
+
+void
+DroidGopOrder::Flush (std::vector<DroidPacket> & ready)
+{
+  for (Gop & gop : m_gops)
+    ready.insert (ready.end (), gop.held.begin (), gop.held.end ());
+  m_gops.clear ();
+  m_nextInstance = 0;
+}
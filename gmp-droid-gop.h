@@ -0,0 +1,66 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_GOP
+#define GMP_DROID_GOP
+
+#include <deque>
+#include <vector>
+
+#include "gmp-droid-core.h"
+
+/*
+ * Output order of GOP parallel encoding. Closed GOPs alternate between
+ * two encoder instances, which output them at their own pace. Output of a
+ * GOP is held until the GOPs before it have gone out.
+ *
+ * A GOP is done once its instance has returned an output for every frame,
+ * or has output a frame of its next GOP, as an instance returns its GOPs
+ * in order. Frames still missing then were dropped by the encoder. Output
+ * of the other instance says nothing about the GOP, as the instances run
+ * independently. The caller serialises the calls.
+ */
+class DroidGopOrder
+{
+public:
+  // Pick the instance (0 or 1) to encode the frame at ts (usec). A GOP
+  // starts on the other instance at a keyframe, and sync is set for the
+  // first frame.
+  int Dispatch (int64_t ts, bool & sync);
+
+  // Take a packet output by the instance, and append the packets that can
+  // go out now to ready, in order. Output of a GOP already done is
+  // released.
+  void Output (int instance, const DroidPacket & packet,
+      std::vector<DroidPacket> & ready);
+
+  // No more output is coming: append all held packets to ready in GOP
+  // order and start over
+  void Flush (std::vector<DroidPacket> & ready);
+
+private:
+  struct Gop
+  {
+    int instance;
+    // Timestamp of the first frame, in usec
+    int64_t firstTs;
+    uint32_t frames = 0;
+    uint32_t outputs = 0;
+    // The instance has moved on to a later GOP
+    bool closed = false;
+    // Output waiting for the GOPs before this one
+    std::vector<DroidPacket> held;
+  };
+
+  std::deque<Gop> m_gops;
+  int m_nextInstance = 0;
+};
+
+#endif
@@ -0,0 +1,318 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gmp-droid-history.h"
+#include "gmp-droid-log.h"
+#include "gmp-droid-quirks.h"
+
+// In flight entries kept for frames the codec never returns
+#define MAX_IN_FLIGHT 64
+
+static std::mutex g_history_lock;
+static std::string g_history_path;
+static size_t g_history_max = 0;
+// OS build the figures were taken on
+static std::string g_history_build;
+static std::set<DroidSessionStats *> g_open_sessions;
+
+static int64_t
+MonotonicUs ()
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static int64_t
+ProcessCpuUs ()
+{
+  struct timespec cpu;
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  return cpu.tv_sec * 1000000LL + cpu.tv_nsec / 1000;
+}
+
+// VERSION_ID of /etc/os-release
+static std::string
+ReadOsBuild ()
+{
+  std::ifstream file ("/etc/os-release");
+  std::string line;
+  while (std::getline (file, line)) {
+    if (line.compare (0, 11, "VERSION_ID=") == 0) {
+      std::string value = line.substr (11);
+      value.erase (std::remove (value.begin (), value.end (), '"'),
+          value.end ());
+      return value;
+    }
+  }
+  return "unknown";
+}
+
+// Values are written without spaces, so lines split on whitespace
+static std::string
+Token (const std::string & value)
+{
+  if (value.empty ())
+    return "-";
+  std::string token (value);
+  for (char & c : token) {
+    if (c == ' ' || c == '\t' || c == '\n')
+      c = '_';
+  }
+  return token;
+}
+
+// Called with g_history_lock held
+static void
+AppendLine (const std::string & line)
+{
+  const char *path = g_history_path.c_str ();
+  int fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG (ERROR, "Can't open history file " << path << ": " << strerror (errno));
+    return;
+  }
+
+  struct stat st;
+  if (fstat (fd, &st) == 0
+      && (size_t) st.st_size + line.size () > g_history_max) {
+    // Another process may have rotated already, which only costs the
+    // older generation
+    close (fd);
+    rename (path, (g_history_path + ".1").c_str ());
+    fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      return;
+  }
+
+  // A single append of a short line is not interleaved with other writers
+  if (write (fd, line.data (), line.size ()) != (ssize_t) line.size ())
+    LOG (ERROR, "Can't write history file " << path);
+  close (fd);
+}
+
+void
+DroidHistoryInit (const char *path, size_t maxBytes)
+{
+  std::lock_guard<std::mutex> guard (g_history_lock);
+  if (!path || !*path)
+    return;
+  g_history_path = path;
+  g_history_max = maxBytes;
+  g_history_build = ReadOsBuild ();
+  LOG (INFO, "Writing performance history to " << path);
+}
+
+void
+DroidHistoryShutdown ()
+{
+  // Sessions can't be destroyed while the lock is held
+  std::lock_guard<std::mutex> guard (g_history_lock);
+  for (DroidSessionStats *session : g_open_sessions) {
+    std::string line;
+    if (session->Summary (true, line) && !g_history_path.empty ())
+      AppendLine (line);
+  }
+  g_open_sessions.clear ();
+  g_history_path.clear ();
+}
+
+DroidSessionStats::DroidSessionStats (const char *kind)
+    : m_kind (kind)
+{
+  Clear ();
+}
+
+DroidSessionStats::~DroidSessionStats ()
+{
+  std::lock_guard<std::mutex> guard (g_history_lock);
+  g_open_sessions.erase (this);
+}
+
+void
+DroidSessionStats::Clear ()
+{
+  m_started = false;
+  m_converter.clear ();
+  m_firstOutUs = -1;
+  m_lastOutUs = -1;
+  m_frames = 0;
+  m_dropped = 0;
+  m_errors = 0;
+  m_inFlight.clear ();
+  memset (m_latency, 0, sizeof (m_latency));
+}
+
+void
+DroidSessionStats::Start (const char *codec, int32_t width, int32_t height)
+{
+  {
+    std::lock_guard<std::mutex> guard (m_lock);
+    if (m_started)
+      return;
+    m_started = true;
+    m_codec = codec;
+    m_width = width;
+    m_height = height;
+    m_startUs = MonotonicUs ();
+    m_startCpuUs = ProcessCpuUs ();
+  }
+
+  std::lock_guard<std::mutex> guard (g_history_lock);
+  g_open_sessions.insert (this);
+}
+
+void
+DroidSessionStats::SetConverter (const char *name)
+{
+  std::lock_guard<std::mutex> guard (m_lock);
+  m_converter = name ? name : "";
+}
+
+void
+DroidSessionStats::FrameIn (int64_t ts)
+{
+  const int64_t now = MonotonicUs ();
+  std::lock_guard<std::mutex> guard (m_lock);
+  if (m_inFlight.size () >= MAX_IN_FLIGHT)
+    m_inFlight.erase (m_inFlight.begin ());
+  m_inFlight[ts] = now;
+}
+
+void
+DroidSessionStats::FrameOut (int64_t ts)
+{
+  const int64_t now = MonotonicUs ();
+  std::lock_guard<std::mutex> guard (m_lock);
+  m_frames++;
+  if (m_firstOutUs < 0)
+    m_firstOutUs = now;
+  m_lastOutUs = now;
+
+  std::map<int64_t, int64_t>::iterator it = m_inFlight.find (ts);
+  if (it == m_inFlight.end ())
+    return;
+  int bucket = (now - it->second) / LATENCY_BUCKET_US;
+  if (bucket >= LATENCY_BUCKETS)
+    bucket = LATENCY_BUCKETS - 1;
+  m_latency[bucket]++;
+  m_inFlight.erase (it);
+}
+
+void
+DroidSessionStats::Flush ()
+{
+  std::lock_guard<std::mutex> guard (m_lock);
+  m_inFlight.clear ();
+}
+
+void
+DroidSessionStats::Dropped ()
+{
+  std::lock_guard<std::mutex> guard (m_lock);
+  m_dropped++;
+}
+
+void
+DroidSessionStats::Error ()
+{
+  std::lock_guard<std::mutex> guard (m_lock);
+  m_errors++;
+}
+
+// Called with m_lock held. The upper edge of the bucket holding the
+// percentile.
+double
+DroidSessionStats::LatencyPercentileMs (double p) const
+{
+  uint64_t total = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++)
+    total += m_latency[i];
+  if (!total)
+    return 0;
+
+  const uint64_t rank = (uint64_t) (p * (total - 1));
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += m_latency[i];
+    if (seen > rank)
+      return (i + 1) * LATENCY_BUCKET_US / 1000.0;
+  }
+  return LATENCY_BUCKETS * LATENCY_BUCKET_US / 1000.0;
+}
+
+bool
+DroidSessionStats::Summary (bool shutdown, std::string & summary)
+{
+  std::ostringstream line;
+  {
+    std::lock_guard<std::mutex> guard (m_lock);
+    if (!m_started)
+      return false;
+
+    const int64_t now = MonotonicUs ();
+    const int64_t outputUs = m_lastOutUs - m_firstOutUs;
+    struct rusage usage;
+    memset (&usage, 0, sizeof (usage));
+    getrusage (RUSAGE_SELF, &usage);
+
+    line << std::fixed << std::setprecision (1)
+        << "time=" << time (nullptr)
+        << " device=" << Token (DroidQuirksDevice ())
+        << " build=" << Token (g_history_build)
+        << " kind=" << m_kind
+        << " codec=" << Token (m_codec)
+        << " size=" << m_width << "x" << m_height
+        << " conv=" << Token (m_converter)
+        << " duration_s=" << (now - m_startUs) / 1000000.0
+        << " frames=" << m_frames
+        << " fps=" << (outputUs > 0 ? (m_frames - 1) * 1000000.0 / outputUs : 0)
+        << std::setprecision (2)
+        << " p50_ms=" << LatencyPercentileMs (0.5)
+        << " p99_ms=" << LatencyPercentileMs (0.99)
+        << " dropped=" << m_dropped
+        << " errors=" << m_errors
+        << " process_cpu_ms=" << (ProcessCpuUs () - m_startCpuUs) / 1000
+        << " peak_rss_kb=" << usage.ru_maxrss
+        << " end=" << (shutdown ? "shutdown" : "complete")
+        << "\n";
+    Clear ();
+  }
+  summary = line.str ();
+  return true;
+}
+
+void
+DroidSessionStats::Finish ()
+{
+  std::string line;
+  if (!Summary (false, line))
+    return;
+
+  std::lock_guard<std::mutex> guard (g_history_lock);
+  g_open_sessions.erase (this);
+  if (!g_history_path.empty ())
+    AppendLine (line);
+}
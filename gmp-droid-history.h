@@ -0,0 +1,91 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_HISTORY
+#define GMP_DROID_HISTORY
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+/*
+ * Performance history.
+ *
+ * Every codec session appends a one line summary to a history file when
+ * it ends, so that performance can be compared across OS and droidmedia
+ * updates. The file is shared by all processes and rotated to <path>.1
+ * when it would grow past its size limit. Sessions still open when the
+ * library shuts down are written then. See history-report.cpp for the
+ * aggregation tool and the line format.
+ */
+
+// Called once from DroidCoreInit (). A null path disables the history.
+void DroidHistoryInit (const char *path, size_t maxBytes);
+// Write the sessions still open and disable the history
+void DroidHistoryShutdown ();
+
+// Figures of one codec session. May be updated from any thread.
+class DroidSessionStats
+{
+public:
+  // kind is "decoder" or "encoder"
+  explicit DroidSessionStats (const char *kind);
+  ~DroidSessionStats ();
+
+  // Called when the hardware codec is created. Later calls are ignored
+  // until Finish ().
+  void Start (const char *codec, int32_t width, int32_t height);
+  // Colour converter or input format used
+  void SetConverter (const char *name);
+
+  // A frame with timestamp ts entered the codec, or came out of it
+  void FrameIn (int64_t ts);
+  void FrameOut (int64_t ts);
+  // Forget frames in flight, e.g. on reset
+  void Flush ();
+  void Dropped ();
+  void Error ();
+
+  // Write the summary of a started session and start over
+  void Finish ();
+
+private:
+  friend void DroidHistoryShutdown ();
+  // Latency histogram buckets, LATENCY_BUCKET_US wide
+  static const int LATENCY_BUCKETS = 2000;
+  static const int LATENCY_BUCKET_US = 100;
+
+  // The history line of a started session, which is then cleared
+  bool Summary (bool shutdown, std::string & line);
+  double LatencyPercentileMs (double p) const;
+  void Clear ();
+
+  const char *m_kind;
+  std::mutex m_lock;
+  bool m_started = false;
+  std::string m_codec;
+  std::string m_converter;
+  int32_t m_width = 0;
+  int32_t m_height = 0;
+  int64_t m_startUs = 0;
+  int64_t m_startCpuUs = 0;
+  int64_t m_firstOutUs = -1;
+  int64_t m_lastOutUs = -1;
+  uint64_t m_frames = 0;
+  uint64_t m_dropped = 0;
+  uint64_t m_errors = 0;
+  // Entry times of the frames in flight, by timestamp
+  std::map<int64_t, int64_t> m_inFlight;
+  uint32_t m_latency[LATENCY_BUCKETS];
+};
+
+#endif
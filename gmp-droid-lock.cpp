@@ -0,0 +1,128 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <time.h>
+
+#include "gmp-droid-lock.h"
+#include "gmp-droid-log.h"
+
+static bool g_lock_stats = false;
+
+class DroidMutex : public GMPMutex
+{
+public:
+  void Acquire () override { m_mutex.lock (); }
+  void Release () override { m_mutex.unlock (); }
+  void Destroy () override { delete this; }
+
+private:
+  std::recursive_mutex m_mutex;
+};
+
+/*
+ * Mutex wrapper collecting the lock statistics. GMPMutex is recursive, so
+ * nested acquisitions by the owner are passed through uncounted.
+ */
+class DroidProfiledMutex : public GMPMutex
+{
+public:
+  DroidProfiledMutex (GMPMutex * mutex, const char *name)
+      : m_mutex (mutex), m_name (name) { }
+
+  void Acquire () override
+  {
+    const std::thread::id self = std::this_thread::get_id ();
+    const std::thread::id owner = m_owner.load (std::memory_order_relaxed);
+    if (owner == self) {
+      m_mutex->Acquire ();
+      m_depth++;
+      return;
+    }
+
+    const int64_t start = NowNs ();
+    m_mutex->Acquire ();
+    const int64_t acquired = NowNs ();
+    m_owner.store (self, std::memory_order_relaxed);
+    m_depth = 1;
+    m_acquiredAt = acquired;
+
+    m_acquisitions++;
+    if (owner != std::thread::id ())
+      m_contended++;
+    m_waitNs += acquired - start;
+    m_maxWaitNs = std::max (m_maxWaitNs, acquired - start);
+  }
+
+  void Release () override
+  {
+    if (--m_depth == 0) {
+      const int64_t held = NowNs () - m_acquiredAt;
+      m_holdNs += held;
+      m_maxHoldNs = std::max (m_maxHoldNs, held);
+      m_owner.store (std::thread::id (), std::memory_order_relaxed);
+    }
+    m_mutex->Release ();
+  }
+
+  void Destroy () override
+  {
+    if (m_acquisitions) {
+      LOG (INFO, "Lock stats: " << m_name
+          << " acquisitions=" << m_acquisitions
+          << " contended=" << m_contended
+          << " wait_avg_us=" << m_waitNs / m_acquisitions / 1000.0
+          << " wait_max_us=" << m_maxWaitNs / 1000.0
+          << " hold_avg_us=" << m_holdNs / m_acquisitions / 1000.0
+          << " hold_max_us=" << m_maxHoldNs / 1000.0);
+    }
+    m_mutex->Destroy ();
+    delete this;
+  }
+
+private:
+  static int64_t NowNs ()
+  {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+  }
+
+  GMPMutex *m_mutex;
+  const char *m_name;
+  std::atomic<std::thread::id> m_owner { std::thread::id () };
+  // Updated with the lock held
+  int m_depth = 0;
+  int64_t m_acquiredAt = 0;
+  uint64_t m_acquisitions = 0;
+  uint64_t m_contended = 0;
+  int64_t m_waitNs = 0;
+  int64_t m_maxWaitNs = 0;
+  int64_t m_holdNs = 0;
+  int64_t m_maxHoldNs = 0;
+};
+
+void
+DroidLockStatsEnable (bool enable)
+{
+  g_lock_stats = enable;
+}
+
+GMPMutex *
+DroidCreateMutex (const char *name)
+{
+  GMPMutex *mutex = new DroidMutex ();
+  if (g_lock_stats)
+    mutex = new DroidProfiledMutex (mutex, name);
+  return mutex;
+}
@@ -0,0 +1,41 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_LOCK
+#define GMP_DROID_LOCK
+
+#include "gmp-platform.h"
+
+/*
+ * Recursive mutexes for the codec core, which can't rely on the GMP
+ * platform being there. With lock statistics enabled they record how long
+ * threads wait for the lock, how long they hold it and how often it was
+ * already taken when acquired, and log the figures when destroyed.
+ */
+
+// Called once before any mutex is created
+void DroidLockStatsEnable (bool enable);
+
+// name identifies the lock in the statistics
+GMPMutex *DroidCreateMutex (const char *name);
+
+// Adapts GMPMutex to the standard BasicLockable interface, so it can be
+// waited on with std::condition_variable_any
+class GMPMutexLockable
+{
+public:
+  explicit GMPMutexLockable (GMPMutex * mutex) : m_mutex (mutex) { }
+  void lock () { m_mutex->Acquire (); }
+  void unlock () { m_mutex->Release (); }
+private:
+  GMPMutex *m_mutex;
+};
+
+#endif
@@ -0,0 +1,20 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include "gmp-droid-log.h"
+
+const char *kLogStrings[] = {
+  "GMP-DROID Critical: ",
+  "GMP-DROID Error: ",
+  "GMP-DROID Info: ",
+  "GMP-DROID Debug: "
+};
+
+int g_log_level = INFO;
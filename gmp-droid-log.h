@@ -0,0 +1,30 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_LOG
+#define GMP_DROID_LOG
+
+#include <iostream>
+
+#define CRITICAL 0
+#define ERROR 1
+#define INFO  2
+#define DEBUG 3
+
+extern const char *kLogStrings[];
+extern int g_log_level;
+
+#define LOG(l, x) do { \
+        if (l >=0 && l <= g_log_level) { \
+            std::cerr << kLogStrings[l] << x << std::endl; \
+        } \
+    } while(0)
+
+#endif
@@ -0,0 +1,56 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <dlfcn.h>
+
+#include "gmp-droid-media.h"
+
+#define DROID_MEDIA_LIBRARY "libdroidmedia.so"
+
+DroidMediaSymbols g_droidmedia;
+
+static void *g_handle = nullptr;
+
+bool
+DroidMediaLoad (const char *path, std::string & error)
+{
+  if (g_handle)
+    return true;
+
+  if (!path || !*path)
+    path = DROID_MEDIA_LIBRARY;
+
+  g_handle = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+  if (!g_handle) {
+    error = dlerror ();
+    return false;
+  }
+
+#define DROID_MEDIA_RESOLVE(name) \
+  g_droidmedia.p_##name = \
+      reinterpret_cast<decltype (g_droidmedia.p_##name)> (dlsym (g_handle, #name)); \
+  if (!g_droidmedia.p_##name) { \
+    error = std::string (path) + ": missing symbol " #name; \
+    dlclose (g_handle); \
+    g_handle = nullptr; \
+    g_droidmedia = DroidMediaSymbols (); \
+    return false; \
+  }
+  DROID_MEDIA_SYMBOLS (DROID_MEDIA_RESOLVE)
+#undef DROID_MEDIA_RESOLVE
+
+  return true;
+}
+
+bool
+DroidMediaLoaded ()
+{
+  return g_handle != nullptr;
+}
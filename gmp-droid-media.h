@@ -0,0 +1,101 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_MEDIA
+#define GMP_DROID_MEDIA
+
+#include <string>
+
+#include "droidmedia.h"
+#include "droidmediacodec.h"
+#include "droidmediaconstants.h"
+#include "droidmediaconvert.h"
+
+/*
+ * Runtime binding of droidmedia.
+ *
+ * The plugin does not link against droidmedia, so loading it does not pull
+ * in libhybris until GMPInit. The droid_media_* calls used by the plugin go
+ * through a table of pointers filled in by DroidMediaLoad (). Include this
+ * header after any other droidmedia header.
+ */
+#define DROID_MEDIA_SYMBOLS(X) \
+  X (droid_media_init) \
+  X (droid_media_deinit) \
+  X (droid_media_codec_create_decoder) \
+  X (droid_media_codec_create_encoder) \
+  X (droid_media_codec_is_supported) \
+  X (droid_media_codec_get_supported_color_formats) \
+  X (droid_media_codec_start) \
+  X (droid_media_codec_stop) \
+  X (droid_media_codec_destroy) \
+  X (droid_media_codec_queue) \
+  X (droid_media_codec_drain) \
+  X (droid_media_codec_set_callbacks) \
+  X (droid_media_codec_set_data_callbacks) \
+  X (droid_media_codec_get_output_info) \
+  X (droid_media_codec_set_video_encoder_bitrate) \
+  X (droid_media_colour_format_constants_init) \
+  X (droid_media_pixel_format_constants_init) \
+  X (droid_media_convert_create) \
+  X (droid_media_convert_destroy) \
+  X (droid_media_convert_set_crop_rect) \
+  X (droid_media_convert_to_i420)
+
+struct DroidMediaSymbols
+{
+#define DROID_MEDIA_POINTER(name) decltype (&::name) p_##name;
+  DROID_MEDIA_SYMBOLS (DROID_MEDIA_POINTER)
+#undef DROID_MEDIA_POINTER
+};
+
+extern DroidMediaSymbols g_droidmedia;
+
+// Open the library at path, or the system droidmedia when path is null, and
+// resolve all symbols. Returns false and sets error on failure. Once loaded
+// the library is never closed: codec and binder threads started by it may
+// outlive the plugin's own shutdown.
+bool DroidMediaLoad (const char *path, std::string & error);
+bool DroidMediaLoaded ();
+
+#define droid_media_init g_droidmedia.p_droid_media_init
+#define droid_media_deinit g_droidmedia.p_droid_media_deinit
+#define droid_media_codec_create_decoder \
+  g_droidmedia.p_droid_media_codec_create_decoder
+#define droid_media_codec_create_encoder \
+  g_droidmedia.p_droid_media_codec_create_encoder
+#define droid_media_codec_is_supported \
+  g_droidmedia.p_droid_media_codec_is_supported
+#define droid_media_codec_get_supported_color_formats \
+  g_droidmedia.p_droid_media_codec_get_supported_color_formats
+#define droid_media_codec_start g_droidmedia.p_droid_media_codec_start
+#define droid_media_codec_stop g_droidmedia.p_droid_media_codec_stop
+#define droid_media_codec_destroy g_droidmedia.p_droid_media_codec_destroy
+#define droid_media_codec_queue g_droidmedia.p_droid_media_codec_queue
+#define droid_media_codec_drain g_droidmedia.p_droid_media_codec_drain
+#define droid_media_codec_set_callbacks \
+  g_droidmedia.p_droid_media_codec_set_callbacks
+#define droid_media_codec_set_data_callbacks \
+  g_droidmedia.p_droid_media_codec_set_data_callbacks
+#define droid_media_codec_get_output_info \
+  g_droidmedia.p_droid_media_codec_get_output_info
+#define droid_media_codec_set_video_encoder_bitrate \
+  g_droidmedia.p_droid_media_codec_set_video_encoder_bitrate
+#define droid_media_colour_format_constants_init \
+  g_droidmedia.p_droid_media_colour_format_constants_init
+#define droid_media_pixel_format_constants_init \
+  g_droidmedia.p_droid_media_pixel_format_constants_init
+#define droid_media_convert_create g_droidmedia.p_droid_media_convert_create
+#define droid_media_convert_destroy g_droidmedia.p_droid_media_convert_destroy
+#define droid_media_convert_set_crop_rect \
+  g_droidmedia.p_droid_media_convert_set_crop_rect
+#define droid_media_convert_to_i420 g_droidmedia.p_droid_media_convert_to_i420
+
+#endif
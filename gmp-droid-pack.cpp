@@ -0,0 +1,166 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <algorithm>
+#include <cstring>
+
+#include "gmp-droid-pack.h"
+#include "gmp-droid-executor.h"
+#include "gmp-droid-log.h"
+#include "gmp-task-utils.h"
+
+// Copy a plane, in one go when it is contiguous
+static void
+PackPlane (uint8_t * out, const uint8_t * in, int32_t stride, int32_t width,
+    int32_t height)
+{
+  if (stride == width) {
+    memcpy (out, in, (size_t) width * height);
+    return;
+  }
+  for (int32_t row = 0; row < height; row++)
+    memcpy (out + row * width, in + row * stride, width);
+}
+
+void
+DroidPackRows (const DroidPicture & picture, uint8_t * out, bool semiPlanar,
+    int32_t rowBegin, int32_t rowEnd)
+{
+  const int32_t width = picture.width;
+  const int32_t height = picture.height;
+  const int32_t chromaWidth = width / 2;
+  const int32_t chromaHeight = height / 2;
+  const size_t ySize = (size_t) width * height;
+  const size_t uSize = ySize / 4;
+  const uint8_t *const *planes = picture.planes.data;
+  const int32_t *strides = picture.planes.stride;
+
+  const int32_t chromaBegin = rowBegin / 2;
+  const int32_t chromaEnd = rowEnd < height ? rowEnd / 2 : chromaHeight;
+
+  PackPlane (out + (size_t) rowBegin * width,
+      planes[0] + (size_t) rowBegin * strides[0], strides[0], width,
+      rowEnd - rowBegin);
+
+  uint8_t *buf = out + ySize;
+  if (picture.layout == DROID_LAYOUT_NV12) {
+    // Interleaved input is copied as it is, or split for planar codecs
+    if (semiPlanar) {
+      PackPlane (buf + (size_t) chromaBegin * chromaWidth * 2,
+          planes[1] + (size_t) chromaBegin * strides[1], strides[1],
+          chromaWidth * 2, chromaEnd - chromaBegin);
+      return;
+    }
+    uint8_t *outU = buf + (size_t) chromaBegin * chromaWidth;
+    uint8_t *outV = outU + uSize;
+    for (int32_t row = chromaBegin; row < chromaEnd; row++) {
+      const uint8_t *inp = planes[1] + row * strides[1];
+      for (int32_t i = 0; i < chromaWidth; i++) {
+        *outU++ = *inp++;
+        *outV++ = *inp++;
+      }
+    }
+  } else if (!semiPlanar) {
+    PackPlane (buf + (size_t) chromaBegin * chromaWidth,
+        planes[1] + (size_t) chromaBegin * strides[1], strides[1],
+        chromaWidth, chromaEnd - chromaBegin);
+    buf += uSize;
+    PackPlane (buf + (size_t) chromaBegin * chromaWidth,
+        planes[2] + (size_t) chromaBegin * strides[2], strides[2],
+        chromaWidth, chromaEnd - chromaBegin);
+  } else {
+    buf += (size_t) chromaBegin * chromaWidth * 2;
+    for (int32_t row = chromaBegin; row < chromaEnd; row++) {
+      const uint8_t *inpU = planes[1] + row * strides[1];
+      const uint8_t *inpV = planes[2] + row * strides[2];
+      for (int32_t i = 0; i < chromaWidth; i++) {
+        *buf++ = inpU[i];
+        *buf++ = inpV[i];
+      }
+    }
+  }
+}
+
+DroidPackBands::DroidPackBands (int bands)
+    : m_bands (bands > 1 ? bands : 1)
+{
+}
+
+DroidPackBands::~DroidPackBands ()
+{
+  Join ();
+}
+
+void
+DroidPackBands::Join ()
+{
+  for (GMPThread *strand : m_strands)
+    strand->Join ();
+  m_strands.clear ();
+}
+
+void
+DroidPackBands::Pack (const DroidPicture & picture, uint8_t * out,
+    bool semiPlanar, GMPTask * done)
+{
+  while ((int) m_strands.size () < m_bands) {
+    GMPThread *strand = nullptr;
+    if (DroidExecutor::CreateStrand (&strand) != GMPNoErr)
+      break;
+    m_strands.push_back (strand);
+  }
+
+  const int32_t height = picture.height;
+  const int bands = std::max<int> (m_strands.size (), 1);
+  // Even band boundaries, so that every chroma row falls in one band
+  const int32_t bandRows = ((height + bands - 1) / bands + 1) & ~1;
+  std::vector<std::pair<int32_t, int32_t>> rows;
+  for (int32_t row = 0; row < height; row += bandRows)
+    rows.push_back (std::make_pair (row, std::min (row + bandRows, height)));
+
+  Job *job = new Job;
+  job->pending = m_strands.empty () ? 1 : rows.size ();
+  job->done = done;
+  {
+    std::lock_guard<std::mutex> guard (m_lock);
+    m_jobs.push_back (job);
+  }
+
+  if (m_strands.empty ()) {
+    // No executor, pack here
+    PackBand (picture, out, semiPlanar, 0, height, job);
+    return;
+  }
+  for (size_t i = 0; i < rows.size (); i++) {
+    m_strands[i]->Post (WrapTask (this, &DroidPackBands::PackBand, picture,
+            out, semiPlanar, rows[i].first, rows[i].second, job));
+  }
+}
+
+// Called on a worker
+void
+DroidPackBands::PackBand (DroidPicture picture, uint8_t * out,
+    bool semiPlanar, int32_t rowBegin, int32_t rowEnd, Job * job)
+{
+  DroidPackRows (picture, out, semiPlanar, rowBegin, rowEnd);
+
+  // Pass on the pictures packed so far in order. This runs under the lock
+  // so that a later picture finishing on another worker can't overtake.
+  std::lock_guard<std::mutex> guard (m_lock);
+  if (--job->pending > 0)
+    return;
+  while (!m_jobs.empty () && m_jobs.front ()->pending == 0) {
+    Job *front = m_jobs.front ();
+    m_jobs.pop_front ();
+    front->done->Run ();
+    front->done->Destroy ();
+    delete front;
+  }
+}
@@ -0,0 +1,70 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_PACK
+#define GMP_DROID_PACK
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "gmp-platform.h"
+#include "gmp-droid-core.h"
+
+/*
+ * Encoder input packing. Pictures are copied into the contiguous I420 or
+ * NV12 layout the codec takes. At 2160p that is 12 MB per frame, more than
+ * one small core keeps up with, so large pictures are split into bands of
+ * rows packed in parallel on strands of the shared executor. Nothing
+ * waits for the bands: the last one to finish hands the picture on.
+ */
+
+// Pack luma rows [rowBegin, rowEnd) of the picture, and the chroma rows
+// they cover, into out, which holds the whole packed picture. rowBegin
+// must be even. Pictures of either layout are packed into either.
+void DroidPackRows (const DroidPicture & picture, uint8_t * out,
+    bool semiPlanar, int32_t rowBegin, int32_t rowEnd);
+
+class DroidPackBands
+{
+public:
+  // Pack in up to bands bands
+  explicit DroidPackBands (int bands);
+  ~DroidPackBands ();
+
+  int Bands () const { return m_bands; }
+
+  // Queue the picture for packing and return. done is run on the worker
+  // that finishes it, after the pictures queued before, and takes over
+  // the picture.
+  void Pack (const DroidPicture & picture, uint8_t * out, bool semiPlanar,
+      GMPTask * done);
+  // Wait for the queued pictures and release the strands, which Pack ()
+  // creates again when needed
+  void Join ();
+
+private:
+  struct Job
+  {
+    int pending;
+    GMPTask *done;
+  };
+
+  void PackBand (DroidPicture picture, uint8_t * out, bool semiPlanar,
+      int32_t rowBegin, int32_t rowEnd, Job * job);
+
+  const int m_bands;
+  std::vector<GMPThread *> m_strands;
+  std::mutex m_lock;
+  // Pictures being packed, in the order they were queued
+  std::deque<Job *> m_jobs;
+};
+
+#endif
@@ -0,0 +1,202 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <algorithm>
+#include <sstream>
+#include <time.h>
+
+#include "gmp-droid-executor.h"
+#include "gmp-droid-pipeline.h"
+
+static GMPPlatformAPI *g_api = nullptr;
+static std::thread::id g_main_thread;
+// Time spent in stages run inline from the current task
+static thread_local int64_t t_nestedNs = 0;
+
+static int64_t
+NowNs ()
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Runs a posted task through the stage that times it
+class DroidStageTask : public GMPTask
+{
+public:
+  DroidStageTask (DroidStage * stage, GMPTask * task)
+      : m_stage (stage), m_task (task), m_queuedAt (NowNs ()) { }
+
+  void Run () override
+  {
+    m_stage->RunTask (m_task, m_queuedAt);
+    m_task = nullptr;
+  }
+
+  void Destroy () override
+  {
+    // Not run, e.g. the platform was shut down
+    if (m_task)
+      m_task->Destroy ();
+    delete this;
+  }
+
+private:
+  DroidStage *m_stage;
+  GMPTask *m_task;
+  int64_t m_queuedAt;
+};
+
+void
+DroidPipelineInit (GMPPlatformAPI * api)
+{
+  g_api = api;
+  g_main_thread = std::this_thread::get_id ();
+}
+
+bool
+DroidOnMainThread ()
+{
+  return std::this_thread::get_id () == g_main_thread;
+}
+
+DroidStage::DroidStage (const char *name, DroidStagePolicy policy,
+    size_t capacity)
+    : m_name (name), m_policy (policy), m_capacity (capacity)
+{
+}
+
+DroidStage::~DroidStage ()
+{
+  Join ();
+}
+
+void
+DroidStage::Reserve ()
+{
+  std::unique_lock<std::mutex> lock (m_lock);
+  if (m_capacity && m_depth >= m_capacity) {
+    if (DroidOnMainThread () || DroidExecutor::OnWorker ())
+      m_overruns++;
+    else
+      m_space.wait (lock, [this] { return m_depth < m_capacity; });
+  }
+  m_depth++;
+  m_maxDepth = std::max (m_maxDepth, m_depth);
+}
+
+GMPErr
+DroidStage::Post (GMPTask * task)
+{
+  switch (m_policy) {
+    case DROID_STAGE_INLINE:
+      Reserve ();
+      RunTask (task, NowNs ());
+      return GMPNoErr;
+
+    case DROID_STAGE_MAIN:
+      if (!g_api) {
+        task->Destroy ();
+        return GMPGenericErr;
+      }
+      Reserve ();
+      return g_api->runonmainthread (new DroidStageTask (this, task));
+
+    case DROID_STAGE_WORKER:
+    case DROID_STAGE_BLOCKING:
+    default:
+      if (!m_strand && DroidExecutor::CreateStrand (&m_strand,
+              m_policy == DROID_STAGE_BLOCKING) != GMPNoErr) {
+        m_strand = nullptr;
+        task->Destroy ();
+        return GMPGenericErr;
+      }
+      Reserve ();
+      m_strand->Post (new DroidStageTask (this, task));
+      return GMPNoErr;
+  }
+}
+
+GMPErr
+DroidStage::PostSync (GMPTask * task)
+{
+  if (m_policy == DROID_STAGE_MAIN) {
+    if (!g_api) {
+      task->Destroy ();
+      return GMPGenericErr;
+    }
+    Reserve ();
+    return g_api->syncrunonmainthread (new DroidStageTask (this, task));
+  }
+  return Post (task);
+}
+
+bool
+DroidStage::Active () const
+{
+  return (m_policy != DROID_STAGE_WORKER && m_policy != DROID_STAGE_BLOCKING)
+      || m_strand;
+}
+
+void
+DroidStage::Join ()
+{
+  if (m_strand) {
+    m_strand->Join ();
+    m_strand = nullptr;
+  }
+}
+
+void
+DroidStage::RunTask (GMPTask * task, int64_t queuedAt)
+{
+  const int64_t start = NowNs ();
+  {
+    std::lock_guard<std::mutex> guard (m_lock);
+    m_depth--;
+  }
+  m_space.notify_one ();
+
+  const int64_t outerNs = t_nestedNs;
+  t_nestedNs = 0;
+  task->Run ();
+  task->Destroy ();
+
+  const int64_t end = NowNs ();
+  const int64_t run = end - start - t_nestedNs;
+  t_nestedNs = outerNs + (end - start);
+  std::lock_guard<std::mutex> guard (m_lock);
+  m_tasks++;
+  m_waitNs += start - queuedAt;
+  m_maxWaitNs = std::max (m_maxWaitNs, start - queuedAt);
+  m_runNs += run;
+  m_maxRunNs = std::max (m_maxRunNs, run);
+}
+
+std::string
+DroidStage::Stats () const
+{
+  static const char *policies[] = { "inline", "main", "worker", "blocking" };
+  std::lock_guard<std::mutex> guard (m_lock);
+  std::ostringstream out;
+  out << m_name << ": policy=" << policies[m_policy]
+      << " tasks=" << m_tasks;
+  if (m_tasks) {
+    out << " queue_avg_us=" << m_waitNs / m_tasks / 1000.0
+        << " queue_max_us=" << m_maxWaitNs / 1000.0
+        << " run_avg_us=" << m_runNs / m_tasks / 1000.0
+        << " run_max_us=" << m_maxRunNs / 1000.0;
+  }
+  out << " depth_max=" << m_maxDepth;
+  if (m_capacity)
+    out << " overruns=" << m_overruns;
+  return out.str ();
+}
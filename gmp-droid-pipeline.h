@@ -0,0 +1,99 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_PIPELINE
+#define GMP_DROID_PIPELINE
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "gmp-platform.h"
+
+/*
+ * Pipeline stages.
+ *
+ * The decoder and encoder are written as chains of stages, each running
+ * GMPTasks under a thread policy. A stage times how long its tasks wait
+ * and run, so bottlenecks show up per stage, and a stage can be moved to
+ * another thread or fused with its neighbour by changing its policy. Run
+ * times exclude the stages run inline from a task, so fused stages are
+ * not counted twice.
+ */
+
+enum DroidStagePolicy
+{
+  // Run on the thread posting the task
+  DROID_STAGE_INLINE,
+  // Run on the GMP main thread
+  DROID_STAGE_MAIN,
+  // Run in order on a strand of the shared executor
+  DROID_STAGE_WORKER,
+  // Run in order on a strand of the blocking workers, for calls that block
+  // in droidmedia
+  DROID_STAGE_BLOCKING,
+};
+
+// Called once from GMPInit, on the main thread
+void DroidPipelineInit (GMPPlatformAPI * api);
+bool DroidOnMainThread ();
+
+class DroidStage
+{
+public:
+  // A capacity of 0 leaves the queue unbounded
+  DroidStage (const char *name, DroidStagePolicy policy, size_t capacity = 0);
+  ~DroidStage ();
+
+  // Queue a task. When capacity tasks are already waiting the caller
+  // blocks, except on the main thread and the shared workers, which must
+  // never wait on a stage; there the post is counted as an overrun, and
+  // the owner has to bound its input another way.
+  GMPErr Post (GMPTask * task);
+  // Run a task and wait for it to finish. Main and inline stages only.
+  GMPErr PostSync (GMPTask * task);
+
+  // Whether a worker or blocking stage has a strand with work posted
+  // since the last Join (). Other stages are always active.
+  bool Active () const;
+  // Wait for the queued tasks of a worker or blocking stage and release
+  // its strand
+  void Join ();
+
+  std::string Stats () const;
+
+  // Called by the tasks wrapping the posted ones
+  void RunTask (GMPTask * task, int64_t queuedAt);
+
+private:
+  void Reserve ();
+
+  const char *m_name;
+  const DroidStagePolicy m_policy;
+  const size_t m_capacity;
+  GMPThread *m_strand = nullptr;
+
+  mutable std::mutex m_lock;
+  std::condition_variable m_space;
+  size_t m_depth = 0;
+
+  // Statistics, under m_lock
+  uint64_t m_tasks = 0;
+  uint64_t m_overruns = 0;
+  size_t m_maxDepth = 0;
+  int64_t m_waitNs = 0;
+  int64_t m_maxWaitNs = 0;
+  int64_t m_runNs = 0;
+  int64_t m_maxRunNs = 0;
+};
+
+#endif
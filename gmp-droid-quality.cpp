@@ -0,0 +1,176 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <cmath>
+
+#include "gmp-droid-quality.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define QUALITY_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define QUALITY_SSE2 1
+#endif
+
+static uint64_t
+RowSse (const uint8_t * a, const uint8_t * b, int32_t n)
+{
+  uint64_t sse = 0;
+  int32_t x = 0;
+#if defined(QUALITY_NEON)
+  uint32x4_t acc = vdupq_n_u32 (0);
+  for (; x + 16 <= n; x += 16) {
+    uint8x16_t d = vabdq_u8 (vld1q_u8 (a + x), vld1q_u8 (b + x));
+    acc = vpadalq_u16 (acc, vmull_u8 (vget_low_u8 (d), vget_low_u8 (d)));
+    acc = vpadalq_u16 (acc, vmull_u8 (vget_high_u8 (d), vget_high_u8 (d)));
+  }
+  uint64x2_t sum = vpaddlq_u32 (acc);
+  sse = vgetq_lane_u64 (sum, 0) + vgetq_lane_u64 (sum, 1);
+#elif defined(QUALITY_SSE2)
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i acc = zero;
+  for (; x + 16 <= n; x += 16) {
+    __m128i va = _mm_loadu_si128 ((const __m128i *) (a + x));
+    __m128i vb = _mm_loadu_si128 ((const __m128i *) (b + x));
+    __m128i d = _mm_or_si128 (_mm_subs_epu8 (va, vb), _mm_subs_epu8 (vb, va));
+    __m128i lo = _mm_unpacklo_epi8 (d, zero);
+    __m128i hi = _mm_unpackhi_epi8 (d, zero);
+    acc = _mm_add_epi32 (acc, _mm_madd_epi16 (lo, lo));
+    acc = _mm_add_epi32 (acc, _mm_madd_epi16 (hi, hi));
+  }
+  uint32_t lanes[4];
+  _mm_storeu_si128 ((__m128i *) lanes, acc);
+  sse = (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; x < n; x++) {
+    int d = a[x] - b[x];
+    sse += d * d;
+  }
+  return sse;
+}
+
+uint64_t
+DroidPlaneSse (const uint8_t * a, int32_t aStride,
+    const uint8_t * b, int32_t bStride, int32_t width, int32_t height)
+{
+  uint64_t sse = 0;
+  // Per row accumulation keeps the 32 bit SIMD lanes from overflowing
+  for (int32_t y = 0; y < height; y++)
+    sse += RowSse (a + y * aStride, b + y * bStride, width);
+  return sse;
+}
+
+double
+DroidPsnr (uint64_t sse, uint64_t samples)
+{
+  if (!samples)
+    return 0;
+  if (!sse)
+    return 99.0;
+  double psnr = 10.0 * log10 (255.0 * 255.0 * samples / (double) sse);
+  return psnr > 99.0 ? 99.0 : psnr;
+}
+
+struct BlockSums
+{
+  uint32_t sa, sb, saa, sbb, sab;
+};
+
+static void
+Block8x8Sums (const uint8_t * a, int32_t aStride,
+    const uint8_t * b, int32_t bStride, BlockSums * s)
+{
+#if defined(QUALITY_NEON)
+  uint16x8_t sa = vdupq_n_u16 (0), sb = vdupq_n_u16 (0);
+  uint32x4_t saa = vdupq_n_u32 (0), sbb = vdupq_n_u32 (0), sab = vdupq_n_u32 (0);
+  for (int y = 0; y < 8; y++) {
+    uint8x8_t va = vld1_u8 (a + y * aStride);
+    uint8x8_t vb = vld1_u8 (b + y * bStride);
+    sa = vaddw_u8 (sa, va);
+    sb = vaddw_u8 (sb, vb);
+    saa = vpadalq_u16 (saa, vmull_u8 (va, va));
+    sbb = vpadalq_u16 (sbb, vmull_u8 (vb, vb));
+    sab = vpadalq_u16 (sab, vmull_u8 (va, vb));
+  }
+  uint32x4_t sa32 = vpaddlq_u16 (sa), sb32 = vpaddlq_u16 (sb);
+  s->sa = vgetq_lane_u32 (sa32, 0) + vgetq_lane_u32 (sa32, 1)
+      + vgetq_lane_u32 (sa32, 2) + vgetq_lane_u32 (sa32, 3);
+  s->sb = vgetq_lane_u32 (sb32, 0) + vgetq_lane_u32 (sb32, 1)
+      + vgetq_lane_u32 (sb32, 2) + vgetq_lane_u32 (sb32, 3);
+  s->saa = vgetq_lane_u32 (saa, 0) + vgetq_lane_u32 (saa, 1)
+      + vgetq_lane_u32 (saa, 2) + vgetq_lane_u32 (saa, 3);
+  s->sbb = vgetq_lane_u32 (sbb, 0) + vgetq_lane_u32 (sbb, 1)
+      + vgetq_lane_u32 (sbb, 2) + vgetq_lane_u32 (sbb, 3);
+  s->sab = vgetq_lane_u32 (sab, 0) + vgetq_lane_u32 (sab, 1)
+      + vgetq_lane_u32 (sab, 2) + vgetq_lane_u32 (sab, 3);
+#elif defined(QUALITY_SSE2)
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i sa = zero, sb = zero, saa = zero, sbb = zero, sab = zero;
+  for (int y = 0; y < 8; y++) {
+    __m128i va = _mm_loadl_epi64 ((const __m128i *) (a + y * aStride));
+    __m128i vb = _mm_loadl_epi64 ((const __m128i *) (b + y * bStride));
+    sa = _mm_add_epi64 (sa, _mm_sad_epu8 (va, zero));
+    sb = _mm_add_epi64 (sb, _mm_sad_epu8 (vb, zero));
+    va = _mm_unpacklo_epi8 (va, zero);
+    vb = _mm_unpacklo_epi8 (vb, zero);
+    saa = _mm_add_epi32 (saa, _mm_madd_epi16 (va, va));
+    sbb = _mm_add_epi32 (sbb, _mm_madd_epi16 (vb, vb));
+    sab = _mm_add_epi32 (sab, _mm_madd_epi16 (va, vb));
+  }
+  uint32_t lanes[4];
+  s->sa = _mm_cvtsi128_si32 (sa);
+  s->sb = _mm_cvtsi128_si32 (sb);
+  _mm_storeu_si128 ((__m128i *) lanes, saa);
+  s->saa = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm_storeu_si128 ((__m128i *) lanes, sbb);
+  s->sbb = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm_storeu_si128 ((__m128i *) lanes, sab);
+  s->sab = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+  *s = BlockSums ();
+  for (int y = 0; y < 8; y++) {
+    for (int x = 0; x < 8; x++) {
+      uint32_t va = a[y * aStride + x], vb = b[y * bStride + x];
+      s->sa += va;
+      s->sb += vb;
+      s->saa += va * va;
+      s->sbb += vb * vb;
+      s->sab += va * vb;
+    }
+  }
+#endif
+}
+
+double
+DroidPlaneSsim (const uint8_t * a, int32_t aStride,
+    const uint8_t * b, int32_t bStride, int32_t width, int32_t height)
+{
+  static const double c1 = (0.01 * 255) * (0.01 * 255);
+  static const double c2 = (0.03 * 255) * (0.03 * 255);
+  double total = 0;
+  uint32_t blocks = 0;
+
+  for (int32_t y = 0; y + 8 <= height; y += 8) {
+    for (int32_t x = 0; x + 8 <= width; x += 8) {
+      BlockSums s;
+      Block8x8Sums (a + y * aStride + x, aStride, b + y * bStride + x,
+          bStride, &s);
+      double ma = s.sa / 64.0, mb = s.sb / 64.0;
+      double va = s.saa / 64.0 - ma * ma;
+      double vb = s.sbb / 64.0 - mb * mb;
+      double cov = s.sab / 64.0 - ma * mb;
+      total += ((2 * ma * mb + c1) * (2 * cov + c2))
+          / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+      blocks++;
+    }
+  }
+  return blocks ? total / blocks : 1.0;
+}
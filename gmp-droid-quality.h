@@ -0,0 +1,31 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_QUALITY
+#define GMP_DROID_QUALITY
+
+#include <stdint.h>
+
+/*
+ * Objective quality metrics between a reference and a distorted plane
+ */
+
+// Sum of squared differences over a width x height area
+uint64_t DroidPlaneSse (const uint8_t * a, int32_t aStride,
+    const uint8_t * b, int32_t bStride, int32_t width, int32_t height);
+
+// PSNR in dB for an 8 bit plane, capped at 99 dB for identical planes
+double DroidPsnr (uint64_t sse, uint64_t samples);
+
+// Mean SSIM over non-overlapping 8x8 blocks
+double DroidPlaneSsim (const uint8_t * a, int32_t aStride,
+    const uint8_t * b, int32_t bStride, int32_t width, int32_t height);
+
+#endif
@@ -0,0 +1,179 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdlib.h>
+#include <vector>
+
+#include "gmp-droid-log.h"
+#include "gmp-droid-quirks.h"
+
+struct QuirksSection
+{
+  std::map<std::string, std::string> selectors;
+  std::map<std::string, std::string> values;
+};
+
+static std::vector<QuirksSection> g_sections;
+static std::string g_device;
+
+static std::string
+Trim (const std::string & s)
+{
+  const char *ws = " \t\r\n";
+  size_t start = s.find_first_not_of (ws);
+  if (start == std::string::npos)
+    return std::string ();
+  return s.substr (start, s.find_last_not_of (ws) - start + 1);
+}
+
+// Value of key=value in a properties style file
+static std::string
+ReadProperty (const char *path, const std::string & key)
+{
+  std::ifstream file (path);
+  std::string line;
+  while (std::getline (file, line)) {
+    size_t eq = line.find ('=');
+    if (eq != std::string::npos && Trim (line.substr (0, eq)) == key) {
+      std::string value = Trim (line.substr (eq + 1));
+      if (value.size () >= 2 && value.front () == '"' && value.back () == '"')
+        value = value.substr (1, value.size () - 2);
+      return value;
+    }
+  }
+  return std::string ();
+}
+
+static std::string
+DetectDevice ()
+{
+  std::string device = ReadProperty ("/etc/hw-release", "MER_HA_DEVICE");
+  if (device.empty ())
+    device = ReadProperty ("/system/build.prop", "ro.product.device");
+  if (device.empty ())
+    device = ReadProperty ("/vendor/build.prop", "ro.product.vendor.device");
+  return device;
+}
+
+static bool
+IsPowerOfTwo (int32_t value)
+{
+  return value > 0 && (value & (value - 1)) == 0;
+}
+
+bool
+DroidLoadQuirks (const char *path)
+{
+  g_sections.clear ();
+  g_device = DetectDevice ();
+
+  std::ifstream file (path);
+  if (!file)
+    return false;
+
+  std::string line;
+  while (std::getline (file, line)) {
+    line = Trim (line);
+    if (line.empty () || line[0] == '#' || line[0] == ';')
+      continue;
+
+    if (line.front () == '[' && line.back () == ']') {
+      QuirksSection section;
+      std::istringstream selectors (line.substr (1, line.size () - 2));
+      std::string selector;
+      while (selectors >> selector) {
+        size_t eq = selector.find ('=');
+        if (eq != std::string::npos)
+          section.selectors[selector.substr (0, eq)] = selector.substr (eq + 1);
+      }
+      g_sections.push_back (section);
+      continue;
+    }
+
+    size_t eq = line.find ('=');
+    if (eq == std::string::npos || g_sections.empty ())
+      continue;
+    const std::string key = Trim (line.substr (0, eq));
+    const std::string value = Trim (line.substr (eq + 1));
+    // Alignments are applied with masks
+    if ((key == "stride-align" || key == "slice-align")
+        && !IsPowerOfTwo (atoi (value.c_str ()))) {
+      LOG (ERROR, "Quirks: ignoring " << key << "=" << value
+          << ", not a power of two");
+      continue;
+    }
+    g_sections.back ().values[key] = value;
+  }
+
+  return true;
+}
+
+const std::string &
+DroidQuirksDevice ()
+{
+  return g_device;
+}
+
+static bool
+ParseBool (const std::string & value)
+{
+  return value == "1" || value == "true" || value == "yes";
+}
+
+DroidQuirks
+DroidGetQuirks (const char *codecType, bool encoder)
+{
+  DroidQuirks quirks;
+  const std::map<std::string, std::string> props = {
+    { "device", g_device },
+    { "codec", codecType ? codecType : "" },
+    { "role", encoder ? "encoder" : "decoder" },
+  };
+
+  for (const QuirksSection & section : g_sections) {
+    bool match = true;
+    for (const auto & selector : section.selectors) {
+      auto prop = props.find (selector.first);
+      if (prop == props.end () || prop->second != selector.second) {
+        match = false;
+        break;
+      }
+    }
+    if (!match)
+      continue;
+
+    for (const auto & value : section.values) {
+      const std::string & key = value.first;
+      if (key == "native-convert")
+        quirks.nativeConvert = ParseBool (value.second);
+      else if (key == "stride-align")
+        quirks.strideAlign = atoi (value.second.c_str ());
+      else if (key == "slice-align")
+        quirks.sliceAlign = atoi (value.second.c_str ());
+      else if (key == "prepend-header")
+        quirks.prependHeader = ParseBool (value.second);
+      else if (key == "bitrate-overshoot")
+        quirks.bitrateOvershoot = atoi (value.second.c_str ());
+      else if (key == "color-format") {
+        if (value.second == "planar")
+          quirks.colorFormat = DROID_COLOR_FORMAT_PLANAR;
+        else if (value.second == "semi-planar")
+          quirks.colorFormat = DROID_COLOR_FORMAT_SEMI_PLANAR;
+        else
+          quirks.colorFormat = DROID_COLOR_FORMAT_ANY;
+      }
+    }
+  }
+
+  return quirks;
+}
@@ -0,0 +1,65 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+#ifndef GMP_DROID_QUIRKS
+#define GMP_DROID_QUIRKS
+
+#include <stdint.h>
+#include <string>
+
+/*
+ * Per device codec quirks.
+ *
+ * Quirks are read from an ini style file. Each section header lists
+ * selectors that must all match for the section to apply, later sections
+ * override earlier ones:
+ *
+ *   [device=f5121 codec=video/avc role=decoder]
+ *   native-convert=false
+ *   stride-align=32
+ *
+ * Selectors are device (MER_HA_DEVICE or ro.product.device), codec (the
+ * droidmedia mime type) and role (decoder or encoder). An empty section
+ * header, [], matches everything.
+ */
+
+enum DroidColorFormatPreference
+{
+  DROID_COLOR_FORMAT_ANY = 0,
+  DROID_COLOR_FORMAT_PLANAR,
+  DROID_COLOR_FORMAT_SEMI_PLANAR
+};
+
+struct DroidQuirks
+{
+  // Decoder: use droidmedia's native converter when available
+  bool nativeConvert = true;
+  // Decoder: minimum stride and slice height alignment of the output, a
+  // power of two or 0 for none
+  int32_t strideAlign = 0;
+  int32_t sliceAlign = 0;
+  // Encoder: codec supports prepending SPS/PPS to sync frames
+  bool prependHeader = true;
+  // Encoder: input colour format to prefer over the codec's own order
+  DroidColorFormatPreference colorFormat = DROID_COLOR_FORMAT_ANY;
+  // Encoder: percentage the codec overshoots the target bitrate by
+  int32_t bitrateOvershoot = 0;
+};
+
+// Load the quirks file. Returns false if it could not be read.
+bool DroidLoadQuirks (const char *path);
+
+// Device name used for matching
+const std::string & DroidQuirksDevice ();
+
+// Quirks for a codec type on this device
+DroidQuirks DroidGetQuirks (const char *codecType, bool encoder);
+
+#endif
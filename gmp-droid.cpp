@@ -8,13 +8,13 @@
 **
 ****************************************************************************/
 
-#include <iostream>
+#include <algorithm>
 #include <cstring>
-#include <map>
+#include <deque>
+#include <string>
+#include <vector>
 #include <stdlib.h>
-#include <arpa/inet.h>
-
-#include "droidmediacodec.h"
+#include <time.h>
 
 #include "gmp-platform.h"
 #include "gmp-video-host.h"
@@ -23,47 +23,174 @@
 #include "gmp-video-encode.h"
 #include "gmp-video-frame-i420.h"
 #include "gmp-video-frame-encoded.h"
-#include "gmp-droid-conv.h"
+#include "gmp-droid-core.h"
+#include "gmp-droid-log.h"
+#include "gmp-droid-pipeline.h"
 #include "gmp-task-utils.h"
 
-#define CRITICAL 0
-#define ERROR 1
-#define INFO  2
-#define DEBUG 3
+static GMPPlatformAPI *g_platform_api = nullptr;
 
-const char *kLogStrings[] = {
-  "GMP-DROID Critical: ",
-  "GMP-DROID Error: ",
-  "GMP-DROID Info: ",
-  "GMP-DROID Debug: "
+/*
+ * Plugin configuration. Defaults can be overridden from the environment
+ * of the plugin process, see LoadConfig ().
+ */
+struct DroidConfig
+{
+  // Drop encoder keyframe requests repeating one the previous frame answered
+  bool coalesceKeyFrames = false;
+  // Temporal denoise of encoder input, 0 disables, 1-2 increase strength
+  int denoiseStrength = 0;
+  // Pixel difference treated as motion by the denoiser
+  int denoiseThreshold = 12;
+  // Measure encoder luma PSNR/SSIM on every Nth frame, 0 disables
+  int qualityInterval = 0;
+  // Device quirks file
+  const char *quirksFile = "/etc/gmp-droid/quirks.conf";
+  // Maximum decoder output frame rate, 0 disables the limit
+  int maxOutputFps = 0;
+  // Worker threads shared by all codec instances, and those for calls that
+  // block in droidmedia
+  int workers = 4;
+  int blockingWorkers = 4;
+  // Keyframe only decoding for seek previews: 0 off, 1 while seeks come in
+  // quick succession, 2 always
+  int scrubMode = 1;
+  // Playback decoding in bursts: converted frames are buffered up to the
+  // high watermark, then the decoder idles until the buffer is down to the
+  // low one. A high watermark of 0 disables it.
+  int burstHigh = 0;
+  int burstLow = 4;
+  // Encode high resolution recordings on two instances, a GOP each
+  bool gopParallel = true;
+  // Deliver H.264 access units split by the encoder piece by piece
+  bool sliceOutput = false;
+  // Measure lock wait and hold times
+  bool lockStats = false;
+  // Hardware codecs shared by all plugin processes, 0 for no limit
+  int maxDecoders = 0;
+  int maxEncoders = 0;
+  // droidmedia implementation, null for the system library
+  const char *droidmedia = nullptr;
+  // Per session performance history, null disables it
+  const char *historyFile = nullptr;
+  int64_t historyMaxBytes = 256 * 1024;
 };
 
-static int g_log_level = INFO;
+static DroidConfig g_config;
 
-#define LOG(l, x) do { \
-        if (l >=0 && l <= g_log_level) { \
-            std::cerr << kLogStrings[l] << x << std::endl; \
-        } \
-    } while(0)
+static bool
+GetEnvBool (const char *name, bool defaultValue)
+{
+  const char *value = getenv (name);
+  if (!value || !*value)
+    return defaultValue;
+  return strcmp (value, "0") != 0;
+}
 
-static GMPPlatformAPI *g_platform_api = nullptr;
+static int64_t
+GetEnvInt (const char *name, int64_t defaultValue)
+{
+  const char *value = getenv (name);
+  if (!value || !*value)
+    return defaultValue;
+  return strtoll (value, nullptr, 10);
+}
 
-class DroidVideoDecoder : public GMPVideoDecoder
+static void
+LoadConfig ()
+{
+  g_config.coalesceKeyFrames =
+      GetEnvBool ("GMP_DROID_KEYFRAME_COALESCE", g_config.coalesceKeyFrames);
+  g_config.denoiseStrength =
+      GetEnvInt ("GMP_DROID_DENOISE", g_config.denoiseStrength);
+  g_config.denoiseThreshold =
+      GetEnvInt ("GMP_DROID_DENOISE_THRESHOLD", g_config.denoiseThreshold);
+  g_config.qualityInterval =
+      GetEnvInt ("GMP_DROID_QUALITY_INTERVAL", g_config.qualityInterval);
+  g_config.maxOutputFps =
+      GetEnvInt ("GMP_DROID_MAX_FPS", g_config.maxOutputFps);
+  g_config.workers = GetEnvInt ("GMP_DROID_WORKERS", g_config.workers);
+  g_config.blockingWorkers =
+      GetEnvInt ("GMP_DROID_BLOCKING_WORKERS", g_config.blockingWorkers);
+  g_config.scrubMode = GetEnvInt ("GMP_DROID_SCRUB", g_config.scrubMode);
+  g_config.burstHigh = GetEnvInt ("GMP_DROID_BURST", g_config.burstHigh);
+  g_config.burstLow = GetEnvInt ("GMP_DROID_BURST_LOW", g_config.burstLow);
+  g_config.gopParallel =
+      GetEnvBool ("GMP_DROID_GOP_PARALLEL", g_config.gopParallel);
+  g_config.sliceOutput =
+      GetEnvBool ("GMP_DROID_SLICE_OUTPUT", g_config.sliceOutput);
+  g_config.lockStats =
+      GetEnvBool ("GMP_DROID_LOCK_STATS", g_config.lockStats);
+  g_config.maxDecoders =
+      GetEnvInt ("GMP_DROID_MAX_DECODERS", g_config.maxDecoders);
+  g_config.maxEncoders =
+      GetEnvInt ("GMP_DROID_MAX_ENCODERS", g_config.maxEncoders);
+  g_config.droidmedia = getenv ("GMP_DROID_DROIDMEDIA");
+  g_config.historyFile = getenv ("GMP_DROID_HISTORY");
+  g_config.historyMaxBytes =
+      GetEnvInt ("GMP_DROID_HISTORY_SIZE", g_config.historyMaxBytes);
+  if (getenv ("GMP_DROID_QUIRKS"))
+    g_config.quirksFile = getenv ("GMP_DROID_QUIRKS");
+}
+
+static GMPErr
+ToGMPErr (DroidCoreError error)
+{
+  switch (error) {
+    case DROID_ERROR_NOT_SUPPORTED:
+      return GMPNotImplementedErr;
+    case DROID_ERROR_DECODE:
+      return GMPDecodeErr;
+    case DROID_ERROR_ENCODE:
+      return GMPEncodeErr;
+    case DROID_ERROR_GENERIC:
+    default:
+      return GMPGenericErr;
+  }
+}
+
+// GMP frames must be released on the main thread. Used as the release
+// function of packets and pictures wrapping a GMPVideoFrame.
+static void
+DestroyFrame (void *opaque)
+{
+  GMPVideoFrame *frame = static_cast <GMPVideoFrame *> (opaque);
+  if (DroidOnMainThread ()) {
+    frame->Destroy ();
+  } else if (g_platform_api) {
+    g_platform_api->runonmainthread (WrapTask (frame,
+            &GMPVideoFrame::Destroy));
+  }
+}
+
+// Scrub mode starts after this many resets within SCRUB_WINDOW_MS and ends
+// once no reset has come for SCRUB_EXIT_MS
+#define SCRUB_RESETS 3
+#define SCRUB_WINDOW_MS 2000
+#define SCRUB_EXIT_MS 500
+// Delta frames kept in scrub mode for resuming within a GOP
+#define SCRUB_MAX_RETAINED 600
+// Scrub previews are converted at half size above this width
+#define SCRUB_HALF_MIN_WIDTH 640
+
+/*
+ * GMP decoder over the core decoder. The core does the bitstream work and
+ * drives the hardware codec on worker and codec threads; this adds the
+ * hops to the GMP main thread, scrub mode and the output rate limiter.
+ */
+class DroidVideoDecoder : public GMPVideoDecoder, public DroidDecoderListener
 {
 public:
   explicit DroidVideoDecoder (GMPVideoHost * hostAPI)
-      : m_host (hostAPI)
+      : m_host (hostAPI), m_decoder (DroidDecoder::Create (this))
   {
-    // Create the Mutex
-    GMPErr err = g_platform_api->createmutex (&m_codec_lock);
-    if (GMP_FAILED (err))
-        Error (err);
   }
 
   virtual ~DroidVideoDecoder ()
   {
-    // Destroy the Mutex
-    m_codec_lock->Destroy ();
+    DropRetainedFrames ();
+    DropBufferedFrames ();
+    delete m_decoder;
   }
 
 // GMPVideoDecoder methods
@@ -72,23 +199,19 @@ public:
       uint32_t aCodecSpecificSize,
       GMPVideoDecoderCallback * callback, int32_t coreCount)
   {
+    DroidDecoderSettings settings;
 
     m_callback = callback;
 
-    // Check if this device supports the codec we want
-    memset (&m_metadata, 0x0, sizeof (m_metadata));
-    m_metadata.parent.flags =
-        static_cast <DroidMediaCodecFlags> (DROID_MEDIA_CODEC_HW_ONLY | DROID_MEDIA_CODEC_NO_MEDIA_BUFFER);
-
     switch (codecSettings.mCodecType) {
       case kGMPVideoCodecVP8:
-        m_metadata.parent.type = "video/x-vnd.on2.vp8";
+        settings.codec = DROID_CODEC_VP8;
         break;
       case kGMPVideoCodecVP9:
-        m_metadata.parent.type = "video/x-vnd.on2.vp9";
+        settings.codec = DROID_CODEC_VP9;
         break;
       case kGMPVideoCodecH264:
-        m_metadata.parent.type = "video/avc";
+        settings.codec = DROID_CODEC_H264;
         break;
       default:
         LOG (ERROR, "Unknown GMP codec");
@@ -96,37 +219,32 @@ public:
         return;
     }
 
-    // Check that the requested codec is actually available on this device
-    if (!droid_media_codec_is_supported (&m_metadata.parent, false)) {
-      LOG (ERROR, "Codec not supported");
-      Error (GMPNotImplementedErr);
-    }
-    // Set codec parameters
-    m_metadata.parent.width = codecSettings.mWidth;
-    m_metadata.parent.height = codecSettings.mHeight;
-
-    if (codecSettings.mMaxFramerate) {
-      /* variable fps with a max-framerate */
-      m_metadata.parent.fps = codecSettings.mMaxFramerate;
+    m_scrub = g_config.scrubMode == 2;
+    // Realtime video is shown as soon as it is decoded, so it can't be
+    // buffered ahead
+    m_burst = g_config.burstHigh > 1
+        && codecSettings.mMode != kGMPRealtimeVideo
+        && codecSettings.mMode != kGMPScreensharing;
+    if (m_burst) {
+      m_burstHigh = g_config.burstHigh;
+      m_burstLow = std::min<size_t> (std::max (g_config.burstLow, 0),
+          m_burstHigh - 1);
+      LOG (INFO, "Burst decoding: high=" << m_burstHigh
+          << " low=" << m_burstLow);
     }
+    settings.width = codecSettings.mWidth;
+    settings.height = codecSettings.mHeight;
+    settings.fps = codecSettings.mMaxFramerate;
 
     if (aCodecSpecificSize && codecSettings.mCodecType == kGMPVideoCodecH264) {
-      // Copy AVCC data
-      m_metadata.codec_data.size = aCodecSpecificSize - 1;
-      m_metadata.codec_data.data = malloc (aCodecSpecificSize - 1);
       const GMPVideoCodecH264 *h264 =
           (const GMPVideoCodecH264 *) (aCodecSpecific);
-      memcpy (m_metadata.codec_data.data, &h264->mAVCC, aCodecSpecificSize - 1);
-      LOG (DEBUG, "Got H264 codec data size: " << (aCodecSpecificSize - 1));
-    } else {
-      m_metadata.codec_data.size = 0;
+      settings.codecData = (const uint8_t *) &h264->mAVCC;
+      settings.codecDataSize = aCodecSpecificSize - 1;
     }
-    LOG (INFO,
-        "InitDecode: Codec metadata prepared: " << m_metadata.parent.type
-        << " width=" << m_metadata.parent.width
-        << " height=" << m_metadata.parent.height
-        << " fps=" << m_metadata.parent.fps
-        << " extra=" << m_metadata.codec_data.size);
+
+    if (!m_decoder->Init (settings))
+      Error (GMPNotImplementedErr);
   }
 
   virtual void Decode (GMPVideoEncodedFrame * inputFrame,
@@ -138,284 +256,354 @@ public:
         << " duration=" << inputFrame->Duration ()
         << " extra=" << aCodecSpecificInfoLength);
 
-    DroidMediaBufferCallbacks cb;
-    DroidMediaCodecData cdata;
-
-    if (!strcmp (m_metadata.parent.type, "video/avc")
-        && inputFrame->BufferType () != GMP_BufferSingle) {
-      // H264: Replace each NAL length with the start code
-      // The length is in network byte order, with size matching GMP_BufferLength
-      uint32_t offset = 0;
-      while (offset < inputFrame->Size ()) {
-        // Get NAL length
-        uint32_t len = 0;
-        uint8_t *len8 = 0;
-        uint32_t start_code_len = 0;
-
-        switch (inputFrame->BufferType ()) {
-          case GMP_BufferLength32:
-            len =
-                ntohl (*(reinterpret_cast <int32_t *>(inputFrame->Buffer () + offset)));
-            start_code_len = 4;
-            break;
-
-          case GMP_BufferLength16:
-            len =
-                ntohs (*(reinterpret_cast <int16_t *>(inputFrame->Buffer () + offset)));
-            start_code_len = 2;
-            break;
-
-          case GMP_BufferLength8:
-            len8 = (inputFrame->Buffer () + offset);
-            len = *len8;
-            start_code_len = 1;
-            break;
-
-          case GMP_BufferLength24:
-          case GMP_BufferInvalid:
-          default:
-            LOG (ERROR, "Unsupported H264 buffer size");
-            Error (GMPDecodeErr);
-            return;
-        }
-
-
-        if (len == 1) {
-          // Start code already processed
-          LOG (DEBUG, "NAL start code found. Skipping");
-          break;
-        } else if (offset + len + 4 > inputFrame->Size ()) {
-          // Make sure that we won't run out of space in the buffer
-          LOG (DEBUG,
-              "NAL length more than buffer size: " << len << " bytes");
-          break;
-        } else {
-            // Write NAL start code over the length
-          static const uint8_t code[] = { 0x00, 0x00, 0x00, 0x01 };
-          const uint8_t *start_code = code + (4 - start_code_len);
-          memcpy (inputFrame->Buffer () + offset, start_code, start_code_len);
-          offset += start_code_len + len;
-
-          LOG (DEBUG, "Parsed nal unit of size " << len);
-        }
-      }
+    if (m_scrub && !ScrubAccept (inputFrame))
+      return;
+
+    if (m_burst && !m_scrub && !m_bursting && !m_flushing) {
+      BurstIdleAccept (inputFrame);
+      return;
     }
 
-    cdata.data.size = inputFrame->Size ();
-    cdata.data.data = malloc (inputFrame->Size ());
-    memcpy (cdata.data.data, inputFrame->Buffer (), inputFrame->Size ());
+    PostFrame (inputFrame, true);
+  }
 
-    cb.data = cdata.data.data;
-    cb.unref = free;
+  // Called on the main thread while the decoder idles between bursts.
+  // Gecko gets a buffered frame for the input, which is held back without
+  // waking the codec until the buffer is down to the low watermark. Then
+  // the held input is decoded in one go, and further input goes straight
+  // to the codec, until the buffer is back up at the high watermark.
+  void BurstIdleAccept (GMPVideoEncodedFrame * inputFrame)
+  {
+    if (!m_ready.empty ()) {
+      m_callback->Decoded (m_ready.front ());
+      m_ready.pop_front ();
+    }
+    m_held.push_back (inputFrame);
+    InputDataExhausted_m ();
 
-    cdata.ts = inputFrame->TimeStamp ();
-    // Android doesn't pass duration through the codec - we'll have to keep it
-    m_dur[cdata.ts] = inputFrame->Duration ();
-    cdata.sync = inputFrame->FrameType () == kGMPKeyFrame;
+    if (m_ready.size () <= m_burstLow) {
+      m_wakeups++;
+      m_idleMs += MonotonicMs () - m_idleSince;
+      m_bursting = true;
+      m_burstFrames = 0;
+      // Their input was already reported as consumed
+      for (GMPVideoEncodedFrame *frame : m_held)
+        PostFrame (frame, false);
+      m_held.clear ();
+    }
+  }
 
-    inputFrame->Destroy ();
+  // Called on the main thread with a converted frame. The first frame
+  // after start or a reset goes straight out, so playback and seeks don't
+  // wait for the buffer to fill up.
+  void Output (GMPVideoi420Frame * frame)
+  {
+    if (!m_burst || m_scrub || m_flushing || !m_burstPrimed) {
+      m_burstPrimed = true;
+      m_callback->Decoded (frame);
+      return;
+    }
 
-    if (!m_submit_thread) {
-      GMPErr err = g_platform_api->createthread (&m_submit_thread);
-      if (err != GMPNoErr) {
-        LOG (ERROR, "Couldn't create new thread");
-        Error (GMPGenericErr);
-        cb.unref (cb.data);
-        return;
+    m_ready.push_back (frame);
+    m_peakReady = std::max (m_peakReady, m_ready.size ());
+    if (m_bursting) {
+      m_burstFrames++;
+      if (m_ready.size () >= m_burstHigh) {
+        m_bursting = false;
+        m_bursts++;
+        m_burstFramesSum += m_burstFrames;
+        m_burstFramesMax = std::max (m_burstFramesMax, m_burstFrames);
+        m_idleSince = MonotonicMs ();
       }
     }
-    // Queue new frame submission to codec in another thread so we don't block.
-    m_submit_thread->Post (WrapTask (this,
-            &DroidVideoDecoder::SubmitBufferThread, cdata, cb));
   }
 
-  // Called on submit thread
-  void SubmitBufferThread (DroidMediaCodecData cdata,
-      DroidMediaBufferCallbacks cb)
+  void DropBufferedFrames ()
   {
-    m_codec_lock->Acquire ();
+    for (GMPVideoi420Frame *frame : m_ready)
+      frame->Destroy ();
+    m_ready.clear ();
+    for (GMPVideoEncodedFrame *frame : m_held)
+      frame->Destroy ();
+    m_held.clear ();
+    m_bursting = true;
+    m_burstPrimed = false;
+  }
 
-    if (m_resetting || m_draining || (!m_codec && !CreateCodec ())) {
-      LOG (ERROR, "Buffer submitted while draining or resetting");
-      cb.unref (cb.data);
-      m_codec_lock->Release ();
-      return;
+  // Hand a frame to the core decoder, which preprocesses it and copies it
+  // to codec memory on a worker, so Decode returns without touching the
+  // payload. signal tells whether Gecko is waiting for InputDataExhausted
+  // for it.
+  void PostFrame (GMPVideoEncodedFrame * inputFrame, bool signal)
+  {
+    DroidPacket packet;
+    packet.data = inputFrame->Buffer ();
+    packet.size = inputFrame->Size ();
+    packet.ts = inputFrame->TimeStamp ();
+    packet.duration = inputFrame->Duration ();
+    packet.keyFrame = inputFrame->FrameType () == kGMPKeyFrame;
+    packet.release = DestroyFrame;
+    packet.opaque = static_cast <GMPVideoFrame *> (inputFrame);
+
+    // The length is in network byte order, with size matching GMP_BufferLength
+    switch (inputFrame->BufferType ()) {
+      case GMP_BufferSingle:
+        packet.nalLengthSize = 0;
+        break;
+      case GMP_BufferLength8:
+        packet.nalLengthSize = 1;
+        break;
+      case GMP_BufferLength16:
+        packet.nalLengthSize = 2;
+        break;
+      case GMP_BufferLength24:
+        packet.nalLengthSize = 3;
+        break;
+      case GMP_BufferLength32:
+        packet.nalLengthSize = 4;
+        break;
+      case GMP_BufferInvalid:
+      default:
+        packet.nalLengthSize = -1;
+        break;
     }
 
-    m_codec_lock->Release ();
+    m_decoder->Decode (packet, signal);
+  }
 
-    // This blocks when the input Source is full
-    droid_media_codec_queue (m_codec, &cdata, &cb);
+  // Called on the main thread in scrub mode. Keyframes are decoded, delta
+  // frames are held back without touching the codec or the duration cache.
+  // If seeking stops in the middle of a GOP the held frames are submitted
+  // so that decoding carries on from the keyframe. Returns whether
+  // inputFrame should be submitted.
+  bool ScrubAccept (GMPVideoEncodedFrame * inputFrame)
+  {
+    const bool keyFrame = inputFrame->FrameType () == kGMPKeyFrame;
+    const bool seeking = g_config.scrubMode == 2 || (!m_resetTimes.empty ()
+        && MonotonicMs () - m_resetTimes.back () < SCRUB_EXIT_MS);
 
-    if (g_platform_api) {
-      g_platform_api->runonmainthread (WrapTask (this,
-              &DroidVideoDecoder::InputDataExhausted_m));
+    if (!seeking) {
+      LOG (INFO, "Leaving scrub mode, resuming "
+          << m_retained.size () << " held frames");
+      m_scrub = false;
+      m_resetTimes.clear ();
+      if (keyFrame) {
+        DropRetainedFrames ();
+        return true;
+      }
+      // Post the held frames ahead of this one. Their input was already
+      // reported as consumed.
+      for (GMPVideoEncodedFrame *frame : m_retained)
+        PostFrame (frame, false);
+      m_retained.clear ();
+      return true;
     }
-  }
 
-  void InputDataExhausted_m() {
-    m_codec_lock->Acquire ();
-    if (!m_draining && m_callback) {
-      m_callback->InputDataExhausted();
+    if (keyFrame) {
+      DropRetainedFrames ();
+      return true;
     }
-    m_codec_lock->Release ();
+
+    m_scrubSkippedFrames++;
+    if (g_config.scrubMode == 2 || m_retained.size () >= SCRUB_MAX_RETAINED) {
+      // Can't resume within this GOP any more
+      DropRetainedFrames ();
+      inputFrame->Destroy ();
+    } else {
+      m_retained.push_back (inputFrame);
+    }
+    InputDataExhausted_m ();
+    return false;
   }
 
-  virtual void Reset ()
+  // Called on the main thread. Seeks in quick succession are taken as
+  // scrubbing, during which only keyframes are decoded.
+  void NoteReset ()
   {
-    m_codec_lock->Acquire ();
+    DropRetainedFrames ();
+    if (g_config.scrubMode != 1)
+      return;
 
-    if (!m_resetting && m_submit_thread) {
-      m_submit_thread->Post (WrapTask (this,
-              &DroidVideoDecoder::ResetCodec));
+    const int64_t now = MonotonicMs ();
+    m_resetTimes.push_back (now);
+    while (m_resetTimes.front () < now - SCRUB_WINDOW_MS)
+      m_resetTimes.pop_front ();
+    if (!m_scrub && m_resetTimes.size () >= SCRUB_RESETS) {
+      LOG (INFO, "Entering keyframe only scrub mode");
+      m_scrub = true;
     }
+  }
 
-    m_codec_lock->Release ();
+  void DropRetainedFrames ()
+  {
+    for (GMPVideoEncodedFrame *frame : m_retained)
+      frame->Destroy ();
+    m_retained.clear ();
   }
 
-  virtual void Drain ()
+  static int64_t MonotonicMs ()
   {
-    m_codec_lock->Acquire ();
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+  }
 
-    if (!m_draining && m_submit_thread) {
-      m_submit_thread->Post (WrapTask (this,
-              &DroidVideoDecoder::DrainCodec));
+  void InputDataExhausted_m() {
+    if (m_callback) {
+      m_callback->InputDataExhausted();
     }
+  }
 
-    m_codec_lock->Release ();
+  // m_resetting is set before the hop to the core so that frames still in
+  // flight are discarded instead of being converted
+  virtual void Reset ()
+  {
+    NoteReset ();
+    m_seekLanded = false;
+    DropBufferedFrames ();
+    m_flushing = false;
+    m_resetting = true;
+    m_decoder->Reset ();
   }
 
-  virtual void DecodingComplete ()
+  virtual void Drain ()
   {
-    m_codec_lock->Acquire ();
+    if (m_burst) {
+      // Pass on everything buffered and decode the held input, output
+      // goes straight to Gecko until the drain completes
+      m_flushing = true;
+      for (GMPVideoi420Frame *frame : m_ready)
+        m_callback->Decoded (frame);
+      m_ready.clear ();
+      for (GMPVideoEncodedFrame *frame : m_held)
+        PostFrame (frame, false);
+      m_held.clear ();
+      m_bursting = true;
+    }
+    m_decoder->Drain ();
+  }
 
+  virtual void DecodingComplete ()
+  {
     m_callback = nullptr;
     m_host = nullptr;
-
-    if (!m_resetting && m_submit_thread) {
-      m_submit_thread->Post (WrapTask (this,
-              &DroidVideoDecoder::ResetCodec));
-    }
-
-    m_codec_lock->Release ();
+    ReportStats ();
+    DropRetainedFrames ();
+    DropBufferedFrames ();
+    m_decoder->Stop ();
   }
 
-  bool CreateCodec ()
+  // Output rate limiter. Frames closer than the minimum spacing to the
+  // previous delivered one are dropped before colour conversion. A small
+  // tolerance absorbs timestamp jitter so that e.g. 120 fps content keeps
+  // exactly every other frame at 60 fps.
+  // Called on the main thread.
+  bool RateLimitAccept (int64_t ts)
   {
-    m_codec = droid_media_codec_create_decoder (&m_metadata);
-    if (!m_codec) {
-      LOG (ERROR, "Failed to start the decoder");
-      Error (GMPDecodeErr);
-      return false;
+    if (g_config.maxOutputFps <= 0)
+      return true;
+
+    const int64_t interval = 1000000 / g_config.maxOutputFps;
+    if (m_nextOutputTs < 0 || ts < m_nextOutputTs - 2 * interval) {
+      // First frame or timestamps went backwards
+      m_nextOutputTs = ts + interval;
+      return true;
     }
 
-    LOG (INFO, "Codec created for " << m_metadata.parent.type);
+    if (ts + interval / 8 < m_nextOutputTs)
+      return false;
 
-    {
-      DroidMediaCodecCallbacks cb;
-      memset(&cb, 0, sizeof(cb));
-      cb.error = DroidVideoDecoder::DroidError;
-      cb.size_changed = DroidVideoDecoder::SizeChanged;
-      cb.signal_eos = DroidVideoDecoder::SignalEOS;
-      droid_media_codec_set_callbacks (m_codec, &cb, this);
-    }
+    // Keep the phase while frames arrive on time; after a gap the next
+    // deadline is a whole interval past this frame
+    m_nextOutputTs = std::max (m_nextOutputTs + interval, ts + interval);
+    return true;
+  }
 
-    {
-      DroidMediaCodecDataCallbacks cb;
-      memset(&cb, 0, sizeof(cb));
-      cb.data_available = DroidVideoDecoder::DataAvailable;
-      droid_media_codec_set_data_callbacks (m_codec, &cb, this);
+  void ReportStats ()
+  {
+    m_decoder->ReportStats ();
+    LOG (INFO, "  dropped_rate=" << m_rateDroppedFrames
+        << " scrub_skipped=" << m_scrubSkippedFrames);
+    if (m_burst) {
+      LOG (INFO, "  Burst stats: wakeups=" << m_wakeups
+          << " bursts=" << m_bursts
+          << " burst_avg=" << (m_bursts ? (double) m_burstFramesSum / m_bursts : 0)
+          << " burst_max=" << m_burstFramesMax
+          << " peak_buffered=" << m_peakReady
+          << " idle_ms=" << m_idleMs);
     }
-    // Reset state
-    m_draining = false;
+    LOG (INFO, "  " << m_convert.Stats ());
+  }
 
-    if (!droid_media_codec_start (m_codec)) {
-      droid_media_codec_destroy (m_codec);
-      m_codec = nullptr;
-      LOG (ERROR, "Failed to start the decoder");
-      Error (GMPDecodeErr);
-      return false;
+  // The callback is looked up on the main thread, as it is gone once
+  // DecodingComplete has been called
+  void Error (GMPErr error)
+  {
+    if (g_platform_api) {
+      g_platform_api->runonmainthread (WrapTask (this,
+              &DroidVideoDecoder::Error_m, error));
     }
-    LOG (DEBUG, "Codec started for " << m_metadata.parent.type);
-    return true;
   }
 
-  void ConfigureOutput (DroidMediaCodecData * data)
+  // Called on the main thread
+  void Error_m (GMPErr error)
   {
-    DroidMediaCodecMetaData md;
-    DroidMediaRect rect;
-    memset (&md, 0x0, sizeof (md));
-    memset (&rect, 0x0, sizeof (rect));
-    droid_media_codec_get_output_info (m_codec, &md, &rect);
-    LOG (INFO,
-        "ConfigureOutput: Configuring converter for stride:" << md.width
-        << " slice-height: " << md.height << " top: " << rect.top
-        << " left:" << rect.left << " width: " << rect.right - rect.left
-        << " height: " << rect.bottom - rect.top << " format: " << md.hal_format);
-    const char *convName;
-    m_conv = DroidColourConvert::GetConverter (&md, &rect, &convName);
-    LOG (INFO, "Colour converter class: " << convName);
+    if (m_callback)
+      m_callback->Error (error);
   }
 
-  void RequestNewConverter ()
+// DroidDecoderListener methods
+  // Called on a codec thread, which waits while the frame is converted
+  // on the main thread
+  void Decoded (DroidDecodedFrame & frame) override
   {
-    LOG (DEBUG, "Resetting converter");
-    m_dropConverter = true;
+    m_convert.PostSync (WrapTask (this, &DroidVideoDecoder::Decoded_m,
+            &frame));
   }
 
-  // Called on a codec thread.
-  void ProcessFrame (DroidMediaCodecData * decoded)
+  void InputConsumed () override
   {
-    m_codec_lock->Acquire ();
-
-    // Delete the current colour converter if requested
-    if (m_dropConverter) {
-      if (m_conv)
-        delete m_conv;
-      m_conv = nullptr;
-      m_dropConverter = false;
+    if (g_platform_api) {
+      g_platform_api->runonmainthread (WrapTask (this,
+              &DroidVideoDecoder::InputDataExhausted_m));
     }
+  }
 
-    if (m_resetting || !m_callback || !m_host) {
-        LOG(INFO, "Discarding decoded frame received while resetting");
-        m_codec_lock->Release ();
-        return;
+  void DrainComplete () override
+  {
+    if (g_platform_api) {
+      g_platform_api->runonmainthread (WrapTask (this,
+              &DroidVideoDecoder::DrainComplete_m));
     }
+  }
 
-    m_processing = true;
-    m_codec_lock->Release ();
-
+  void ResetComplete () override
+  {
     if (g_platform_api) {
-      g_platform_api->syncrunonmainthread (WrapTask (this,
-              &DroidVideoDecoder::ProcessFrame_m, decoded));
+      g_platform_api->runonmainthread (WrapTask (this,
+              &DroidVideoDecoder::ResetComplete_m));
     }
+  }
 
-    m_codec_lock->Acquire ();
-    m_processing = false;
-    // Reset() was called while processing. Run it on submit thread.
-    if (m_resetting && m_submit_thread) {
-      m_submit_thread->Post (WrapTask (this,
-              &DroidVideoDecoder::ResetCodec));
-    }
-    m_codec_lock->Release ();
+  void Error (DroidCoreError error) override
+  {
+    Error (ToGMPErr (error));
   }
 
-  // Return the decoded data back to the parent.
-  // Called on the main thread.
-  void ProcessFrame_m (DroidMediaCodecData * data)
+private:
+  // Convert the decoded picture straight into a GMP frame and return it
+  // to the parent. Called on the main thread.
+  void Decoded_m (DroidDecodedFrame * decoded)
   {
     if (m_resetting || !m_callback || !m_host) {
         LOG(INFO, "Discarding decoded frame received while resetting");
         return;
     }
 
-    if (!m_conv) {
-      ConfigureOutput (data);
-    }
-    // Bail out if that didn't work
-    if (!m_conv) {
-      LOG (CRITICAL, "Converter not found");
-      Error (GMPDecodeErr);
+    const int64_t ts = decoded->Timestamp ();
+    if (!RateLimitAccept (ts)) {
+      m_rateDroppedFrames++;
+      LOG (DEBUG, "Rate limiter dropped frame ts: " << ts);
       return;
     }
 
@@ -428,209 +616,124 @@ public:
       Error (err);
       return;
     }
-    // Fill it with the converter
     GMPVideoi420Frame *frame = static_cast <GMPVideoi420Frame *>(ftmp);
-    err = m_conv->Convert (m_host, &data->data, frame);
-    if (err != GMPNoErr) {
-      LOG (ERROR, "Couldn't make decoded frame");
-      Error (err);
-      return;
-    }
-    // Set timestamp
-    int64_t ts = data->ts / 1000;
-    frame->SetTimestamp (ts);
-
-    // Look up duration in our cache
-    uint64_t dur = 0;
-    std::map <int64_t, uint64_t>::iterator durIt = m_dur.find (ts);
-    if (durIt != m_dur.end ()) {
-      dur = durIt->second;
-      m_dur.erase (durIt);
-    }
-    frame->SetDuration (dur);
 
-    // Send the new frame back to Gecko
-    m_callback->Decoded (frame);
-    LOG (DEBUG, "ProcessFrame: Returning frame ts: " << ts << " dur: " << dur);
-    if (m_dur.size () == 0 && m_draining) {
-      // TODO: we never get the buffers down to 0 with the current SimpleDecodingSource, but EOS will do it
-      m_callback->DrainComplete ();
-      m_draining = false;
+    // Scrub previews don't need the full picture. The first picture after
+    // a reset is the one a seek lands on, which stays on screen when
+    // seeking stops, so only the ones decoded past it are made smaller.
+    const bool half = m_scrub && m_seekLanded
+        && decoded->Width () > SCRUB_HALF_MIN_WIDTH;
+    const int32_t width = decoded->Width (half);
+    const int32_t height = decoded->Height (half);
+    // Allocate the planes at the strides the converter copies in one go
+    if (half) {
+      err = frame->CreateEmptyFrame (width, height, width, (width + 1) / 2,
+          (width + 1) / 2);
     } else {
-      LOG (DEBUG, "Buffers still out " << m_dur.size ());
+      err = frame->CreateEmptyFrame (width, height, decoded->Stride (0),
+          decoded->Stride (1), decoded->Stride (2));
     }
-  }
-
-  virtual void EOS ()
-  {
-    LOG (DEBUG, "Codec EOS");
-    if (g_platform_api) {
-      g_platform_api->runonmainthread (WrapTask (m_callback,
-              &GMPVideoDecoderCallback::DrainComplete));
-    }
-    m_dur.clear ();
-  }
-
-  void Error (GMPErr error)
-  {
-    if (m_callback && g_platform_api) {
-      g_platform_api->runonmainthread (WrapTask (m_callback,
-              &GMPVideoDecoderCallback::Error, error));
-    }
-  }
-
-private:
-  // Called on submit thread
-  void ResetCodec ()
-  {
-    DroidMediaCodec *codec = nullptr;
-
-    m_codec_lock->Acquire ();
-    m_resetting = true;
-
-    // The codec is busy in processing, so ResetCodec will be rescheduled
-    // from ProcessFrame
-    if (m_processing) {
-      m_codec_lock->Release ();
+    if (err != GMPNoErr) {
+      LOG (ERROR, "Couldn't allocate I420 planes");
+      frame->Destroy ();
+      Error (err);
       return;
     }
 
-    if (m_codec) {
-      codec = m_codec;
-      m_codec = nullptr;
+    // Fill it with the converter
+    DroidPlanes planes;
+    for (int plane = 0; plane < 3; plane++) {
+      planes.data[plane] = frame->Buffer ((GMPPlaneType) plane);
+      planes.stride[plane] = frame->Stride ((GMPPlaneType) plane);
     }
-    m_codec_lock->Release ();
-
-    if (codec) {
-      LOG (DEBUG, "Codec draining");
-      droid_media_codec_drain (codec);
-      LOG (DEBUG, "Codec stopping");
-      droid_media_codec_stop (codec);
-      LOG (DEBUG, "Destroying codec");
-      droid_media_codec_destroy (codec);
-      LOG (DEBUG, "Codec destroyed");
+    if (!decoded->Convert (planes, half)) {
+      LOG (ERROR, "Couldn't make decoded frame");
+      frame->Destroy ();
+      Error (GMPDecodeErr);
+      return;
     }
+    frame->SetTimestamp (ts);
+    frame->SetDuration (decoded->Duration ());
+    m_seekLanded = true;
 
-    if (m_callback && g_platform_api) {
-      g_platform_api->runonmainthread (WrapTask (this,
-              &DroidVideoDecoder::ResetCodecComplete_m));
-    }
+    // Send the new frame back to Gecko
+    Output (frame);
+    LOG (DEBUG, "ProcessFrame: Returning frame ts: " << ts
+        << " dur: " << decoded->Duration ());
   }
 
   // Called on the main thread
-  void ResetCodecComplete_m () {
-    LOG (DEBUG, "Stopping submit thread");
-    if (m_submit_thread) {
-      m_submit_thread->Join ();
-      m_submit_thread = nullptr;
-    }
-    LOG (DEBUG, "Stopped submit thread");
-
-    m_codec_lock->Acquire ();
-
-    m_dur.clear ();
-    RequestNewConverter ();
-
-    if (m_callback) {
-      m_callback->ResetComplete ();
-    }
-
-    m_draining = false;
-    m_resetting = false;
-
-    m_codec_lock->Release ();
-  }
-
-  // Called on submit thread
-  void DrainCodec ()
+  void DrainComplete_m ()
   {
-    m_draining = true;
-
-    if (m_codec) {
-      droid_media_codec_drain (m_codec);
-    }
-
-    //TODO: This never happens because the codec never really drains, except for EOS
-    if (!m_codec || m_dur.size () == 0) {
-      if (g_platform_api) {
-        g_platform_api->runonmainthread (WrapTask (this,
-                &DroidVideoDecoder::DrainCodecComplete_m));
-      }
-      m_draining = false;
-    }
-  }
-
-  // Called on the main thread
-  void DrainCodecComplete_m () {
+    m_flushing = false;
     if (m_callback) {
       m_callback->DrainComplete ();
     }
   }
 
-  /*
-   * Droidmedia callbacks
-   */
-  static void
-  DataAvailable (void *data, DroidMediaCodecData * decoded)
-  {
-    DroidVideoDecoder *decoder = (DroidVideoDecoder *) data;
-    decoder->ProcessFrame (decoded);
-  }
-
-  static int
-  SizeChanged (void *data, int32_t width, int32_t height)
-  {
-    DroidVideoDecoder *decoder = (DroidVideoDecoder *) data;
-    LOG (INFO, "Received size changed " << width << " x " << height);
-    decoder->RequestNewConverter ();
-    return 0;
-  }
-
-  static void
-  DroidError (void *data, int err)
-  {
-    DroidVideoDecoder *decoder = (DroidVideoDecoder *) data;
-    LOG (ERROR, "Droidmedia error");
-    if (g_platform_api)
-      g_platform_api->runonmainthread (WrapTask (decoder,
-              &DroidVideoDecoder::Error, GMPDecodeErr));
-  }
-
-  static void
-  SignalEOS (void *data)
+  // Called on the main thread
+  void ResetComplete_m ()
   {
-    DroidVideoDecoder *decoder = (DroidVideoDecoder *) data;
-    decoder->EOS ();
+    m_nextOutputTs = -1;
+    m_resetting = false;
+    if (m_callback) {
+      m_callback->ResetComplete ();
+    }
   }
 
   GMPVideoHost *m_host;
   GMPVideoDecoderCallback *m_callback = nullptr;
-  GMPMutex *m_codec_lock = nullptr;
-  GMPThread *m_submit_thread = nullptr;
-  DroidMediaCodecDecoderMetaData m_metadata;
-  DroidMediaCodec *m_codec = nullptr;
-  DroidColourConvert *m_conv = nullptr;
-  bool m_dropConverter = false;
-  bool m_draining = false;
+  DroidDecoder *m_decoder;
+  // Main thread stage after the core decoder: convert and deliver
+  DroidStage m_convert { "decoder convert", DROID_STAGE_MAIN };
+  // Main thread only below
   bool m_resetting = false;
-  bool m_processing = false;
-  std::map <int64_t, uint64_t> m_dur;
+  int64_t m_nextOutputTs = -1;
+  uint64_t m_rateDroppedFrames = 0;
+  // Keyframe only scrub mode
+  bool m_scrub = false;
+  // A picture has been output since the last reset
+  bool m_seekLanded = false;
+  std::deque<int64_t> m_resetTimes;
+  std::vector<GMPVideoEncodedFrame *> m_retained;
+  uint64_t m_scrubSkippedFrames = 0;
+  // Burst decoding for playback
+  bool m_burst = false;
+  size_t m_burstHigh = 0;
+  size_t m_burstLow = 0;
+  // Input goes to the codec, otherwise it is held back
+  bool m_bursting = true;
+  // A frame has been output since start or the last reset
+  bool m_burstPrimed = false;
+  // Draining, buffering is suspended
+  bool m_flushing = false;
+  std::deque<GMPVideoi420Frame *> m_ready;
+  std::vector<GMPVideoEncodedFrame *> m_held;
+  uint64_t m_wakeups = 0;
+  uint64_t m_bursts = 0;
+  uint64_t m_burstFrames = 0;
+  uint64_t m_burstFramesSum = 0;
+  uint64_t m_burstFramesMax = 0;
+  size_t m_peakReady = 0;
+  int64_t m_idleSince = 0;
+  int64_t m_idleMs = 0;
 };
 
-class DroidVideoEncoder : public GMPVideoEncoder
+/*
+ * GMP encoder over the core encoder. Encoded packets are copied into GMP
+ * frames on the main thread.
+ */
+class DroidVideoEncoder : public GMPVideoEncoder, public DroidEncoderListener
 {
 public:
   explicit DroidVideoEncoder (GMPVideoHost * hostAPI)
-      : m_host (hostAPI)
+      : m_host (hostAPI), m_encoder (DroidEncoder::Create (this))
   {
-    GMPErr err = g_platform_api->createmutex (&m_stop_lock);
-    if (GMP_FAILED (err))
-        Error (err);
   }
 
   virtual ~DroidVideoEncoder ()
   {
-    m_stop_lock->Destroy ();
+    delete m_encoder;
   }
 
   void InitEncode (const GMPVideoCodec& codecSettings,
@@ -644,26 +747,18 @@ public:
         << " aNumberOfCores:" << aNumberOfCores
         << " aMaxPayloadSize:" << aMaxPayloadSize);
     m_callback = callback;
-
-    // Check if this device supports the codec we want
-    memset (&m_metadata, 0x0, sizeof (m_metadata));
-    m_metadata.parent.flags =
-        static_cast <DroidMediaCodecFlags> (DROID_MEDIA_CODEC_HW_ONLY);
-
     m_codecType = codecSettings.mCodecType;
 
+    DroidEncoderSettings settings;
     switch (m_codecType) {
       case kGMPVideoCodecVP8:
-        m_metadata.parent.type = "video/x-vnd.on2.vp8";
+        settings.codec = DROID_CODEC_VP8;
         break;
       case kGMPVideoCodecVP9:
-        m_metadata.parent.type = "video/x-vnd.on2.vp9";
+        settings.codec = DROID_CODEC_VP9;
         break;
       case kGMPVideoCodecH264:
-        m_metadata.parent.type = "video/avc";
-        // TODO: Some devices may not support this feature. A workaround is
-        // to save AVCC data and put it before every IDR manually.
-        m_metadata.codec_specific.h264.prepend_header_to_sync_frames = true;
+        settings.codec = DROID_CODEC_H264;
         break;
       default:
         LOG (ERROR, "Unknown GMP codec");
@@ -671,62 +766,39 @@ public:
         return;
     }
 
-    // Check that the requested encoder is actually available on this device
-    if (!droid_media_codec_is_supported (&m_metadata.parent, true)) {
-      LOG (ERROR, "Codec not supported: " << m_metadata.parent.type);
-      Error (GMPNotImplementedErr);
-      return;
+    switch (codecSettings.mMode) {
+      case kGMPRealtimeVideo:
+        settings.mode = DROID_ENCODER_REALTIME;
+        break;
+      case kGMPScreensharing:
+        settings.mode = DROID_ENCODER_SCREENSHARE;
+        break;
+      default:
+        settings.mode = DROID_ENCODER_RECORDING;
+        break;
     }
-    // Set codec parameters
-    m_metadata.parent.width = codecSettings.mWidth;
-    m_metadata.parent.height = codecSettings.mHeight;
 
-    if (codecSettings.mMaxFramerate) {
-      m_metadata.parent.fps = codecSettings.mMaxFramerate;
-    }
+    m_width = codecSettings.mWidth;
+    m_height = codecSettings.mHeight;
+    settings.width = codecSettings.mWidth;
+    settings.height = codecSettings.mHeight;
+    settings.fps = codecSettings.mMaxFramerate;
+    settings.bitrate = codecSettings.mStartBitrate;
+    settings.keyFrameInterval = codecSettings.mKeyFrameInterval;
 
-    m_bitrate = codecSettings.mStartBitrate < 100 ? 100 : codecSettings.mStartBitrate;
-    m_metadata.bitrate = m_bitrate * 1000;
-    m_metadata.stride = codecSettings.mWidth;
-    m_metadata.slice_height = codecSettings.mHeight;
-    m_metadata.meta_data = false;
-    m_metadata.bitrate_mode = DROID_MEDIA_CODEC_BITRATE_CONTROL_CBR;
-
-    droid_media_colour_format_constants_init (&m_constants);
-    m_metadata.color_format = -1;
-
-    {
-      uint32_t supportedFormats[32];
-      unsigned int nFormats = droid_media_codec_get_supported_color_formats (
-          &m_metadata.parent, 1, supportedFormats, 32);
-
-      LOG (INFO, "Found " << nFormats << " color formats supported:");
-      for (unsigned int i = 0; i < nFormats; i++) {
-        int fmt = static_cast<int>(supportedFormats[i]);
-        LOG (INFO, "  " << std::hex << fmt << std::dec);
-        // The list of formats is sorted in order of codec's preference,
-        // so pick the first one supported.
-        if (m_metadata.color_format == -1 &&
-            (fmt == m_constants.OMX_COLOR_FormatYUV420Planar ||
-             fmt == m_constants.OMX_COLOR_FormatYUV420SemiPlanar)) {
-          m_metadata.color_format = fmt;
-        }
-      }
-    }
+    // Gecko expects NAL lengths in native byte order
+    settings.nalLengthPrefix = true;
 
-    if (m_metadata.color_format == -1) {
-      LOG (ERROR, "No supported color format found");
-      Error (GMPNotImplementedErr);
-      return;
-    }
+    settings.coalesceKeyFrames = g_config.coalesceKeyFrames;
+    settings.denoiseStrength = g_config.denoiseStrength;
+    settings.denoiseThreshold = g_config.denoiseThreshold;
+    settings.qualityInterval = g_config.qualityInterval;
+    settings.gopParallel = g_config.gopParallel;
+    settings.sliceOutput = g_config.sliceOutput;
+    settings.cores = aNumberOfCores;
 
-    LOG (INFO,
-        "InitEncode: Codec metadata prepared: " << m_metadata.parent.type
-        << " width=" << m_metadata.parent.width
-        << " height=" << m_metadata.parent.height
-        << " fps=" << m_metadata.parent.fps
-        << " bitrate=" << m_metadata.bitrate
-        << " color_format=" << m_metadata.color_format);
+    if (!m_encoder->Init (settings))
+      Error (GMPNotImplementedErr);
   }
 
   void Encode (GMPVideoi420Frame* inputFrame,
@@ -742,54 +814,20 @@ public:
         << " frameTypesLength=" << frameTypesLength
         << " frameType[0]=" << frameTypes[0]);
 
-    DroidMediaCodecData data;
-    DroidMediaBufferCallbacks cb;
-
-    if (!m_codec && !CreateEncoder ()) {
-      LOG (ERROR, "Cannot create encoder");
-      return;
-    }
-
-    // Copy the frame to contiguous memory buffer
-    const unsigned y_size = inputFrame->Width() * inputFrame->Height();
-    const unsigned u_size = y_size / 4;
-    const unsigned v_size = y_size / 4;
-    uint8_t *buf;
-
-    LOG (DEBUG, "plane sizes: " << y_size
-        << " " << u_size
-        << " " << v_size
-        << " timestamp: " << inputFrame->Timestamp()
-        << " sync: " << (frameTypes[0] == kGMPKeyFrame));
-
-    buf = (uint8_t *)malloc (y_size + u_size + v_size);
-    data.data.data = buf;
-    data.data.size = y_size + u_size + v_size;
-
-    memcpy(buf, inputFrame->Buffer(kGMPYPlane), y_size);
-    buf += y_size;
-    if (m_metadata.color_format == m_constants.OMX_COLOR_FormatYUV420Planar) {
-      memcpy(buf, inputFrame->Buffer(kGMPUPlane), u_size);
-      buf += u_size;
-      memcpy(buf, inputFrame->Buffer(kGMPVPlane), v_size);
-    } else {
-      uint8_t *inpU = inputFrame->Buffer(kGMPUPlane);
-      uint8_t *inpV = inputFrame->Buffer(kGMPVPlane);
-      for (unsigned i = 0; i < u_size + v_size; i += 2) {
-        buf[i] = *inpU++;
-        buf[i + 1] = *inpV++;
-      }
+    DroidPicture picture;
+    for (int plane = 0; plane < 3; plane++) {
+      picture.planes.data[plane] = inputFrame->Buffer ((GMPPlaneType) plane);
+      picture.planes.stride[plane] = inputFrame->Stride ((GMPPlaneType) plane);
     }
+    picture.width = inputFrame->Width ();
+    picture.height = inputFrame->Height ();
+    picture.ts = inputFrame->Timestamp ();
+    picture.duration = inputFrame->Duration ();
+    picture.keyFrame = frameTypes[0] == kGMPKeyFrame;
+    picture.release = DestroyFrame;
+    picture.opaque = static_cast <GMPVideoFrame *> (inputFrame);
 
-    data.ts = inputFrame->Timestamp();
-    data.sync = frameTypes[0] == kGMPKeyFrame;
-
-    cb.unref = free;
-    cb.data = data.data.data;
-
-    droid_media_codec_queue (m_codec, &data, &cb);
-
-    inputFrame->Destroy();
+    m_encoder->Encode (picture);
   }
 
   void SetChannelParameters(uint32_t aPacketLoss, uint32_t aRTT)
@@ -800,183 +838,104 @@ public:
   void SetRates(uint32_t aNewBitRate, uint32_t aFrameRate)
   {
       LOG (INFO, "SetRates: newBitrate=" << aNewBitRate << " frameRate=" << aFrameRate);
-
-      if (aNewBitRate < 100) {
-        aNewBitRate = 100;
-        LOG (INFO, "newBitrate is too low, setting to " << aNewBitRate);
-      }
-
-      if (aNewBitRate != m_bitrate) {
-        m_bitrate = aNewBitRate;
-        droid_media_codec_set_video_encoder_bitrate(m_codec, m_bitrate * 1000);
-      }
+      m_encoder->SetRates (aNewBitRate);
   }
 
   void SetPeriodicKeyFrames(bool aEnable)
   {
       LOG (INFO, "SetPeriodicKeyFrames: enable=" << aEnable);
+      m_encoder->SetPeriodicKeyFrames (aEnable);
   }
 
+  // Output still queued for the main thread is dropped once the callback
+  // and host are cleared
   void EncodingComplete ()
   {
-    // Do not try to stop the codec if it is hanging in data_available()
-    m_stop_lock->Acquire();
-    m_stopping = true;
-    if (m_processing) {
-      // EncodingComplete() will be called from DataAvailable() later
-      m_stop_lock->Release();
-      return;
-    }
-    m_stop_lock->Release();
-
     LOG (INFO, "EncodingComplete");
-    if (m_codec) {
-      droid_media_codec_stop(m_codec);
-      droid_media_codec_destroy(m_codec);
-      LOG (INFO, "EncodingComplete: Codec destroyed");
-    }
-    m_stopping = false;
-    m_codec = nullptr;
+    m_callback = nullptr;
+    m_host = nullptr;
+    m_encoder->Stop ();
+    LOG (INFO, "  " << m_output.Stats ());
   }
 
+  // The callback is looked up on the main thread, as it is gone once
+  // EncodingComplete has been called
   void Error (GMPErr error)
   {
-    if (m_callback && g_platform_api) {
-      g_platform_api->runonmainthread (WrapTask (m_callback,
-              &GMPVideoEncoderCallback::Error, error));
+    if (g_platform_api) {
+      g_platform_api->runonmainthread (WrapTask (this,
+              &DroidVideoEncoder::Error_m, error));
     }
   }
 
-private:
-  GMPVideoHost *m_host;
-  GMPVideoEncoderCallback *m_callback = nullptr;
-  DroidMediaCodecEncoderMetaData m_metadata;
-  DroidMediaCodec *m_codec = nullptr;
-  GMPVideoCodecType m_codecType = kGMPVideoCodecInvalid;
-  GMPMutex *m_stop_lock = nullptr;
-  bool m_processing = false;
-  bool m_stopping = false;
-  DroidMediaColourFormatConstants m_constants;
-  uint32_t m_bitrate = 0;
-
-  bool CreateEncoder ()
+  // Called on the main thread
+  void Error_m (GMPErr error)
   {
-    m_codec = droid_media_codec_create_encoder (&m_metadata);
-
-    if (!m_codec) {
-      LOG (ERROR, "Failed to create the encoder");
-      Error (GMPEncodeErr);
-      return false;
-    }
-
-    LOG (INFO, "Codec created for " << m_metadata.parent.type);
-
-    {
-      DroidMediaCodecCallbacks cb;
-      memset(&cb, 0, sizeof(cb));
-      cb.error = DroidVideoEncoder::DroidError;
-      cb.signal_eos = DroidVideoEncoder::SignalEOS;
-      droid_media_codec_set_callbacks (m_codec, &cb, this);
-    }
-
-    {
-      DroidMediaCodecDataCallbacks cb;
-      memset(&cb, 0, sizeof(cb));
-      cb.data_available = DroidVideoEncoder::DataAvailableCallback;
-      droid_media_codec_set_data_callbacks (m_codec, &cb, this);
-    }
-
-    LOG (DEBUG, "Starting the encoder..");
-    int result = droid_media_codec_start (m_codec);
-    if (result == 0) {
-      droid_media_codec_stop (m_codec);
-      droid_media_codec_destroy (m_codec);
-      m_codec = nullptr;
-      LOG (ERROR, "Failed to start the encoder!");
-      Error (GMPEncodeErr);
-      return false;
-    }
-    LOG (DEBUG, "Encoder started");
-    return true;
+    if (m_callback)
+      m_callback->Error (error);
   }
 
-  // Called on a codec thread
-  static void DataAvailableCallback (void *data, DroidMediaCodecData* encoded)
+// DroidEncoderListener methods
+  // Called on a codec thread. The codec is not held up by the main thread,
+  // the packet is handed over and copied into a GMP frame there.
+  void Encoded (const DroidPacket & packet) override
   {
-    DroidVideoEncoder *encoder = (DroidVideoEncoder*) data;
-    encoder->DataAvailable (data, encoded);
+    if (m_output.Post (WrapTask (this, &DroidVideoEncoder::Encoded_m,
+                packet)) != GMPNoErr)
+      packet.Release ();
   }
 
-  // Called on a codec thread
-  void DataAvailable (void *data, DroidMediaCodecData* encoded)
+  void Error (DroidCoreError error) override
   {
-    m_stop_lock->Acquire();
-    if (m_stopping) {
-      LOG (ERROR, "DataAvailable() while m_stopping is set");
-      m_stop_lock->Release();
-      return;
-    }
-
-    m_processing = true;
-    m_stop_lock->Release();
-
-    if (g_platform_api)
-      g_platform_api->syncrunonmainthread (WrapTask (this,
-            &DroidVideoEncoder::FrameAvailable, encoded));
-
-    m_stop_lock->Acquire();
-    m_processing = false;
-    if (m_stopping && g_platform_api) {
-      // EncodingComplete() was called. Execute it on main thread.
-      g_platform_api->runonmainthread (WrapTask (this,
-              &DroidVideoEncoder::EncodingComplete));
-    }
-    m_stop_lock->Release();
+    Error (ToGMPErr (error));
   }
 
-  void FrameAvailable (DroidMediaCodecData* encoded)
+private:
+  // Called on the main thread
+  void Encoded_m (DroidPacket packet)
   {
-    LOG (DEBUG, "Received encoded frame of length " << encoded->data.size
-        << " ts " << encoded->ts
-        << " sync " << encoded->sync
-        << " codec_config " << encoded->codec_config);
+    if (!m_callback || !m_host) {
+      LOG (INFO, "Discarding encoded frame received after EncodingComplete");
+      packet.Release ();
+      return;
+    }
 
     GMPVideoFrame* tmpFrame;
     GMPErr err = m_host->CreateFrame (kGMPEncodedVideoFrame, &tmpFrame);
     if (err != GMPNoErr) {
       LOG (ERROR, "Cannot create frame");
+      packet.Release ();
       return;
     }
 
     GMPVideoEncodedFrame* frame = static_cast<GMPVideoEncodedFrame*> (tmpFrame);
-    err = frame->CreateEmptyFrame (encoded->data.size);
+    err = frame->CreateEmptyFrame (packet.size);
     if (err != GMPNoErr) {
       LOG (ERROR, "Cannot allocate memory");
       frame->Destroy();
+      packet.Release ();
       return;
     }
 
-    // Copy encoded data to the output frame
-    memcpy (frame->Buffer(), encoded->data.data, encoded->data.size);
+    memcpy (frame->Buffer(), packet.data, packet.size);
+    packet.Release ();
 
     GMPBufferType bufferType = GMP_BufferSingle;
 
-    frame->SetEncodedWidth (m_metadata.parent.width);
-    frame->SetEncodedHeight (m_metadata.parent.height);
-    frame->SetTimeStamp (encoded->ts / 1000); // Convert to usec
-    frame->SetCompleteFrame (true);
-    frame->SetFrameType (encoded->sync ? kGMPKeyFrame : kGMPDeltaFrame);
+    frame->SetEncodedWidth (m_width);
+    frame->SetEncodedHeight (m_height);
+    frame->SetTimeStamp (packet.ts);
+    frame->SetCompleteFrame (packet.complete);
+    frame->SetFrameType (packet.keyFrame ? kGMPKeyFrame : kGMPDeltaFrame);
 
     GMPCodecSpecificInfo info;
     memset (&info, 0, sizeof (info));
     info.mCodecType = m_codecType;
 
-    // Convert NAL Units. Gecko expects header in native byte order
+    // The core has replaced the start codes with 32-bit NAL lengths
     if (m_codecType == kGMPVideoCodecH264) {
-      bufferType = GMP_BufferLength32; // FIXME: Can it change?
+      bufferType = GMP_BufferLength32;
       info.mCodecSpecific.mH264.mSimulcastIdx = 0;
-
-      ConvertNalUnits (frame->Buffer(), encoded->data.size, bufferType);
     }
 
     frame->SetBufferType (bufferType);
@@ -985,84 +944,14 @@ private:
     m_callback->Encoded (frame, reinterpret_cast<uint8_t*> (&info), sizeof (info));
   }
 
-  static inline void UnalignedWrite32 (uint8_t *dest, uint32_t val)
-  {
-    dest[0] = val & 0xff;
-    dest[1] = (val >> 8) & 0xff;
-    dest[2] = (val >> 16) & 0xff;
-    dest[3] = (val >> 24) & 0xff;
-  }
-
-  static void ConvertNalUnits (uint8_t *buf, size_t bufSize, GMPBufferType bufferType)
-  {
-    const uint8_t nalStartCode[] = {0, 0, 0, 1};
-    uint8_t *p = buf, *end = buf + bufSize;
-    uint8_t *prevNalStart = NULL, *nalStart = NULL;
-    unsigned nalStartSize;
-
-    switch (bufferType) {
-      case GMP_BufferLength32:
-        nalStartSize = 4;
-        break;
-      case GMP_BufferLength24:
-        nalStartSize = 3;
-        break;
-      case GMP_BufferLength16:
-        nalStartSize = 2;
-        break;
-      case GMP_BufferLength8:
-        nalStartSize = 1;
-        break;
-      default:
-        return;
-    }
-
-    while (p < end) {
-      // NAL Unit start code found
-      if (0 == memcmp (p, nalStartCode + (4 - nalStartSize), nalStartSize)) {
-        prevNalStart = nalStart;
-        nalStart = p;
-        if (prevNalStart) {
-          unsigned nalSize = p - prevNalStart - nalStartSize;
-          UnalignedWrite32 (prevNalStart, nalSize);
-          LOG (DEBUG, "found nal size: " << nalSize << " at " << prevNalStart - buf);
-        }
-        // Skip NALU Start code;
-        p += nalStartSize;
-        // VCL units are the last NALUs in the encoded chunk
-        if ((p[0] & 0x1f) <= 5) {
-          break;
-        }
-      }
-      p += 1;
-    }
-    // Convert the last NALU
-    if (nalStart) {
-      unsigned nalSize = bufSize - (nalStart - buf) - nalStartSize;
-      UnalignedWrite32 (nalStart, nalSize);
-      LOG (DEBUG, "last nal size: " << nalSize << " at " << nalStart - buf);
-    }
-  }
-
-  static void SignalEOS (void *data)
-  {
-    DroidVideoEncoder *encoder = (DroidVideoEncoder *) data;
-    encoder->EOS ();
-  }
-
-  static void DroidError (void *data, int err)
-  {
-    DroidVideoEncoder *encoder = (DroidVideoEncoder *) data;
-    LOG (ERROR, "Droidmedia encoder error " << err);
-    if (g_platform_api)
-      g_platform_api->runonmainthread (WrapTask (encoder,
-            &DroidVideoEncoder::Error, GMPDecodeErr));
-  }
-
-  void EOS ()
-  {
-    LOG (INFO, "Encoder EOS");
-  }
+  GMPVideoHost *m_host;
+  GMPVideoEncoderCallback *m_callback = nullptr;
+  DroidEncoder *m_encoder;
+  // Main thread stage after the core encoder: copy to GMP frames
+  DroidStage m_output { "encoder output", DROID_STAGE_MAIN };
+  GMPVideoCodecType m_codecType = kGMPVideoCodecInvalid;
+  uint32_t m_width = 0;
+  uint32_t m_height = 0;
 };
 
 /*
@@ -1075,10 +964,26 @@ GMPErr GMPInit (GMPPlatformAPI * platformAPI)
 {
   LOG (DEBUG, "Initializing droidmedia!");
   g_platform_api = platformAPI;
-  if (droid_media_init ())
-    return GMPNoErr;
-  else
+  LoadConfig ();
+  DroidPipelineInit (platformAPI);
+
+  DroidCoreOptions options;
+  options.workers = g_config.workers;
+  options.blockingWorkers = g_config.blockingWorkers;
+  options.droidmedia = g_config.droidmedia;
+  options.quirksFile = g_config.quirksFile;
+  options.maxDecoders = g_config.maxDecoders;
+  options.maxEncoders = g_config.maxEncoders;
+  options.lockStats = g_config.lockStats;
+  options.historyFile = g_config.historyFile;
+  options.historyMaxBytes = g_config.historyMaxBytes;
+
+  std::string error;
+  if (!DroidCoreInit (options, error)) {
+    LOG (ERROR, "Couldn't load droidmedia: " << error);
     return GMPNotImplementedErr;
+  }
+  return GMPNoErr;
 }
 
 GMPErr GMPGetAPI (const char *apiName, void *hostAPI, void **pluginApi)
@@ -1096,7 +1001,7 @@ GMPErr GMPGetAPI (const char *apiName, void *hostAPI, void **pluginApi)
 void GMPShutdown (void)
 {
   LOG (DEBUG, "Shutting down droidmedia!");
-  droid_media_deinit ();
+  DroidCoreShutdown ();
   g_platform_api = nullptr;
 }
 
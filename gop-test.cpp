@@ -0,0 +1,143 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+// Output ordering of GOP parallel encoding, see gmp-droid-gop.h. Replays
+// output of two encoder instances as it could arrive and checks what
+// goes out.
+
+#include <cstdio>
+#include <vector>
+
+#include "gmp-droid-gop.h"
+
+using namespace std;
+
+static int g_failures = 0;
+static int g_released = 0;
+
+static void
+CountRelease (void *)
+{
+  g_released++;
+}
+
+// Frames of 1 ms at 0, 1000, 2000... usec, numbered by their index
+class Replay
+{
+public:
+  // Dispatch count frames, starting a GOP every gop frames
+  Replay (int count, int gop)
+  {
+    for (int i = 0; i < count; i++) {
+      bool sync = i % gop == 0;
+      m_instance.push_back (m_order.Dispatch (i * 1000, sync));
+    }
+  }
+
+  void Output (int frame)
+  {
+    DroidPacket packet;
+    packet.ts = frame * 1000;
+    packet.release = CountRelease;
+    vector<DroidPacket> ready;
+    m_order.Output (m_instance[frame], packet, ready);
+    Take (ready);
+  }
+
+  void Flush ()
+  {
+    vector<DroidPacket> ready;
+    m_order.Flush (ready);
+    Take (ready);
+  }
+
+  void Check (const char *name, const vector<int> & expected)
+  {
+    if (m_out == expected) {
+      printf ("PASS %s\n", name);
+      return;
+    }
+    printf ("FAIL %s: got", name);
+    for (int frame : m_out)
+      printf (" %d", frame);
+    printf (", expected");
+    for (int frame : expected)
+      printf (" %d", frame);
+    printf ("\n");
+    g_failures++;
+  }
+
+private:
+  void Take (const vector<DroidPacket> & ready)
+  {
+    for (const DroidPacket & packet : ready)
+      m_out.push_back (packet.ts / 1000);
+  }
+
+  DroidGopOrder m_order;
+  vector<int> m_instance;
+  vector<int> m_out;
+};
+
+int
+main ()
+{
+  {
+    // The instances run at their own pace. Output of the second GOP ahead
+    // of the end of the first must wait for it, not cut it short.
+    Replay replay (12, 3);
+    for (int frame : { 3, 0, 4, 5, 9, 1, 10, 2, 6, 11, 7, 8 })
+      replay.Output (frame);
+    replay.Check ("interleaved", { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 });
+  }
+
+  {
+    // B-frames come out of an instance after the later frame they refer to
+    Replay replay (8, 4);
+    for (int frame : { 0, 4, 2, 6, 1, 5, 3, 7 })
+      replay.Output (frame);
+    replay.Check ("reordered", { 0, 2, 1, 3, 4, 6, 5, 7 });
+  }
+
+  {
+    // A frame dropped by the first instance holds its GOP until that
+    // instance moves on to its next GOP
+    Replay replay (12, 3);
+    for (int frame : { 0, 3, 4, 5, 2 })
+      replay.Output (frame);
+    replay.Check ("dropped, held", { 0, 2 });
+    replay.Output (6);
+    replay.Check ("dropped", { 0, 2, 3, 4, 5, 6 });
+  }
+
+  {
+    // Output held at the end goes out in GOP order
+    Replay replay (12, 3);
+    for (int frame : { 3, 4, 9, 0, 10 })
+      replay.Output (frame);
+    replay.Flush ();
+    replay.Check ("flush", { 0, 3, 4, 9, 10 });
+  }
+
+  {
+    // Output of a GOP given up on is released
+    g_released = 0;
+    Replay replay (9, 3);
+    for (int frame : { 0, 2, 6, 3, 4, 5, 1 })
+      replay.Output (frame);
+    replay.Check ("late", { 0, 2, 3, 4, 5, 6 });
+    if (g_released != 1) {
+      printf ("FAIL late: %d packets released, expected 1\n", g_released);
+      g_failures++;
+    }
+  }
+
+  return g_failures ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+// Aggregates gmp-droid performance history files, see gmp-droid-history.h.
+// Sessions are grouped by device, codec kind, codec, resolution and
+// converter, with a row per OS build in the order the builds appear. A row
+// is flagged when its median fps or p99 latency is more than 20% worse
+// than the row above. CPU time is that of the whole plugin process, so
+// concurrent sessions count each other's work.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Fraction by which fps may fall or p99 latency rise before a row is
+// flagged
+#define REGRESSION_MARGIN 0.2
+
+typedef map<string, string> session_t;
+
+typedef struct {
+  string build;
+  vector<double> fps;
+  vector<double> p50;
+  vector<double> p99;
+  size_t sessions = 0;
+  double frames = 0;
+  double dropped = 0;
+  double errors = 0;
+  double processCpuMs = 0;
+  double peakRssKb = 0;
+} build_stats_t;
+
+typedef struct {
+  string name;
+  // Builds in the order they first appear
+  vector<build_stats_t> builds;
+} group_t;
+
+static session_t
+parseLine (const string& line)
+{
+  session_t session;
+  istringstream fields (line);
+  string field;
+
+  while (fields >> field) {
+    size_t eq = field.find ('=');
+    if (eq != string::npos)
+      session[field.substr (0, eq)] = field.substr (eq + 1);
+  }
+  return session;
+}
+
+static double
+number (const session_t& session, const char *key)
+{
+  session_t::const_iterator it = session.find (key);
+  return it == session.end () ? 0 : atof (it->second.c_str ());
+}
+
+static double
+median (vector<double> values)
+{
+  if (values.empty ())
+    return 0;
+  sort (values.begin (), values.end ());
+  return values[values.size () / 2];
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " HISTORY_FILE...\n"
+         << "Give rotated files first, e.g. history.log.1 history.log\n";
+    return 1;
+  }
+
+  vector<group_t> groups;
+  map<string, size_t> groupIndex;
+
+  for (int i = 1; i < argc; i++) {
+    ifstream file (argv[i]);
+    if (!file) {
+      cerr << "Can't open " << argv[i] << "\n";
+      continue;
+    }
+
+    string line;
+    while (getline (file, line)) {
+      session_t s = parseLine (line);
+      if (s.find ("kind") == s.end ())
+        continue;
+
+      const string name = s["device"] + " " + s["kind"] + " " + s["codec"]
+          + " " + s["size"] + " " + s["conv"];
+      if (groupIndex.find (name) == groupIndex.end ()) {
+        groupIndex[name] = groups.size ();
+        groups.push_back (group_t ());
+        groups.back ().name = name;
+      }
+      group_t& group = groups[groupIndex[name]];
+
+      vector<build_stats_t>::iterator b = find_if (group.builds.begin (),
+          group.builds.end (), [&s] (const build_stats_t& stats) {
+            return stats.build == s["build"];
+          });
+      if (b == group.builds.end ()) {
+        group.builds.push_back (build_stats_t ());
+        b = group.builds.end () - 1;
+        b->build = s["build"];
+      }
+
+      b->sessions++;
+      if (number (s, "frames") > 0) {
+        b->fps.push_back (number (s, "fps"));
+        b->p50.push_back (number (s, "p50_ms"));
+        b->p99.push_back (number (s, "p99_ms"));
+      }
+      b->frames += number (s, "frames");
+      b->dropped += number (s, "dropped");
+      b->errors += number (s, "errors");
+      // Older lines have the same value under cpu_ms
+      b->processCpuMs += number (s, "process_cpu_ms") + number (s, "cpu_ms");
+      b->peakRssKb = max (b->peakRssKb, number (s, "peak_rss_kb"));
+    }
+  }
+
+  for (const group_t& group : groups) {
+    cout << group.name << "\n";
+    printf ("  %-16s %8s %9s %8s %8s %8s %8s %6s %10s %10s\n", "build",
+        "sessions", "frames", "fps", "p50_ms", "p99_ms", "drop_pm", "errors",
+        "pcpu_ms/f", "rss_kb");
+
+    double prevFps = 0, prevP99 = 0;
+    for (const build_stats_t& b : group.builds) {
+      const double fps = median (b.fps);
+      const double p99 = median (b.p99);
+      const bool regressed =
+          (prevFps > 0 && fps < prevFps * (1 - REGRESSION_MARGIN))
+          || (prevP99 > 0 && p99 > prevP99 * (1 + REGRESSION_MARGIN));
+
+      printf ("%s %-16s %8zu %9.0f %8.1f %8.2f %8.2f %8.1f %6.0f %10.2f %10.0f\n",
+          regressed ? "!" : " ", b.build.c_str (), b.sessions, b.frames,
+          fps, median (b.p50), p99,
+          b.frames > 0 ? b.dropped * 1000 / b.frames : 0, b.errors,
+          b.frames > 0 ? b.processCpuMs / b.frames : 0, b.peakRssKb);
+
+      if (!b.fps.empty ()) {
+        prevFps = fps;
+        prevP99 = p99;
+      }
+    }
+    cout << "\n";
+  }
+  return 0;
+}
@@ -0,0 +1,124 @@
+/****************************************************************************
+**
+** Copyright (c) 2021 Open Mobile Platform LLC.
+**
+** This Source Code Form is subject to the terms of the
+** Mozilla Public License, v. 2.0. If a copy of the MPL was not distributed
+** with this file, You can obtain one at https://mozilla.org/MPL/2.0/.
+**
+****************************************************************************/
+
+// Encoder input packing throughput by band count, see gmp-droid-pack.h.
+// Usage: pack-benchmark [WIDTH HEIGHT [FRAMES [MAX_BANDS]]]
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <time.h>
+
+#include "gmp-droid-core.h"
+#include "gmp-droid-executor.h"
+#include "gmp-droid-pack.h"
+#include "gmp-task-utils.h"
+
+using namespace std;
+
+// Counts the pictures the packer has handed on
+class Completion
+{
+public:
+  void Done ()
+  {
+    lock_guard<mutex> guard (m_lock);
+    m_done++;
+    m_cond.notify_one ();
+  }
+
+  void Wait (int count)
+  {
+    unique_lock<mutex> guard (m_lock);
+    m_cond.wait (guard, [&] { return m_done >= count; });
+  }
+
+private:
+  mutex m_lock;
+  condition_variable m_cond;
+  int m_done = 0;
+};
+
+static double
+nowMs ()
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+int
+main (int argc, char **argv)
+{
+  const int32_t width = argc > 2 ? atoi (argv[1]) : 3840;
+  const int32_t height = argc > 2 ? atoi (argv[2]) : 2160;
+  const int frames = argc > 3 ? atoi (argv[3]) : 60;
+  const int maxBands = argc > 4 ? atoi (argv[4])
+      : max (1u, thread::hardware_concurrency ());
+
+  // Gecko hands over planes with padded strides
+  const int32_t strides[3] = { width + 64, width / 2 + 32, width / 2 + 32 };
+  vector<uint8_t> y ((size_t) strides[0] * height, 16);
+  vector<uint8_t> u ((size_t) strides[1] * (height / 2), 128);
+  vector<uint8_t> v ((size_t) strides[2] * (height / 2), 128);
+  vector<uint8_t> out ((size_t) width * height * 3 / 2);
+
+  DroidPicture picture;
+  picture.planes.data[0] = y.data ();
+  picture.planes.data[1] = u.data ();
+  picture.planes.data[2] = v.data ();
+  for (int plane = 0; plane < 3; plane++)
+    picture.planes.stride[plane] = strides[plane];
+  picture.width = width;
+  picture.height = height;
+
+  DroidExecutor::Init (maxBands, 1);
+
+  printf ("%dx%d, %d frames\n", width, height, frames);
+  printf ("%-6s %-6s %10s %10s %8s\n", "layout", "bands", "ms/frame",
+      "MB/s", "speedup");
+
+  for (int semiPlanar = 0; semiPlanar < 2; semiPlanar++) {
+    double single = 0;
+    for (int bands = 1; bands <= maxBands; bands++) {
+      DroidPackBands packer (bands);
+      Completion completion;
+      // Warm up caches and the strands
+      packer.Pack (picture, out.data (), semiPlanar,
+          WrapTask (&completion, &Completion::Done));
+      completion.Wait (1);
+
+      // One picture at a time, as each is written to the same buffer
+      const double start = nowMs ();
+      for (int i = 0; i < frames; i++) {
+        if (bands == 1) {
+          DroidPackRows (picture, out.data (), semiPlanar, 0, height);
+        } else {
+          packer.Pack (picture, out.data (), semiPlanar,
+              WrapTask (&completion, &Completion::Done));
+          completion.Wait (i + 2);
+        }
+      }
+      const double perFrame = (nowMs () - start) / frames;
+      if (bands == 1)
+        single = perFrame;
+
+      printf ("%-6s %-6d %10.2f %10.0f %8.2f\n",
+          semiPlanar ? "NV12" : "I420", packer.Bands (), perFrame,
+          out.size () / perFrame / 1000.0, single / perFrame);
+    }
+  }
+
+  DroidExecutor::Shutdown ();
+  return 0;
+}
@@ -17,6 +17,14 @@ Requires:  oneshot
 %description
 Gecko Media Plugin for droidmedia codec support in Gecko based browsers
 
+%package devel
+Summary:    Development files for the gmp-droid codec core
+Requires:   %{name} = %{version}-%{release}
+
+%description devel
+Headers and pkg-config file for building native applications against the
+gmp-droid hardware codec core.
+
 %prep
 %setup -q
 
@@ -34,16 +42,31 @@ mkdir -p $RPM_BUILD_ROOT/%{_sharedstatedir}/environment/nemo/
 echo "MOZ_GMP_PATH=\"%{_libdir}/%{name}/0.1/\"" > %{buildroot}/%{_sharedstatedir}/environment/nemo/70-browser-gmp.conf
 
 %post
+/sbin/ldconfig
 # Query device codec support and write out the droid.info file. On imager this should postpone until first boot.
 %{_bindir}/add-oneshot gmp-generate-info.sh
 
+%postun -p /sbin/ldconfig
+
 %files
 %defattr(-,root,root,-)
 %license LICENSE
 %dir %{_libdir}/%{name}
 %dir %{_libdir}/%{name}/0.1
 %{_libdir}/%{name}/0.1/libdroid.so
+%{_libdir}/libgmpdroid-core.so.*
 %ghost %{_libdir}/%{name}/0.1/droid.info
 %{_libdir}/%{name}/0.1/generate-info
+%{_bindir}/gmp-droid-history
+%{_bindir}/droid-transcode
+%dir %{_sysconfdir}/%{name}
+%config(noreplace) %{_sysconfdir}/%{name}/quirks.conf
 %{_oneshotdir}/gmp-generate-info.sh
 %{_sharedstatedir}/environment/nemo/70-browser-gmp.conf
+
+
+%files devel
+%defattr(-,root,root,-)
+%{_includedir}/gmp-droid/gmp-droid-core.h
+%{_libdir}/libgmpdroid-core.so
+%{_libdir}/pkgconfig/gmpdroid-core.pc